@@ -0,0 +1,225 @@
+#include "CommandProtocol.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace CommandProtocol
+{
+    static const char* const commandNames[COMMAND_COUNT] = {
+            "Init",
+            "MergeGroups",
+            "AddPlayer",
+            "RemovePlayer",
+            "IncreasePlayerIDLevel",
+            "ChangePlayerIDScore",
+            "GetPercentOfPlayersWithScoreInBounds",
+            "AverageHighestPlayerLevelByGroup",
+            "GetPlayersBound",
+            "Quit" };
+
+    static const int commandArgCounts[COMMAND_COUNT] = { 2, 2, 3, 1, 2, 2, 4, 2, 3, 0 };
+
+    const char* commandName(int code)
+    {
+        return code >= 0 && code < COMMAND_COUNT ? commandNames[code] : "";
+    }
+
+    int argCount(int code)
+    {
+        return code >= 0 && code < COMMAND_COUNT ? commandArgCounts[code] : 0;
+    }
+
+    const char* statusName(int status)
+    {
+        switch (status)
+        {
+            case SUCCESS:
+                return "SUCCESS";
+            case ALLOCATION_ERROR:
+                return "ALLOCATION_ERROR";
+            case FAILURE:
+                return "FAILURE";
+            case INVALID_INPUT:
+                return "INVALID_INPUT";
+            default:
+                return "";
+        }
+    }
+
+    ParseResult parseTextLine(const char* line, BinaryCommand* command)
+    {
+        if (line == nullptr || line[0] == '\0' || line[0] == '\n')
+        {
+            return MALFORMED;
+        }
+        if (line[0] == '#')
+        {
+            return SKIPPED;
+        }
+
+        //Same prefix matching as main2.cpp's CheckCommand.
+        int code = -1;
+        for (int i = 0; i < COMMAND_COUNT; ++i)
+        {
+            std::size_t length = std::strlen(commandNames[i]);
+            if (std::strncmp(commandNames[i], line, length) == 0)
+            {
+                code = i;
+                line += length;
+                break;
+            }
+        }
+        if (code < 0)
+        {
+            return MALFORMED;
+        }
+
+        command->code = code;
+        for (int i = 0; i < maxArgs; ++i)
+        {
+            command->args[i] = 0;
+        }
+        for (int i = 0; i < commandArgCounts[code]; ++i)
+        {
+            char* end;
+            long value = std::strtol(line, &end, 10);
+            if (end == line)
+            {
+                return MALFORMED;
+            }
+            command->args[i] = (int32_t)value;
+            line = end;
+        }
+        return PARSED;
+    }
+
+    bool readHeader(FILE* stream, uint32_t expectedMagic)
+    {
+        TraceHeader header;
+        if (std::fread(&header, sizeof(header), 1, stream) != 1)
+        {
+            return false;
+        }
+        return header.magic == expectedMagic && header.version == version;
+    }
+
+    void writeHeader(FILE* stream, uint32_t magic)
+    {
+        TraceHeader header = { magic, version };
+        std::fwrite(&header, sizeof(header), 1, stream);
+    }
+
+    int executeBatch(void** DS, const BinaryCommand* commands, int count, BinaryResult* results)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            const int32_t* args = commands[i].args;
+            BinaryResult& result = results[i];
+            result.code = commands[i].code;
+            result.status = SUCCESS;
+            result.value = 0;
+
+            switch (commands[i].code)
+            {
+                case INIT:
+                    if (*DS != nullptr)
+                    {
+                        result.status = FAILURE; //Already initialized.
+                        break;
+                    }
+                    *DS = Init(args[0], args[1]);
+                    if (*DS == nullptr)
+                    {
+                        result.status = ALLOCATION_ERROR;
+                        return i + 1;
+                    }
+                    break;
+                case MERGE_GROUPS:
+                    result.status = MergeGroups(*DS, args[0], args[1]);
+                    break;
+                case ADD_PLAYER:
+                    result.status = AddPlayer(*DS, args[0], args[1], args[2]);
+                    break;
+                case REMOVE_PLAYER:
+                    result.status = RemovePlayer(*DS, args[0]);
+                    break;
+                case INCREASE_PLAYER_ID_LEVEL:
+                    result.status = IncreasePlayerIDLevel(*DS, args[0], args[1]);
+                    break;
+                case CHANGE_PLAYER_ID_SCORE:
+                    result.status = ChangePlayerIDScore(*DS, args[0], args[1]);
+                    break;
+                case GET_PERCENT_OF_PLAYERS_WITH_SCORE_IN_BOUNDS:
+                    result.status = GetPercentOfPlayersWithScoreInBounds(*DS, args[0], args[1], args[2], args[3],
+                                                                         &result.value);
+                    break;
+                case AVERAGE_HIGHEST_PLAYER_LEVEL_BY_GROUP:
+                    result.status = AverageHighestPlayerLevelByGroup(*DS, args[0], args[1], &result.value);
+                    break;
+                case GET_PLAYERS_BOUND:
+                    result.status = GetPlayersBound(*DS, args[0], args[1], args[2],
+                                                    &result.bounds[0], &result.bounds[1]);
+                    break;
+                case QUIT:
+                    Quit(DS);
+                    if (*DS != nullptr)
+                    {
+                        result.status = FAILURE;
+                        return i + 1;
+                    }
+                    break;
+                default:
+                    result.status = INVALID_INPUT;
+                    return i + 1;
+            }
+        }
+        return count;
+    }
+
+    bool isFatal(const BinaryResult& result)
+    {
+        switch (result.code)
+        {
+            case INIT:
+                return result.status == ALLOCATION_ERROR; //FAILURE is "already called", which goes on.
+            case QUIT:
+                return result.status != SUCCESS;
+            default:
+                return result.code < 0 || result.code >= COMMAND_COUNT;
+        }
+    }
+
+    void writeTextResult(OutputWriter& output, const BinaryResult& result)
+    {
+        switch (result.code)
+        {
+            case INIT:
+                output.write(result.status == SUCCESS ? "Init done."
+                        : result.status == FAILURE ? "Init was already called." : "Init failed.");
+                break;
+            case QUIT:
+                output.write(result.status == SUCCESS ? "Quit done." : "Quit failed.");
+                break;
+            default:
+                output.write(commandName(result.code)).write(": ");
+                if (result.status != SUCCESS)
+                {
+                    output.write(statusName(result.status));
+                }
+                else if (result.code == GET_PERCENT_OF_PLAYERS_WITH_SCORE_IN_BOUNDS
+                         || result.code == AVERAGE_HIGHEST_PLAYER_LEVEL_BY_GROUP)
+                {
+                    output.writeFixed(result.value, 2);
+                }
+                else if (result.code == GET_PLAYERS_BOUND)
+                {
+                    output.writeInt(result.bounds[0]).writeChar(' ').writeInt(result.bounds[1]);
+                }
+                else
+                {
+                    output.write(statusName(result.status));
+                }
+        }
+        output.endLine();
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef COMMAND_PROTOCOL_H
+#define COMMAND_PROTOCOL_H
+
+#include "library2.h"
+#include "OutputWriter.hpp"
+#include <cstdint>
+#include <cstdio>
+
+/*
+ * Fixed-width binary encoding of the driver's commands (see main2.cpp for the text format).
+ *
+ * A binary trace is a TraceHeader followed by BinaryCommand records, all in host byte order.
+ * Result streams are a TraceHeader (with resultsMagic) followed by BinaryResult records.
+ * Comment lines of the text format have no binary counterpart and are dropped.
+ */
+namespace CommandProtocol
+{
+    enum CommandCode
+    {
+        INIT = 0,
+        MERGE_GROUPS = 1,
+        ADD_PLAYER = 2,
+        REMOVE_PLAYER = 3,
+        INCREASE_PLAYER_ID_LEVEL = 4,
+        CHANGE_PLAYER_ID_SCORE = 5,
+        GET_PERCENT_OF_PLAYERS_WITH_SCORE_IN_BOUNDS = 6,
+        AVERAGE_HIGHEST_PLAYER_LEVEL_BY_GROUP = 7,
+        GET_PLAYERS_BOUND = 8,
+        QUIT = 9,
+        COMMAND_COUNT = 10
+    };
+
+    const uint32_t commandsMagic = 0x42435347; //"GSCB" read as little endian.
+    const uint32_t resultsMagic = 0x52435347; //"GSCR"
+    const uint32_t version = 1;
+    const int maxArgs = 4;
+
+    struct TraceHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+    };
+
+    //Arguments are in the same order as the text command; unused ones are zero.
+    struct BinaryCommand
+    {
+        int32_t code;
+        int32_t args[maxArgs];
+    };
+
+    struct BinaryResult
+    {
+        int32_t code;
+        int32_t status; //A StatusType.
+        union
+        {
+            double value; //GetPercentOfPlayersWithScoreInBounds, AverageHighestPlayerLevelByGroup.
+            int32_t bounds[2]; //GetPlayersBound.
+        };
+    };
+
+    const char* commandName(int code);
+
+    //Number of arguments the given command takes.
+    int argCount(int code);
+
+    const char* statusName(int status);
+
+    enum ParseResult { PARSED, SKIPPED, MALFORMED };
+
+    /*
+     * Parses one line of the text format. Comments are SKIPPED; blank lines, unknown commands
+     * and missing arguments are MALFORMED (which is where main2.cpp stops reading).
+     */
+    ParseResult parseTextLine(const char* line, BinaryCommand* command);
+
+    bool readHeader(FILE* stream, uint32_t expectedMagic);
+
+    void writeHeader(FILE* stream, uint32_t magic);
+
+    /*
+     * Replays commands straight into library2, in order, filling one BinaryResult per command.
+     * DS is the current data structure handle (Init and Quit update it).
+     * Returns how many commands were executed; it stops early after a command that would have
+     * stopped the text driver (a failed Init or Quit).
+     */
+    int executeBatch(void** DS, const BinaryCommand* commands, int count, BinaryResult* results);
+
+    //Whether the text driver would stop reading after this result: a failed Init or Quit, or an unknown command.
+    bool isFatal(const BinaryResult& result);
+
+    //Writes a result exactly the way main2.cpp prints it.
+    void writeTextResult(OutputWriter& output, const BinaryResult& result);
+}
+
+#endif //COMMAND_PROTOCOL_H
@@ -1,12 +1,52 @@
 #include "GameSystem.hpp"
+#include "WorkStealingPool.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <new>
+#include <vector>
+
+//The StatusType an action ends with, as library2's wrappers would report it.
+template <class A>
+static StatusType statusOf(A action)
+{
+    try
+    {
+        action();
+        return SUCCESS;
+    }
+    catch (Failure& exc)
+    {
+        return FAILURE;
+    }
+    catch (std::bad_alloc& exc)
+    {
+        return ALLOCATION_ERROR;
+    }
+    catch (AllocationError& exc)
+    {
+        return ALLOCATION_ERROR;
+    }
+    catch (InvalidInput& exc)
+    {
+        return INVALID_INPUT;
+    }
+}
 
 void GameSystem::mergeGroups(int id1, int id2)
 {
     players_by_level.assertDebug();
-    if (id1 <= 0 || id2 <= 0)
+    if (id1 <= 0 || id2 <= 0 || id1 > k || id2 > k)
     {
         throw InvalidInput("Invalid input to mergeGroups.");
     }
+    if (inTransaction)
+    {
+        queuedPairs.push_back(id1);
+        queuedPairs.push_back(id2);
+        queueUpdate(Update::MERGE_GROUPS, (int)queuedPairs.size() - 2, 1);
+        return;
+    }
 
     if (id1 == id2)
     {
@@ -14,17 +54,204 @@ void GameSystem::mergeGroups(int id1, int id2)
         //TODO: CHECK if this is considered a failure or a success.
     }
 
-    groups.uniteGroups(id1, id2);
+    int root1 = groups.findGroupId(id1), root2 = groups.findGroupId(id2);
+    const Group *first = &groups.findGroup(root1), *second = &groups.findGroup(root2);
+    const Group& merged = groups.uniteGroups(root1, root2);
+    if (first == second)
+    {
+        return;
+    }
+    if (&merged == first)
+    {
+        players.spliceList(root2, root1);
+    }
+    else
+    {
+        players.spliceList(root1, root2);
+    }
+    if (!trackingMembership)
+    {
+        return;
+    }
+
+    //Every level of the absorbed group is now a level of the merged one.
+    const Group* absorbed = &merged == first ? second : first;
+    auto splice = [&](int level, int inThisLevel)
+    {
+        membership.spliceGroup(absorbed, &merged, level);
+        return true;
+    };
+    try
+    {
+        merged.getPlayers()[0]->forEachLevelDescending(splice);
+        splice(0, 0);
+    }
+    catch (...)
+    {
+        stopTrackingMembership(); //The groups are merged all the same.
+    }
+}
+
+void GameSystem::mergeGroupsBatch(const int* pairs, int n)
+{
+    players_by_level.assertDebug();
+    if ((pairs == nullptr && n > 0) || n < 0)
+    {
+        throw InvalidInput("Invalid input to mergeGroupsBatch.");
+    }
+    for (int i = 0; i < 2 * n; ++i)
+    {
+        if (pairs[i] <= 0 || pairs[i] > k)
+        {
+            throw InvalidInput("Invalid input to mergeGroupsBatch.");
+        }
+    }
+    if (inTransaction)
+    {
+        if (n > 0)
+        {
+            queuedPairs.insert(queuedPairs.end(), pairs, pairs + 2 * n);
+            queueUpdate(Update::MERGE_GROUPS, (int)queuedPairs.size() - 2 * n, n);
+        }
+        return;
+    }
+    uniteGroups(pairs, n, nullptr);
+}
+
+void GameSystem::uniteGroups(const int* pairs, int n, std::vector<SumTree*>* replaced)
+{
+    //The absorbed group's levels are still in its own tree at this point.
+    auto spliceLevels = [&](const Group& absorbed, const Group& into, int absorbedId, int intoId)
+    {
+        if (!trackingMembership) return;
+        auto spliceLevel = [&](int level, int inThisLevel)
+        {
+            membership.spliceGroup(&absorbed, &into, level);
+            return true;
+        };
+        try
+        {
+            absorbed.getPlayers()[0]->forEachLevelDescending(spliceLevel);
+            spliceLevel(0, 0);
+        }
+        catch (...)
+        {
+            stopTrackingMembership();
+        }
+    };
+    auto spliceList = [&](int absorbedId, int intoId)
+    {
+        players.spliceList(absorbedId, intoId);
+    };
+    try
+    {
+        groups.uniteGroups(pairs, n, spliceLevels, spliceList, replaced);
+    }
+    catch (...)
+    {
+        //The levels of a set that failed to merge may have gone over already.
+        stopTrackingMembership();
+        throw;
+    }
+}
+
+int GameSystem::getMergeCheckpoint() const
+{
+    return groups.getUnionCount();
+}
+
+void GameSystem::rollbackMerges(int checkpoint)
+{
+    players_by_level.assertDebug();
+    if (checkpoint < 0)
+    {
+        throw InvalidInput("Invalid input to rollbackMerges.");
+    }
+    if (inTransaction)
+    {
+        throw Failure("rollbackMerges: not within a transaction.");
+    }
+    if (checkpoint > groups.getUnionCount())
+    {
+        throw Failure("rollbackMerges: no such checkpoint.");
+    }
+
+    while (groups.getUnionCount() > checkpoint)
+    {
+        splitLastUnion();
+    }
+}
+
+/*
+ * The players go back by the group they were added to: those whose group ID leads to the absorbed root
+ * once the union is undone. They are picked off the merged group's list in O(its size), added to a group
+ * on the side, and taken off the merged one in one subtractGroup; only then does the absorbed group take
+ * the side one's trees. Until that point a failure puts the union back, and nothing else has changed.
+ */
+void GameSystem::splitLastUnion()
+{
+    int into, absorbed = groups.undoUnion(&into);
+    Group &merged = groups.findGroup(into), &split = groups.findGroup(absorbed);
+    auto leaves = [&](const Player& player)
+    {
+        return groups.findGroupId(player.getGroupId()) == absorbed;
+    };
+    try
+    {
+        Group part(scale);
+        auto add = [&](const Player& player)
+        {
+            if (leaves(player))
+            {
+                part.addPlayer(player);
+            }
+        };
+        players.forEachInList(into, add);
+        merged.subtractGroup(part);
+        split.swapTrees(part); //The absorbed group's old (merged away) trees go with part.
+    }
+    catch (...)
+    {
+        groups.redoUnion(absorbed, into);
+        throw;
+    }
+
+    players.splitList(into, absorbed, leaves);
+    if (!trackingMembership)
+    {
+        return;
+    }
+    auto move = [&](const Player& player)
+    {
+        membership.moveGroup(player, &merged, &split);
+    };
+    try
+    {
+        players.forEachInList(absorbed, move);
+    }
+    catch (...)
+    {
+        stopTrackingMembership();
+    }
 }
 
 void GameSystem::addPlayer(int playerId, int groupId, int score)
 {
     players_by_level.assertDebug();
+    if (inTransaction)
+    {
+        if (playerId <= 0 || groupId <= 0 || groupId > k || score <= 0 || score > scale)
+        {
+            throw InvalidInput("Invalid input to addPlayer.");
+        }
+        queueUpdate(Update::ADD_PLAYER, playerId, groupId, score);
+        return;
+    }
     Player p(playerId, groupId, score);
     addPlayer(p);
 }
 
-void GameSystem::addPlayer(const Player& player)
+void GameSystem::addPlayer(const Player& player, bool reserved)
 {
     players_by_level.assertDebug();
     if (player.getPlayerId() <= 0 || player.getScore() <= 0 || player.getScore() > scale)
@@ -32,11 +259,99 @@ void GameSystem::addPlayer(const Player& player)
         throw InvalidInput("Invalid input to addPlayer.");
     }
 
-    Group& group = groups.findGroup(player.getGroupId()); //This also ensures the group exists.
+    int root = groups.findGroupId(player.getGroupId()); //This also ensures the group exists.
+    Group& group = groups.findGroup(root);
+
+    if (reserved)
+    {
+        players.insert(player, root);
+    }
+    else
+    {
+        //The trees' room is had first, so that only the insertion may fail after it (changing nothing).
+        reserveUpdates(group, player, 1, 0);
+        try
+        {
+            players.insert(player, root);
+        }
+        catch (...)
+        {
+            releaseUpdates(group, player, 1, 0);
+            throw;
+        }
+    }
+    group.addPlayer(player, true);
+    players_by_level.addPlayer(player, true);
+    if (trackingMembership)
+    {
+        try
+        {
+            membership.add(player, &group, &players_by_level);
+        }
+        catch (...)
+        {
+            stopTrackingMembership();
+        }
+    }
+}
+
+void GameSystem::reserveUpdates(Group& group, const Player& player, int additions, int removals)
+{
+    group.reserveUpdates(player, additions, removals);
+    try
+    {
+        players_by_level.reserveUpdates(player, additions, removals);
+    }
+    catch (...)
+    {
+        group.releaseUpdates(player, additions, removals);
+        throw;
+    }
+}
+
+void GameSystem::releaseUpdates(Group& group, const Player& player, int additions, int removals)
+{
+    group.releaseUpdates(player, additions, removals);
+    players_by_level.releaseUpdates(player, additions, removals);
+}
+
+void GameSystem::updatePlayer(const Player& updated, bool reserved)
+{
+    Player old = players.search(updated.getPlayerId());
+    Group& group = groups.findGroup(old.getGroupId());
+
+    if (!reserved)
+    {
+        reserveUpdates(group, updated, 1, 0);
+        try
+        {
+            reserveUpdates(group, old, 0, 1);
+        }
+        catch (...)
+        {
+            releaseUpdates(group, updated, 1, 0);
+            throw;
+        }
+    }
 
-    players.insert(player);
-    group.addPlayer(player);
-    players_by_level.addPlayer(player);
+    //Nothing below throws.
+    group.addPlayer(updated, true);
+    players_by_level.addPlayer(updated, true);
+    group.removePlayer(old, true);
+    players_by_level.removePlayer(old, true);
+    players.update(updated);
+    if (trackingMembership)
+    {
+        try
+        {
+            membership.remove(old, &group, &players_by_level);
+            membership.add(updated, &group, &players_by_level);
+        }
+        catch (...)
+        {
+            stopTrackingMembership();
+        }
+    }
 }
 
 void GameSystem::removePlayer(int playerId)
@@ -46,13 +361,91 @@ void GameSystem::removePlayer(int playerId)
     {
         throw InvalidInput("Invalid input to removePlayer.");
     }
+    if (queueUpdate(Update::REMOVE_PLAYER, playerId))
+    {
+        return;
+    }
+    removePlayer(players.search(playerId), false);
+}
 
-    const Player& p = players.search(playerId);
-    groups.findGroup(p.getGroupId()).removePlayer(p);
-    players_by_level.removePlayer(p);
+void GameSystem::removePlayer(const Player& p, bool reserved)
+{
+    Group& group = groups.findGroup(p.getGroupId());
+    if (!reserved)
+    {
+        reserveUpdates(group, p, 0, 1); //Allocates only while a snapshot shares the trees.
+    }
+    group.removePlayer(p, true);
+    players_by_level.removePlayer(p, true);
+    if (trackingMembership)
+    {
+        try
+        {
+            membership.remove(p, &group, &players_by_level);
+        }
+        catch (...)
+        {
+            stopTrackingMembership();
+        }
+    }
     players.remove(p.getPlayerId());
 }
 
+/*
+ * Takes the group's players off players_by_level in one go (a linear difference of the trees, or player
+ * by player for a group that is small next to them), then drops the group's trees and the players'
+ * entries, found through the group's list. The group stays, empty; its ID keeps leading to it.
+ * Whatever may fail is done before the first change, so a failure leaves everything as it was.
+ */
+void GameSystem::removeAllPlayersInGroup(int groupId)
+{
+    players_by_level.assertDebug();
+    if (groupId <= 0 || groupId > k)
+    {
+        throw InvalidInput("Invalid input to removeAllPlayersInGroup.");
+    }
+    if (queueUpdate(Update::REMOVE_ALL_PLAYERS, groupId))
+    {
+        return;
+    }
+    emptyGroup(groups.findGroupId(groupId), nullptr);
+}
+
+void GameSystem::emptyGroup(int root, std::vector<SumTree*>* replaced)
+{
+    Group& group = groups.findGroup(root);
+    std::vector<SumTree*> fresh = group.makeEmptyTrees();
+    try
+    {
+        Group::reserveReplaced(replaced, 2 * (scale + 1)); //players_by_level's trees (if rebuilt) and the group's.
+        players_by_level.subtractGroup(group, replaced); //Changes nothing if it fails.
+    }
+    catch (...)
+    {
+        for (SumTree* tree : fresh) delete tree;
+        throw;
+    }
+
+    //Nothing below throws.
+    if (trackingMembership)
+    {
+        auto forget = [&](const Player& player)
+        {
+            membership.remove(player, &group, &players_by_level);
+        };
+        try
+        {
+            players.forEachInList(root, forget);
+        }
+        catch (...)
+        {
+            stopTrackingMembership();
+        }
+    }
+    group.clear(fresh, replaced);
+    players.removeList(root);
+}
+
 void GameSystem::increasePlayerIDLevel(int playerId, int levelIncrease)
 {
     players_by_level.assertDebug();
@@ -60,11 +453,14 @@ void GameSystem::increasePlayerIDLevel(int playerId, int levelIncrease)
     {
         throw InvalidInput("Invalid input to increasePlayerIDLevel.");
     }
+    if (queueUpdate(Update::INCREASE_LEVEL, playerId, levelIncrease))
+    {
+        return;
+    }
 
     Player player = players.search(playerId);
     player.setLevel(player.getLevel() + levelIncrease);
-    removePlayer(playerId);
-    addPlayer(player);
+    updatePlayer(player);
 }
 
 void GameSystem::changePlayerIDScore(int playerId, int newScore)
@@ -74,11 +470,314 @@ void GameSystem::changePlayerIDScore(int playerId, int newScore)
     {
         throw InvalidInput("Invalid input to changePlayerIDScore.");
     }
+    if (queueUpdate(Update::CHANGE_SCORE, playerId, newScore))
+    {
+        return;
+    }
 
     Player p = players.search(playerId), modified(p.getPlayerId(), p.getGroupId(), newScore);
     modified.setLevel(p.getLevel());
-    removePlayer(playerId);
-    addPlayer(modified);
+    updatePlayer(modified);
+}
+
+bool GameSystem::queueUpdate(Update::Kind kind, int id, int arg0, int arg1)
+{
+    if (!inTransaction)
+    {
+        return false;
+    }
+    Update update = { kind, id, { arg0, arg1 } };
+    queued.push_back(update);
+    return true;
+}
+
+void GameSystem::beginTransaction()
+{
+    players_by_level.assertDebug();
+    if (inTransaction)
+    {
+        throw Failure("beginTransaction: a transaction is already open.");
+    }
+    inTransaction = true;
+}
+
+void GameSystem::abortTransaction()
+{
+    players_by_level.assertDebug();
+    if (!inTransaction)
+    {
+        throw Failure("abortTransaction: no transaction is open.");
+    }
+    queued.clear();
+    queuedPairs.clear();
+    inTransaction = false;
+}
+
+/*
+ * Applies the queued updates in order, with two shortcuts. A run of player updates is sorted by player
+ * (stably, so each player's own stay in order) and each player's are folded into the one change they
+ * make: a player updated many times is taken out of the trees and put back once. A run of merges is one
+ * mergeGroupsBatch. Each step changes nothing when it fails (a player's change, each set of a batch, an
+ * emptied group) and is logged with what taking it back needs, had before it is made: the room in the trees
+ * and the table for a player's way back, the trees that merges and emptied groups replace (kept instead of
+ * released). If one fails, the steps done are undone, latest first, which can't fail, and its exception goes
+ * on to the caller with the system as it was before the commit.
+ */
+void GameSystem::commitTransaction()
+{
+    players_by_level.assertDebug();
+    if (!inTransaction)
+    {
+        throw Failure("commitTransaction: no transaction is open.");
+    }
+
+    std::vector<Update> updates;
+    std::vector<int> pairs;
+    updates.swap(queued);
+    pairs.swap(queuedPairs);
+    inTransaction = false; //So that the calls below go through.
+
+    auto isPlayerUpdate = [](const Update& update)
+    {
+        return update.kind != Update::MERGE_GROUPS && update.kind != Update::REMOVE_ALL_PLAYERS;
+    };
+    CommitLog log;
+    try
+    {
+        std::size_t i = 0;
+        while (i < updates.size())
+        {
+            std::size_t j = i + 1;
+            if (updates[i].kind == Update::MERGE_GROUPS)
+            {
+                int n = updates[i].args[0];
+                for (; j < updates.size() && updates[j].kind == Update::MERGE_GROUPS; ++j)
+                {
+                    n += updates[j].args[0];
+                }
+                UndoStep step = { UndoStep::ROLLBACK_MERGES, groups.getUnionCount(), 0, 0, log.replaced.size() };
+                log.steps.push_back(step); //Undoing it takes back the sets merged before one that failed.
+                uniteGroups(pairs.data() + updates[i].id, n, &log.replaced);
+            }
+            else if (updates[i].kind == Update::REMOVE_ALL_PLAYERS)
+            {
+                int root = groups.findGroupId(updates[i].id);
+                UndoStep step = { UndoStep::RESTORE_PLAYERS, root, log.saved.size(), 0, log.replaced.size() };
+                auto save = [&log](const Player& player)
+                {
+                    log.saved.push_back(player);
+                };
+                players.forEachInList(root, save);
+                step.last = log.saved.size();
+                players.reserve((int)(step.last - step.first)); //To put them back.
+                log.steps.push_back(step);
+                try
+                {
+                    emptyGroup(root, &log.replaced);
+                }
+                catch (...)
+                {
+                    log.steps.pop_back();
+                    throw;
+                }
+            }
+            else
+            {
+                for (; j < updates.size() && isPlayerUpdate(updates[j]); ++j) {}
+                auto byPlayer = [](const Update& a, const Update& b)
+                {
+                    return a.id < b.id;
+                };
+                std::stable_sort(updates.begin() + i, updates.begin() + j, byPlayer);
+                for (std::size_t first = i, last; first < j; first = last)
+                {
+                    for (last = first + 1; last < j && updates[last].id == updates[first].id; ++last) {}
+                    applyPlayerUpdates(updates.data() + first, updates.data() + last, log);
+                }
+            }
+            i = j;
+        }
+    }
+    catch (...)
+    {
+        undoSteps(log);
+        endReservations(log);
+        throw;
+    }
+    endReservations(log);
+    for (SumTree* tree : log.replaced)
+    {
+        SumTree::release(tree);
+    }
+}
+
+/*
+ * Folds one player's updates into the change they make, and makes it. Fails (changing nothing) where one would.
+ * The room for the change and for its undoing is had before the step is logged, so that neither can fail: an
+ * addition and a removal in the trees of each of the player's versions, and the table's nodes for whichever
+ * of them goes in.
+ */
+void GameSystem::applyPlayerUpdates(const Update* first, const Update* last, CommitLog& log)
+{
+    int playerId = first->id;
+    bool existed = players.isMember(playerId), exists = existed;
+    Player player = existed ? players.search(playerId) : Player(playerId, 0, 0), old = player;
+    for (const Update* update = first; update != last; ++update)
+    {
+        if (update->kind == Update::ADD_PLAYER)
+        {
+            if (exists)
+            {
+                throw Failure("Tried to add a player that was already added.");
+            }
+            player = Player(playerId, update->args[0], update->args[1]);
+            exists = true;
+        }
+        else if (!exists)
+        {
+            throw Failure("Player not found when searching hash table.");
+        }
+        else if (update->kind == Update::REMOVE_PLAYER)
+        {
+            exists = false;
+        }
+        else if (update->kind == Update::INCREASE_LEVEL)
+        {
+            player.setLevel(player.getLevel() + update->args[0]);
+        }
+        else
+        {
+            Player modified(playerId, player.getGroupId(), update->args[0]);
+            modified.setLevel(player.getLevel());
+            player = modified;
+        }
+    }
+    if (!existed && !exists)
+    {
+        return;
+    }
+
+    bool sameGroup = existed && exists && player.getGroupId() == old.getGroupId();
+    const Player* versions[] = { existed ? &old : nullptr, exists ? &player : nullptr };
+    for (const Player* version : versions)
+    {
+        if (version != nullptr)
+        {
+            log.reserved.push_back(*version);
+            reserveUpdates(groups.findGroup(version->getGroupId()), *version, 1, 1);
+        }
+    }
+    if (!sameGroup)
+    {
+        players.reserve((int)existed + (int)exists);
+    }
+    UndoStep step = { UndoStep::RESTORE_PLAYER, playerId, log.saved.size(), log.saved.size(), 0 };
+    if (existed)
+    {
+        log.saved.push_back(old);
+        step.last = log.saved.size();
+    }
+    log.steps.push_back(step);
+
+    //Nothing below throws.
+    if (sameGroup)
+    {
+        updatePlayer(player, true);
+        return;
+    }
+    if (existed)
+    {
+        removePlayer(players.search(playerId), true);
+    }
+    if (exists)
+    {
+        addPlayer(player, true);
+    }
+}
+
+/*
+ * Takes the logged steps back, latest first, with what they kept: nothing here throws. A player goes back
+ * the way it went, with the room its step reserved. Merges are undone union by union, each group taking
+ * back its trees from before its set's merge (the survivor's first, the set's last union being undone first),
+ * and an emptied group gets its players and trees back. The per-level lists aren't kept through that.
+ */
+void GameSystem::undoSteps(const CommitLog& log)
+{
+    std::size_t treesEnd = log.replaced.size();
+    for (auto step = log.steps.rbegin(); step != log.steps.rend(); ++step)
+    {
+        if (step->kind == UndoStep::ROLLBACK_MERGES)
+        {
+            stopTrackingMembership();
+            int lastInto = 0;
+            while (groups.getUnionCount() > step->id)
+            {
+                int into, absorbed = groups.undoUnion(&into);
+                if (into != lastInto)
+                {
+                    treesEnd -= scale + 1;
+                    groups.findGroup(into).restoreTrees(&log.replaced[treesEnd]);
+                    lastInto = into;
+                }
+                treesEnd -= scale + 1;
+                groups.findGroup(absorbed).restoreTrees(&log.replaced[treesEnd]);
+                auto leaves = [&](const Player& player)
+                {
+                    return groups.findGroupId(player.getGroupId()) == absorbed;
+                };
+                players.splitList(into, absorbed, leaves);
+            }
+            continue;
+        }
+        if (step->kind == UndoStep::RESTORE_PLAYERS)
+        {
+            stopTrackingMembership();
+            for (std::size_t i = step->last; i > step->first; --i)
+            {
+                players.insert(log.saved[i - 1], step->id); //Back in the list's order.
+            }
+            treesEnd -= scale + 1;
+            groups.findGroup(step->id).restoreTrees(&log.replaced[treesEnd]);
+            if (treesEnd > step->firstTree)
+            {
+                treesEnd -= scale + 1;
+                players_by_level.restoreTrees(&log.replaced[treesEnd]);
+                continue;
+            }
+            for (std::size_t i = step->first; i < step->last; ++i)
+            {
+                players_by_level.addPlayer(log.saved[i], true);
+            }
+            continue;
+        }
+
+        bool existed = step->first < step->last;
+        if (players.isMember(step->id))
+        {
+            const Player& current = players.search(step->id);
+            if (existed && current.getGroupId() == log.saved[step->first].getGroupId())
+            {
+                updatePlayer(log.saved[step->first], true);
+                continue;
+            }
+            removePlayer(current, true);
+        }
+        if (existed)
+        {
+            addPlayer(log.saved[step->first], true);
+        }
+    }
+}
+
+//Takes back the room the commit's steps reserved and didn't use.
+void GameSystem::endReservations(const CommitLog& log)
+{
+    for (const Player& player : log.reserved)
+    {
+        groups.findGroup(player.getGroupId()).endUpdates(player);
+    }
+    players_by_level.endUpdates();
+    players.releaseReserved();
 }
 
 double GameSystem::getPercentOfPlayersWithScoreInBounds(int groupId, int score, int lowerLevel, int higherLevel)
@@ -94,16 +793,31 @@ double GameSystem::getPercentOfPlayersWithScoreInBounds(int groupId, int score,
         throw Failure("0 characters in range. (Nonsense lower/higher or score values.)");
     }
 
-    const Group& group = groupId > 0 ? groups.findGroup(groupId) : players_by_level;
+    Group& group = groupId > 0 ? groups.findGroup(groupId) : players_by_level;
 
-    double playersInRange = group.countPlayersInRange(lowerLevel, higherLevel);
-    if (playersInRange == 0)
+    double percent;
+    bool failed;
+    if (group.findCachedResult(QueryCache::PERCENT_OF_PLAYERS_WITH_SCORE_IN_BOUNDS, score, lowerLevel, higherLevel,
+                               &percent, &failed))
     {
-        throw Failure("0 characters in range.");
+        ++cacheHits;
+    }
+    else
+    {
+        ++cacheMisses;
+        int playersInRange, playersWithScore;
+        group.countPlayersInRangeWithScore(lowerLevel, higherLevel, score, &playersInRange, &playersWithScore);
+        failed = playersInRange == 0;
+        percent = failed ? 0 : ((double)playersWithScore / playersInRange) * 100;
+        group.cacheResult(QueryCache::PERCENT_OF_PLAYERS_WITH_SCORE_IN_BOUNDS, score, lowerLevel, higherLevel,
+                          percent, failed);
     }
 
-    return ((double)group.countPlayersWithScoreInRange(lowerLevel, higherLevel, score)
-        / playersInRange) * 100;
+    if (failed)
+    {
+        throw Failure("0 characters in range.");
+    }
+    return percent;
 }
 
 double GameSystem::averageHighestPlayerLevelByGroup(int groupId, int m)
@@ -120,7 +834,409 @@ double GameSystem::averageHighestPlayerLevelByGroup(int groupId, int m)
         throw Failure("m > player count in averageHighestPlayerLevelByGroup.");
     }
 
-    return (double)group.sumLevelOfTopM(m) / m;
+    double average;
+    bool failed;
+    if (group.findCachedResult(QueryCache::AVERAGE_HIGHEST_PLAYER_LEVEL, m, 0, 0, &average, &failed))
+    {
+        ++cacheHits;
+        return average;
+    }
+    ++cacheMisses;
+    average = (double)group.sumLevelOfTopM(m) / m;
+    group.cacheResult(QueryCache::AVERAGE_HIGHEST_PLAYER_LEVEL, m, 0, 0, average, false);
+    return average;
+}
+
+double GameSystem::getPercentOfPlayersWithScoreBandInBounds(int groupId, int lowerScore, int higherScore,
+                                                            int lowerLevel, int higherLevel)
+{
+    players_by_level.assertDebug();
+    if (groupId < 0 || groupId > k || lowerScore <= 0 || higherScore > scale || lowerScore > higherScore)
+    {
+        throw InvalidInput("Invalid input to getPercentOfPlayersWithScoreBandInBounds.");
+    }
+
+    if (lowerLevel > higherLevel)
+    {
+        throw Failure("0 characters in range. (Nonsense lower/higher values.)");
+    }
+
+    Group& group = groupId > 0 ? groups.findGroup(groupId) : players_by_level;
+
+    int playersInRange, playersInBand;
+    group.countPlayersInRangeWithScoreBand(lowerLevel, higherLevel, lowerScore, higherScore,
+                                           &playersInRange, &playersInBand);
+    if (playersInRange == 0)
+    {
+        throw Failure("0 characters in range.");
+    }
+
+    return ((double)playersInBand / playersInRange) * 100;
+}
+
+int GameSystem::countPlayersWithScoreBandInBounds(int groupId, int lowerScore, int higherScore,
+                                                  int lowerLevel, int higherLevel)
+{
+    players_by_level.assertDebug();
+    if (groupId < 0 || groupId > k || lowerScore <= 0 || higherScore > scale || lowerScore > higherScore)
+    {
+        throw InvalidInput("Invalid input to countPlayersWithScoreBandInBounds.");
+    }
+
+    if (lowerLevel > higherLevel)
+    {
+        return 0;
+    }
+
+    Group& group = groupId > 0 ? groups.findGroup(groupId) : players_by_level;
+    return group.countPlayersWithScoreBandInRange(lowerLevel, higherLevel, lowerScore, higherScore);
+}
+
+double GameSystem::averageHighestPlayerLevelInScoreBand(int groupId, int lowerScore, int higherScore, int m)
+{
+    players_by_level.assertDebug();
+    if (groupId < 0 || groupId > k || m <= 0 || lowerScore <= 0 || higherScore > scale || lowerScore > higherScore)
+    {
+        throw InvalidInput("Invalid input to averageHighestPlayerLevelInScoreBand.");
+    }
+
+    Group& group = groupId > 0 ? groups.findGroup(groupId) : players_by_level;
+    if (m > group.getPlayerCountInScoreBand(lowerScore, higherScore))
+    {
+        throw Failure("m > player count in the score band in averageHighestPlayerLevelInScoreBand.");
+    }
+
+    return (double)group.sumLevelOfTopMInScoreBand(m, lowerScore, higherScore) / m;
+}
+
+void GameSystem::getLevelStats(int groupId, int lowerScore, int higherScore, int lowerLevel, int higherLevel,
+                               int* players, double* mean, double* variance)
+{
+    players_by_level.assertDebug();
+    bool anyScore = lowerScore == 0 && higherScore == 0;
+    if (groupId < 0 || groupId > k
+        || (!anyScore && (lowerScore <= 0 || higherScore > scale || lowerScore > higherScore)))
+    {
+        throw InvalidInput("Invalid input to getLevelStats.");
+    }
+
+    if (lowerLevel > higherLevel)
+    {
+        throw Failure("0 characters in range. (Nonsense lower/higher values.)");
+    }
+
+    Group& group = groupId > 0 ? groups.findGroup(groupId) : players_by_level;
+    long long levelSum;
+    unsigned long long squareSum;
+    int lowest, highest;
+    group.levelMomentsInRange(lowerLevel, higherLevel, lowerScore, higherScore, players, &levelSum, &squareSum,
+                              &lowest, &highest);
+    if (*players == 0)
+    {
+        throw Failure("0 characters in range.");
+    }
+
+    /*
+     * The trees only have the sum of squares modulo 2^64. For n levels in [low, high] adding up to sum, it
+     * is at least sum^2 / n (all at the mean) and at most (low + high) * sum - n * low * high (all at the
+     * ends, as (level - low) * (high - level) >= 0): while that is narrower than 2^64, the one value in it
+     * with those low bits is the sum of squares. Past that it can't be told, which is a FAILURE rather
+     * than garbage. The variance, n * squares - sum^2 over n^2, is then exact up to the final division.
+     */
+    typedef unsigned __int128 Wide;
+    Wide low = lowest, high = highest, sum = (Wide)levelSum, n = (Wide)*players;
+    Wide least = sum * sum / n, most = (low + high) * sum - n * low * high;
+    if (most > least && most - least > std::numeric_limits<unsigned long long>::max())
+    {
+        throw Failure("getLevelStats: too many levels too far apart to tell the sum of squares.");
+    }
+    Wide squares = least + (unsigned long long)(squareSum - (unsigned long long)least);
+    Wide spread = n * squares - sum * sum;
+    *mean = (double)((long double)levelSum / *players);
+    *variance = (double)((long double)spread / ((long double)*players * *players));
+}
+
+void GameSystem::getLevelHistogram(int groupId, int lowerScore, int higherScore, int lowerLevel, int higherLevel,
+                                   int buckets, int* counts)
+{
+    players_by_level.assertDebug();
+    bool anyScore = lowerScore == 0 && higherScore == 0;
+    if (groupId < 0 || groupId > k || buckets <= 0
+        || (!anyScore && (lowerScore <= 0 || higherScore > scale || lowerScore > higherScore)))
+    {
+        throw InvalidInput("Invalid input to getLevelHistogram.");
+    }
+
+    if (lowerLevel > higherLevel)
+    {
+        //No level in range, so no player in any bucket: the same as a range nobody is in.
+        std::fill(counts, counts + buckets, 0);
+        return;
+    }
+
+    Group& group = groupId > 0 ? groups.findGroup(groupId) : players_by_level;
+    group.levelHistogram(lowerLevel, higherLevel, lowerScore, higherScore, buckets, counts);
+}
+
+/*
+ * Lists the m highest players by walking the group's levels from the top and taking each level's
+ * players off its membership list: O(log n + m), since every level visited contributes a player.
+ * Players of the same level come in the order they got there.
+ */
+void GameSystem::getTopMPlayers(int groupId, int m, int* ids, int* levels)
+{
+    players_by_level.assertDebug();
+    if (groupId < 0 || groupId > k || m <= 0 || ids == nullptr || levels == nullptr)
+    {
+        throw InvalidInput("Invalid input to getTopMPlayers.");
+    }
+
+    Group& group = groupId > 0 ? groups.findGroup(groupId) : players_by_level;
+    if (m > group.getPlayerCount())
+    {
+        throw Failure("m > player count in getTopMPlayers.");
+    }
+    if (!trackingMembership)
+    {
+        startTrackingMembership();
+    }
+
+    LevelMembership::Scope scope = groupId > 0 ? LevelMembership::GROUP : LevelMembership::ALL;
+    int found = 0;
+    auto take = [&](int level, int inThisLevel)
+    {
+        for (const LevelMembership::Member* member = membership.first(&group, level, scope);
+             member != nullptr && found < m; member = member->getNext(scope))
+        {
+            ids[found] = member->getPlayerId();
+            levels[found++] = level;
+        }
+        return found < m;
+    };
+    group.getPlayers()[0]->forEachLevelDescending(take);
+    if (found < m)
+    {
+        take(0, 0);
+    }
+    assert(found == m);
+}
+
+/*
+ * A player's rank is 1 + the number of players with a higher level (so players of the same level share
+ * it), within its group and system-wide. With withinScore, only players of the same score are counted.
+ */
+void GameSystem::getPlayerRank(int playerId, bool withinScore, int* groupRank, int* globalRank)
+{
+    players_by_level.assertDebug();
+    if (playerId <= 0 || groupRank == nullptr || globalRank == nullptr)
+    {
+        throw InvalidInput("Invalid input to getPlayerRank.");
+    }
+
+    const Player& player = players.search(playerId);
+    int score = withinScore ? player.getScore() : -1;
+    *groupRank = groups.findGroup(player.getGroupId()).rankOfLevel(player.getLevel(), score);
+    *globalRank = players_by_level.rankOfLevel(player.getLevel(), score);
+}
+
+/*
+ * A single-threaded first pass resolves every query's group and checks its arguments up front, so the
+ * answers only have to read the trees, and can run on the shared pool.
+ */
+void GameSystem::runQueryBatch(const Query* queries, int n, QueryResult* results)
+{
+    players_by_level.assertDebug();
+    if (n < 0 || (n > 0 && (queries == nullptr || results == nullptr)))
+    {
+        throw InvalidInput("Invalid input to runQueryBatch.");
+    }
+
+    std::vector<PreparedQuery> prepared(n);
+    for (int i = 0; i < n; ++i)
+    {
+        results[i] = QueryResult();
+        results[i].status = statusOf([&]() { prepared[i] = prepareQuery(queries[i]); });
+    }
+
+    auto answer = [&](int first, int last)
+    {
+        for (int i = first; i < last; ++i)
+        {
+            if (results[i].status != SUCCESS) continue;
+            results[i].status = statusOf([&]() { answerQuery(queries[i], prepared[i], &results[i]); });
+        }
+    };
+
+    WorkStealingPool& pool = WorkStealingPool::shared();
+    if (n < parallelQueryThreshold || pool.getWorkerCount() == 0)
+    {
+        answer(0, n);
+        return;
+    }
+    std::vector<WorkStealingPool::Task> tasks;
+    for (int first = 0; first < n; first += queriesPerTask)
+    {
+        int last = first + queriesPerTask < n ? first + queriesPerTask : n;
+        tasks.push_back([&answer, first, last]()
+        {
+            STATS_DETACH();
+            answer(first, last);
+        });
+    }
+    pool.run(tasks);
+}
+
+GameSystem::PreparedQuery GameSystem::prepareQuery(const Query& query)
+{
+    PreparedQuery prepared = { nullptr, nullptr, 0, 0 };
+    int groupId = query.args[0];
+    switch (query.kind)
+    {
+        case QUERY_PERCENT_OF_PLAYERS_WITH_SCORE_IN_BOUNDS:
+        case QUERY_AVERAGE_HIGHEST_PLAYER_LEVEL:
+            if (groupId < 0 || groupId > k || (query.kind == QUERY_AVERAGE_HIGHEST_PLAYER_LEVEL && query.args[1] <= 0))
+            {
+                throw InvalidInput("Invalid input to a batched query.");
+            }
+            break;
+        case QUERY_COUNT_PLAYERS_IN_BOUNDS:
+            if (groupId < 0 || groupId > k || query.args[1] < 0 || query.args[1] > scale)
+            {
+                throw InvalidInput("Invalid input to a batched query.");
+            }
+            break;
+        case QUERY_PLAYER_RANK:
+        {
+            if (query.args[0] <= 0)
+            {
+                throw InvalidInput("Invalid input to a batched query.");
+            }
+            const Player& player = players.search(query.args[0]);
+            prepared.group = &groups.findGroup(player.getGroupId());
+            prepared.global = &players_by_level;
+            prepared.level = player.getLevel();
+            prepared.score = query.args[1] != 0 ? player.getScore() : -1;
+            return prepared;
+        }
+        default:
+            throw InvalidInput("Unknown batched query.");
+    }
+    prepared.group = groupId > 0 ? &groups.findGroup(groupId) : &players_by_level;
+    return prepared;
+}
+
+void GameSystem::answerQuery(const Query& query, const PreparedQuery& prepared, QueryResult* result) const
+{
+    const Group& group = *prepared.group;
+    switch (query.kind)
+    {
+        case QUERY_PERCENT_OF_PLAYERS_WITH_SCORE_IN_BOUNDS:
+        {
+            int score = query.args[1], lowerLevel = query.args[2], higherLevel = query.args[3];
+            if (lowerLevel > higherLevel || score > scale)
+            {
+                throw Failure("0 characters in range. (Nonsense lower/higher or score values.)");
+            }
+            int playersInRange, playersWithScore;
+            group.countPlayersInRangeWithScore(lowerLevel, higherLevel, score, &playersInRange, &playersWithScore);
+            if (playersInRange == 0)
+            {
+                throw Failure("0 characters in range.");
+            }
+            result->value = ((double)playersWithScore / playersInRange) * 100;
+            break;
+        }
+        case QUERY_AVERAGE_HIGHEST_PLAYER_LEVEL:
+        {
+            int m = query.args[1];
+            if (m > group.getPlayerCount())
+            {
+                throw Failure("m > player count in a batched query.");
+            }
+            result->value = (double)group.sumLevelOfTopM(m) / m;
+            break;
+        }
+        case QUERY_COUNT_PLAYERS_IN_BOUNDS:
+        {
+            int score = query.args[1], lowerLevel = query.args[2], higherLevel = query.args[3];
+            result->counts[0] = score == 0 ? group.countPlayersInRange(lowerLevel, higherLevel)
+                                           : group.countPlayersWithScoreInRange(lowerLevel, higherLevel, score);
+            break;
+        }
+        case QUERY_PLAYER_RANK:
+            result->counts[0] = group.rankOfLevel(prepared.level, prepared.score);
+            result->counts[1] = prepared.global->rankOfLevel(prepared.level, prepared.score);
+            break;
+    }
+}
+
+double GameSystem::approxPlayersInBounds(int groupId, int lowerLevel, int higherLevel)
+{
+    players_by_level.assertDebug();
+    if (groupId < 0 || groupId > k)
+    {
+        throw InvalidInput("Invalid input to approxPlayersInBounds.");
+    }
+
+    Group& group = groupId > 0 ? groups.findGroup(groupId) : players_by_level;
+    return group.approxCountPlayersInRange(lowerLevel, higherLevel);
+}
+
+int GameSystem::approxLevelPercentile(int groupId, double percentile)
+{
+    players_by_level.assertDebug();
+    if (groupId < 0 || groupId > k || !(percentile > 0 && percentile <= 100))
+    {
+        throw InvalidInput("Invalid input to approxLevelPercentile.");
+    }
+
+    Group& group = groupId > 0 ? groups.findGroup(groupId) : players_by_level;
+    if (group.getPlayerCount() == 0)
+    {
+        throw Failure("No players in approxLevelPercentile.");
+    }
+    return group.approxLevelAtPercentile(percentile);
+}
+
+double GameSystem::approxAverageHighestPlayerLevel(int groupId, int m)
+{
+    players_by_level.assertDebug();
+    if (groupId < 0 || groupId > k || m <= 0)
+    {
+        throw InvalidInput("Invalid input to approxAverageHighestPlayerLevel.");
+    }
+
+    Group& group = groupId > 0 ? groups.findGroup(groupId) : players_by_level;
+    if (m > group.getPlayerCount())
+    {
+        throw Failure("m > player count in approxAverageHighestPlayerLevel.");
+    }
+    return group.approxSumLevelOfTopM(m) / m;
+}
+
+//Fills the membership lists with the players added so far; add and remove keep them up to date after that.
+void GameSystem::stopTrackingMembership()
+{
+    membership.clear();
+    trackingMembership = false;
+}
+
+void GameSystem::startTrackingMembership()
+{
+    auto add = [&](const Player& player)
+    {
+        membership.add(player, &groups.findGroup(player.getGroupId()), &players_by_level);
+    };
+    try
+    {
+        players.forEach(add);
+    }
+    catch (...)
+    {
+        membership.clear();
+        throw;
+    }
+    trackingMembership = true;
 }
 
 void GameSystem::getPlayersBound(int groupId, int score, int m, int *lowerBoundPlayers, int *higherBoundPlayers) const
@@ -131,4 +1247,121 @@ void GameSystem::getPlayersBound(int groupId, int score, int m, int *lowerBoundP
     {
         throw InvalidInput("Invalid input to getPercentOfPlayersWithScoreInBounds.");
     }
-}
\ No newline at end of file
+}
+
+/*
+ * Estimated heap footprint of a single allocation, assuming a glibc-like allocator:
+ * an 8 byte header, 16 byte alignment and 32 byte minimal chunks.
+ */
+static unsigned long long allocationSize(std::size_t requested)
+{
+    std::size_t chunk = (requested + 8 + 15) & ~(std::size_t)15;
+    return chunk < 32 ? 32 : chunk;
+}
+
+void GameSystem::getMemoryUsage(MemoryReport* report) const
+{
+    if (report == nullptr)
+    {
+        throw InvalidInput("Invalid input to getMemoryUsage.");
+    }
+
+    const TreeMemoryCounters &grouped = groups.getTreeCounters(), &global = players_by_level.getTreeCounters();
+    unsigned long long playerCount = players.getPlayerCount(), buckets = players.getTableLength(),
+        nodes = grouped.nodes + global.nodes, liveTrees = grouped.liveTrees + global.liveTrees;
+
+    report->hashTableBuckets = buckets * sizeof(void*) + players.getListsSize();
+    report->hashTableNodes = playerCount * PlayersHashTable::getNodeSize();
+    report->unionFindArrays = groups.getArraysSize();
+    report->treeArrays = (unsigned long long)(k + 1) * (scale + 1) * sizeof(SumTree*);
+    report->trees = liveTrees * sizeof(SumTree);
+    report->groupAllPlayersTreeNodes = grouped.allPlayersNodes * sizeof(SumTreeNode);
+    report->groupScoreTreeNodes = (grouped.nodes - grouped.allPlayersNodes) * sizeof(SumTreeNode);
+    report->globalTreeNodes = global.nodes * sizeof(SumTreeNode);
+    report->smallTreeLevels = (grouped.smallLevels + global.smallLevels) * sizeof(SumTree::LevelCount);
+    report->denseLevelCounts = grouped.denseBytes + global.denseBytes;
+    report->liveTrees = liveTrees;
+    report->emptyTrees = grouped.emptyTrees + global.emptyTrees;
+    report->emptyBuckets = buckets - players.getUsedBuckets();
+    report->levelMembership = membership.getMemorySize();
+    static const std::size_t sketchSize = LevelSketch().getMemorySize(); //All of them have the default precision.
+    report->sketches = (grouped.sketches + global.sketches) * sketchSize;
+    report->queryCaches = (grouped.caches + global.caches) * sizeof(QueryCache);
+
+    //Tree nodes come out of one pool per tree, so their only overhead is the unused slots.
+    report->fragmentation = report->emptyTrees * sizeof(SumTree) + report->emptyBuckets * sizeof(void*)
+        + (grouped.nodeSlots + global.nodeSlots - nodes) * sizeof(SumTreeNode)
+        + (grouped.smallSlots + global.smallSlots - grouped.smallLevels - global.smallLevels) * sizeof(SumTree::LevelCount)
+        + playerCount * (allocationSize(PlayersHashTable::getNodeSize()) - PlayersHashTable::getNodeSize())
+        + liveTrees * (allocationSize(sizeof(SumTree)) - sizeof(SumTree));
+
+    report->total = report->hashTableBuckets + report->hashTableNodes + report->unionFindArrays
+        + report->treeArrays + report->trees + report->groupAllPlayersTreeNodes + report->groupScoreTreeNodes
+        + report->globalTreeNodes + report->smallTreeLevels + report->denseLevelCounts + report->levelMembership
+        + report->sketches + report->queryCaches + report->fragmentation;
+}
+
+void GameSystem::getQueryCacheStats(unsigned long long* hits, unsigned long long* misses, double* hitRate) const
+{
+    if (hits == nullptr || misses == nullptr || hitRate == nullptr)
+    {
+        throw InvalidInput("Invalid input to getQueryCacheStats.");
+    }
+
+    *hits = cacheHits;
+    *misses = cacheMisses;
+    *hitRate = cacheHits + cacheMisses == 0 ? 0 : (double)cacheHits / (cacheHits + cacheMisses);
+}
+
+unsigned long long GameSystem::getTreeMemoryUsage(int groupId, int score)
+{
+    if (groupId < 0 || groupId > k || score < 0 || score > scale)
+    {
+        throw InvalidInput("Invalid input to getTreeMemoryUsage.");
+    }
+
+    const Group& group = groupId > 0 ? groups.findGroup(groupId) : players_by_level;
+    return (unsigned long long)group.getTreeDataSize(score);
+}
+
+std::unique_ptr<GroupSnapshot> GameSystem::takeSnapshot(int groupId)
+{
+    players_by_level.assertDebug();
+    if (groupId < 0 || groupId > k)
+    {
+        throw InvalidInput("Invalid input to takeSnapshot.");
+    }
+
+    Group& group = groupId > 0 ? groups.findGroup(groupId) : players_by_level;
+    return group.takeSnapshot();
+}
+
+double GameSystem::getPercentOfPlayersWithScoreInBounds(const GroupSnapshot& snapshot, int score,
+                                                        int lowerLevel, int higherLevel)
+{
+    if (lowerLevel > higherLevel || score > snapshot.getScale())
+    {
+        throw Failure("0 characters in range. (Nonsense lower/higher or score values.)");
+    }
+
+    int playersInRange, playersWithScore;
+    snapshot.countPlayersInRangeWithScore(lowerLevel, higherLevel, score, &playersInRange, &playersWithScore);
+    if (playersInRange == 0)
+    {
+        throw Failure("0 characters in range.");
+    }
+    return ((double)playersWithScore / playersInRange) * 100;
+}
+
+double GameSystem::averageHighestPlayerLevel(const GroupSnapshot& snapshot, int m)
+{
+    if (m <= 0)
+    {
+        throw InvalidInput("Invalid input to averageHighestPlayerLevel.");
+    }
+    if (m > snapshot.getPlayerCount())
+    {
+        throw Failure("m > player count in averageHighestPlayerLevel.");
+    }
+    return (double)snapshot.sumLevelOfTopM(m) / m;
+}
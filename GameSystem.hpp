@@ -5,6 +5,9 @@
 #include "Group.hpp"
 #include "PlayersHashTable.hpp"
 #include "GroupsUnionFind.hpp"
+#include "LevelMembership.hpp"
+#include "Instrumentation.hpp"
+#include <vector>
 
 class GameSystem
 {
@@ -14,17 +17,147 @@ class GameSystem
         GroupsUnionFind groups;
         int k;
         int scale;
-        void addPlayer(const Player& player);
+        LevelMembership membership; //Only kept once the top players were asked for.
+        bool trackingMembership;
+        unsigned long long cacheHits;
+        unsigned long long cacheMisses;
+#ifdef GAME_SYSTEM_STATS
+        Stats stats{};
+#endif
+        //With reserved (the room in the trees had with reserveUpdates, and a node with players.reserve), these
+        //don't throw. Otherwise the room is had first, so that a failure changes nothing.
+        void addPlayer(const Player& player, bool reserved = false);
+        //Gives a player its new level or score.
+        void updatePlayer(const Player& updated, bool reserved = false);
+        void removePlayer(const Player& player, bool reserved);
+        //Group::reserveUpdates, in the group and in players_by_level; all or nothing.
+        void reserveUpdates(Group& group, const Player& player, int additions, int removals);
+        void releaseUpdates(Group& group, const Player& player, int additions, int removals);
+        void startTrackingMembership();
+        //Drops the per-level lists, for when they can't be kept right; the next top players query rebuilds them.
+        void stopTrackingMembership();
+
+        //Undoes the latest union of groups, moving the players that came with the absorbed group back to it.
+        void splitLastUnion();
+
+        //mergeGroupsBatch and removeAllPlayersInGroup (of a root) once queuing is ruled out. With replaced,
+        //the trees they replace are kept there (see Group::mergeGroups and Group::subtractGroup).
+        void uniteGroups(const int* pairs, int n, std::vector<SumTree*>* replaced);
+        void emptyGroup(int root, std::vector<SumTree*>* replaced);
+
+        //An update queued by an open transaction.
+        struct Update
+        {
+            enum Kind
+            {
+                ADD_PLAYER,
+                REMOVE_PLAYER,
+                INCREASE_LEVEL,
+                CHANGE_SCORE,
+                MERGE_GROUPS,
+                REMOVE_ALL_PLAYERS
+            };
+            Kind kind;
+            int id; //The player or the group; for merges, where their pairs start in queuedPairs.
+            int args[2]; //Group and score to add with, the level increase or the new score; for merges, the pair count.
+        };
+        bool inTransaction;
+        std::vector<Update> queued;
+        std::vector<int> queuedPairs; //A run of merges has its pairs next to each other, so it is merged as one batch.
+
+        //How to take one step of a commit back.
+        struct UndoStep
+        {
+            enum Kind
+            {
+                RESTORE_PLAYER, //To how it was, or gone if it wasn't there.
+                ROLLBACK_MERGES,
+                RESTORE_PLAYERS //Of a group that was emptied.
+            };
+            Kind kind;
+            int id; //The player, the merge checkpoint, or the emptied group.
+            std::size_t first, last; //The players to put back, in the saved ones.
+            std::size_t firstTree; //Where the trees it replaced start, in the replaced ones (up to the next step's).
+        };
+
+        //What a commit keeps to take its steps back, without needing any memory to do it.
+        struct CommitLog
+        {
+            std::vector<UndoStep> steps;
+            std::vector<Player> saved;
+            std::vector<SumTree*> replaced; //Released once the commit went through.
+            std::vector<Player> reserved; //Players whose groups' trees have room reserved, to end once done.
+        };
+
+        //Queues the update if a transaction is open, and says whether it did.
+        bool queueUpdate(Update::Kind kind, int id, int arg0=0, int arg1=0);
+        void applyPlayerUpdates(const Update* first, const Update* last, CommitLog& log);
+        void undoSteps(const CommitLog& log);
+        void endReservations(const CommitLog& log);
+
+        //A query of a batch, with everything that writes to the structures done: the groups are found.
+        struct PreparedQuery
+        {
+            const Group* group;
+            const Group* global; //For ranks.
+            int level;
+            int score;
+        };
+        PreparedQuery prepareQuery(const Query& query);
+        void answerQuery(const Query& query, const PreparedQuery& prepared, QueryResult* result) const;
+
+        //A batch is split in tasks of this many queries, and stays on the calling thread below the threshold.
+        static const int queriesPerTask = 32;
+        static const int parallelQueryThreshold = 256;
     public:
-        GameSystem(int k, int scale) : players_by_level(scale), players(), groups(k, scale), k(k), scale(scale) {}
+        GameSystem(int k, int scale) : players_by_level(scale), players(k), groups(k, scale), k(k), scale(scale),
+            membership(), trackingMembership(false), cacheHits(0), cacheMisses(0), inTransaction(false), queued(),
+            queuedPairs()
+        {}
         void mergeGroups(int id1, int id2);
+        void mergeGroupsBatch(const int* pairs, int n);
+        int getMergeCheckpoint() const;
+        void rollbackMerges(int checkpoint);
         void addPlayer(int playerId, int groupId, int score);
         void removePlayer(int playerId);
+        void removeAllPlayersInGroup(int groupId);
         void increasePlayerIDLevel(int playerId, int levelIncrease);
         void changePlayerIDScore(int playerId, int newScore);
+        void beginTransaction();
+        void commitTransaction();
+        void abortTransaction();
         double getPercentOfPlayersWithScoreInBounds(int groupId, int score, int lowerLevel, int higherLevel);
         double averageHighestPlayerLevelByGroup(int groupId, int m);
+        double getPercentOfPlayersWithScoreBandInBounds(int groupId, int lowerScore, int higherScore,
+                                                        int lowerLevel, int higherLevel);
+        int countPlayersWithScoreBandInBounds(int groupId, int lowerScore, int higherScore,
+                                              int lowerLevel, int higherLevel);
+        double averageHighestPlayerLevelInScoreBand(int groupId, int lowerScore, int higherScore, int m);
+        void getLevelStats(int groupId, int lowerScore, int higherScore, int lowerLevel, int higherLevel,
+                           int* players, double* mean, double* variance);
+        void getLevelHistogram(int groupId, int lowerScore, int higherScore, int lowerLevel, int higherLevel,
+                               int buckets, int* counts);
+        void getTopMPlayers(int groupId, int m, int* ids, int* levels);
+        void getPlayerRank(int playerId, bool withinScore, int* groupRank, int* globalRank);
+        void runQueryBatch(const Query* queries, int n, QueryResult* results);
+        double approxPlayersInBounds(int groupId, int lowerLevel, int higherLevel);
+        int approxLevelPercentile(int groupId, double percentile);
+        double approxAverageHighestPlayerLevel(int groupId, int m);
         void getPlayersBound(int groupId, int score, int m, int* lowerBoundPlayers, int* higherBoundPlayers) const;
+        void getMemoryUsage(MemoryReport* report) const;
+        void getQueryCacheStats(unsigned long long* hits, unsigned long long* misses, double* hitRate) const;
+        unsigned long long getTreeMemoryUsage(int groupId, int score);
+        std::unique_ptr<GroupSnapshot> takeSnapshot(int groupId);
+        //The queries above, on a snapshot (which needs no GameSystem).
+        static double getPercentOfPlayersWithScoreInBounds(const GroupSnapshot& snapshot, int score,
+                                                           int lowerLevel, int higherLevel);
+        static double averageHighestPlayerLevel(const GroupSnapshot& snapshot, int m);
+#ifdef GAME_SYSTEM_STATS
+        Stats& getStats()
+        {
+            return stats;
+        }
+#endif
 };
 
 #endif //GAME_SYSTEM_H
\ No newline at end of file
@@ -1,4 +1,10 @@
 #include "Group.hpp"
+#include "WorkStealingPool.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <limits>
 
 int Group::countPlayersInRange_Aux(int lowerLevel, int higherLevel, int score) const
 {
@@ -7,12 +13,46 @@ int Group::countPlayersInRange_Aux(int lowerLevel, int higherLevel, int score) c
     return tree->countInRange(lowerLevel, higherLevel);
 }
 
-Group::Group(int scale) : scale(scale), trees_array(nullptr), playerCount(0), initialized(false)
+Group::Group(int scale) : scale(scale), trees_array(nullptr), playerCount(0), initialized(false), counters(),
+    shared(nullptr), score_bands(nullptr), sketch(nullptr), epoch(0), cache(nullptr)
 {
     init(scale);
 }
 
-void Group::init(int scale)
+TreeMemoryCounters Group::countTree(int index) const
+{
+    return countTree(trees_array[index], index == 0);
+}
+
+TreeMemoryCounters Group::countTree(const SumTree* tree, bool allPlayers)
+{
+    TreeMemoryCounters counted;
+    if (tree != nullptr)
+    {
+        counted.nodes = tree->getNodeCount();
+        counted.allPlayersNodes = allPlayers ? counted.nodes : 0;
+        counted.nodeSlots = tree->getNodeCapacity();
+        counted.smallLevels = tree->getSmallCount();
+        counted.smallSlots = tree->getSmallCapacity();
+        counted.denseBytes = tree->getDenseSize();
+        counted.liveTrees = 1;
+        counted.emptyTrees = tree->getPlayerCount() == 0;
+    }
+    return counted;
+}
+
+void Group::account(const TreeMemoryCounters& after, const TreeMemoryCounters& before)
+{
+    counters.add(after);
+    counters.add(before, -1);
+    if (shared != nullptr)
+    {
+        shared->add(after);
+        shared->add(before, -1);
+    }
+}
+
+void Group::init(int scale, TreeMemoryCounters* shared)
 {
     if (initialized)
     {
@@ -38,32 +78,342 @@ void Group::init(int scale)
         throw AllocationError("Group init failed.");
     }
     initialized = true;
+    this->shared = shared;
+    for (int i = 0; i < scale + 1; ++i)
+    {
+        account(countTree(i), TreeMemoryCounters());
+    }
 }
 
-void Group::addPlayer(const Player &player)
+void Group::reserveUpdates(const Player& player, int additions, int removals)
+{
+    if (!initialized)
+    {
+        throw Failure("Tried to use uninitialized group (reserveUpdates).");
+    }
+
+    //The capacities change even if it fails, and a tree in the array may have been built into nodes.
+    int indices[] = { 0, player.getScore() };
+    for (int n = 0; n < 2; ++n)
+    {
+        TreeMemoryCounters before = countTree(indices[n]);
+        try
+        {
+            trees_array[indices[n]]->reserveUpdates(additions, removals);
+        }
+        catch (...)
+        {
+            account(countTree(indices[n]), before);
+            if (n == 1)
+            {
+                trees_array[0]->releaseUpdates(additions, removals);
+            }
+            throw;
+        }
+        account(countTree(indices[n]), before);
+    }
+}
+
+void Group::releaseUpdates(const Player& player, int additions, int removals)
+{
+    trees_array[0]->releaseUpdates(additions, removals);
+    trees_array[player.getScore()]->releaseUpdates(additions, removals);
+}
+
+void Group::endUpdates(const Player& player)
+{
+    trees_array[0]->endUpdates();
+    trees_array[player.getScore()]->endUpdates();
+}
+
+void Group::endUpdates()
+{
+    for (int i = 0; i < scale + 1; ++i)
+    {
+        trees_array[i]->endUpdates();
+    }
+}
+
+void Group::addPlayer(const Player &player, bool reserved)
 {
     assert(trees_array[0]->getPlayerCount() == playerCount);
     if (!initialized)
     {
         throw Failure("Tried to use uninitialized group (addPlayer).");
     }
+    if (!reserved)
+    {
+        reserveUpdates(player, 1, 0);
+    }
 
+    //Nothing below throws.
+    TreeMemoryCounters allBefore = countTree(0), scoreBefore = countTree(player.getScore());
     trees_array[0]->addNode(player.getLevel()); //All players tree.
     trees_array[player.getScore()]->addNode(player.getLevel()); //Score-based tree.
+    account(countTree(0), allBefore);
+    account(countTree(player.getScore()), scoreBefore);
+    if (score_bands != nullptr)
+    {
+        try
+        {
+            updateScoreBands(player, true);
+        }
+        catch (...)
+        {
+            dropScoreBands(); //Rebuilt by the next band query; the player is in all the same.
+        }
+    }
+    if (sketch != nullptr)
+    {
+        sketch->add(player.getLevel());
+    }
     ++playerCount;
+    ++epoch;
 }
 
-void Group::removePlayer(const Player &player)
+void Group::removePlayer(const Player &player, bool reserved)
 {
     assert(trees_array[0]->getPlayerCount() == playerCount);
     if (!initialized)
     {
         throw Failure("Tried to use uninitialized group (removePlayer).");
     }
+    if (!reserved)
+    {
+        reserveUpdates(player, 0, 1); //Allocates only while snapshots share the trees.
+    }
 
-    trees_array[0]->removeNode(player.getLevel()); //All players tree.
+    //Nothing below throws.
+    TreeMemoryCounters allBefore = countTree(0), scoreBefore = countTree(player.getScore());
     trees_array[player.getScore()]->removeNode(player.getLevel()); //Score-based tree.
+    trees_array[0]->removeNode(player.getLevel()); //All players tree.
+    account(countTree(0), allBefore);
+    account(countTree(player.getScore()), scoreBefore);
+    if (score_bands != nullptr)
+    {
+        updateScoreBands(player, false);
+    }
+    if (sketch != nullptr)
+    {
+        sketch->add(player.getLevel(), -1);
+    }
     --playerCount;
+    ++epoch;
+}
+
+void Group::subtractGroup(const Group& part, std::vector<SumTree*>* replaced)
+{
+    assert(trees_array[0]->getPlayerCount() == playerCount);
+    if (!initialized || !part.initialized)
+    {
+        throw Failure("Tried to use uninitialized group (subtractGroup).");
+    }
+    if (part.playerCount == 0)
+    {
+        return;
+    }
+
+    //Two O(log n) removals per player, against one pass over every tree.
+    long long rebuildCost = 0, depth = 1;
+    for (int i = 0; i < scale + 1; ++i)
+    {
+        rebuildCost += trees_array[i]->getSize();
+    }
+    for (int n = playerCount; n > 1; n /= 2)
+    {
+        ++depth;
+    }
+    bool shared = false;
+    for (int i = 0; i < scale + 1; ++i)
+    {
+        shared = shared || trees_array[i]->hasSnapshots();
+    }
+    if (2 * depth * part.playerCount <= rebuildCost && !shared)
+    {
+        for (int i = 0; replaced != nullptr && i < scale + 1; ++i)
+        {
+            TreeMemoryCounters before = countTree(i);
+            try
+            {
+                trees_array[i]->reserveUpdates(part.trees_array[i]->getPlayerCount(), 0);
+            }
+            catch (...)
+            {
+                account(countTree(i), before);
+                for (int j = 0; j < i; ++j)
+                {
+                    trees_array[j]->releaseUpdates(part.trees_array[j]->getPlayerCount(), 0);
+                }
+                throw;
+            }
+            account(countTree(i), before);
+        }
+        for (int score = 1; score <= scale; ++score)
+        {
+            auto remove = [this, score](int level, int inThisLevel)
+            {
+                Player player(0, 0, score);
+                player.setLevel(level);
+                for (int i = 0; i < inThisLevel; ++i)
+                {
+                    removePlayer(player);
+                }
+                return true;
+            };
+            part.trees_array[score]->forEachLevelDescending(remove);
+            remove(0, part.trees_array[score]->getLevelZero());
+        }
+        return;
+    }
+
+    //Every tree is built before any is replaced, so a failure leaves the group as it was.
+    std::vector<SumTree*> built(scale + 1, nullptr);
+    try
+    {
+        for (int i = 0; i < scale + 1; ++i)
+        {
+            built[i] = SumTree::difference(*trees_array[i], *part.trees_array[i]);
+        }
+        reserveReplaced(replaced, scale + 1);
+    }
+    catch (...)
+    {
+        for (SumTree* tree : built) delete tree;
+        throw;
+    }
+
+    dropScoreBands(); //Rebuilt by the next band query, if there is one.
+    if (sketch != nullptr)
+    {
+        auto subtract = [this](int level, int inThisLevel)
+        {
+            sketch->add(level, -inThisLevel);
+            return true;
+        };
+        part.trees_array[0]->forEachLevelDescending(subtract);
+        subtract(0, part.trees_array[0]->getLevelZero());
+    }
+    for (int i = 0; i < scale + 1; ++i)
+    {
+        TreeMemoryCounters before = countTree(i);
+        if (replaced != nullptr)
+        {
+            replaced->push_back(trees_array[i]);
+        }
+        else
+        {
+            SumTree::release(trees_array[i]); //Snapshots may still be reading it.
+        }
+        trees_array[i] = built[i];
+        account(countTree(i), before);
+    }
+    playerCount = trees_array[0]->getPlayerCount();
+    ++epoch;
+}
+
+void Group::clear()
+{
+    std::vector<SumTree*> fresh = makeEmptyTrees();
+    clear(fresh);
+}
+
+std::vector<SumTree*> Group::makeEmptyTrees() const
+{
+    if (!initialized)
+    {
+        throw Failure("Tried to use uninitialized group (clear).");
+    }
+
+    std::vector<SumTree*> fresh(scale + 1, nullptr);
+    try
+    {
+        for (int i = 0; i < scale + 1; ++i)
+        {
+            fresh[i] = new SumTree();
+        }
+    }
+    catch (...)
+    {
+        for (SumTree* tree : fresh) delete tree;
+        throw;
+    }
+    return fresh;
+}
+
+void Group::clear(std::vector<SumTree*>& fresh, std::vector<SumTree*>* replaced)
+{
+    assert(trees_array[0] == nullptr || trees_array[0]->getPlayerCount() == playerCount);
+    assert(initialized && (int)fresh.size() == scale + 1);
+
+    dropScoreBands();
+    dropSketch();
+    dropCache();
+    for (int i = 0; i < scale + 1; ++i)
+    {
+        TreeMemoryCounters before = countTree(i);
+        if (replaced != nullptr)
+        {
+            replaced->push_back(trees_array[i]);
+        }
+        else
+        {
+            SumTree::release(trees_array[i]);
+        }
+        trees_array[i] = fresh[i];
+        fresh[i] = nullptr;
+        account(countTree(i), before);
+    }
+    playerCount = 0;
+    ++epoch;
+}
+
+void Group::reserveReplaced(std::vector<SumTree*>* replaced, std::size_t count)
+{
+    if (replaced != nullptr && replaced->capacity() < replaced->size() + count)
+    {
+        replaced->reserve(std::max(replaced->size() + count, 2 * replaced->capacity()));
+    }
+}
+
+void Group::restoreTrees(SumTree* const* kept)
+{
+    assert(initialized);
+
+    dropScoreBands();
+    dropSketch();
+    dropCache();
+    for (int i = 0; i < scale + 1; ++i)
+    {
+        TreeMemoryCounters before = countTree(i);
+        SumTree::release(trees_array[i]);
+        trees_array[i] = kept[i];
+        account(countTree(i), before);
+    }
+    playerCount = trees_array[0]->getPlayerCount();
+    ++epoch;
+}
+
+void Group::swapTrees(Group& other)
+{
+    assert(initialized && other.initialized && scale == other.scale);
+
+    Group* both[] = { this, &other };
+    for (Group* group : both)
+    {
+        group->dropScoreBands();
+        group->dropSketch();
+        group->dropCache();
+    }
+    for (int i = 0; i < scale + 1; ++i)
+    {
+        TreeMemoryCounters mine = countTree(i), theirs = other.countTree(i);
+        std::swap(trees_array[i], other.trees_array[i]);
+        account(countTree(i), mine);
+        other.account(other.countTree(i), theirs);
+    }
+    std::swap(playerCount, other.playerCount);
+    ++epoch;
+    ++other.epoch;
 }
 
 SumTree** Group::getPlayers() const
@@ -77,24 +427,163 @@ SumTree** Group::getPlayers() const
 }
 
 void Group::mergeGroups(Group &g)
+{
+    Group* others[] = { &g };
+    mergeGroups(others, 1);
+}
+
+void Group::mergeGroups(Group** others, int count, std::vector<SumTree*>* replaced)
 {
     assert(trees_array[0]->getPlayerCount() == playerCount);
-    if (!initialized || !g.initialized)
+    if (!initialized)
     {
         throw Failure("Tried to use uninitialized group (mergeGroups).");
     }
+    for (int j = 0; j < count; ++j)
+    {
+        if (!others[j]->initialized)
+        {
+            throw Failure("Tried to use uninitialized group (mergeGroups).");
+        }
+    }
+    STATS_TIME_SCOPE(mergeCycles);
 
+    //Sketches merge exactly, so keep one if any of the groups had it. The missing ones are built first,
+    //while a failure only leaves some group with a sketch it didn't have.
+    bool sketched = sketch != nullptr;
+    for (int j = 0; j < count; ++j)
+    {
+        sketched = sketched || others[j]->sketch != nullptr;
+    }
+    if (sketched)
+    {
+        if (sketch == nullptr) buildSketch();
+        for (int j = 0; j < count; ++j)
+        {
+            if (others[j]->sketch == nullptr) others[j]->buildSketch();
+        }
+    }
+
+    /*
+     * Every tree merges on its own: two trees go through the linear array merge, more through one heap
+     * merge (O(N log count) per score). Big merges spread the trees over the shared pool, the biggest first.
+     * The groups' trees are only read: if any build fails, the others are thrown away and every group
+     * stays as it was.
+     */
+    std::vector<SumTree*> built(scale + 1, nullptr);
+    auto mergeTree = [&](int i)
+    {
+        std::vector<SumTree*> merged(count + 1);
+        merged[0] = trees_array[i];
+        for (int j = 0; j < count; ++j)
+        {
+            merged[j + 1] = others[j]->trees_array[i];
+        }
+        built[i] = SumTree::mergedCopy(merged.data(), count + 1);
+    };
+
+    long long totalNodes = 0;
+    std::vector<std::pair<long long, int> > bySize(scale + 1);
     for (int i = 0; i < scale + 1; i++)
     {
-        SumTree *toFree1 = trees_array[i], *toFree2 = g.trees_array[i];
-        trees_array[i]
-                = SumTree::mergeTrees(*trees_array[i], *g.trees_array[i]);
-        delete toFree1;
-        delete toFree2;
-        g.trees_array[i] = nullptr; //The dtor will still go over that one. Don't wanna double free.
+        long long nodes = trees_array[i]->getSize();
+        for (int j = 0; j < count; ++j)
+        {
+            nodes += others[j]->trees_array[i]->getSize();
+        }
+        bySize[i] = std::make_pair(nodes, i);
+        totalNodes += nodes;
+    }
+
+    WorkStealingPool& pool = WorkStealingPool::shared();
+    try
+    {
+        reserveReplaced(replaced, (std::size_t)(count + 1) * (scale + 1));
+        if (totalNodes < parallelMergeThreshold || pool.getWorkerCount() == 0)
+        {
+            for (int i = 0; i < scale + 1; i++)
+            {
+                mergeTree(i);
+            }
+        }
+        else
+        {
+            std::sort(bySize.begin(), bySize.end(), std::greater<std::pair<long long, int> >());
+            std::vector<WorkStealingPool::Task> tasks;
+            tasks.reserve(scale + 1);
+            for (int i = 0; i < scale + 1; i++)
+            {
+                int index = bySize[i].second;
+                tasks.push_back([&mergeTree, index]()
+                {
+                    STATS_DETACH();
+                    mergeTree(index);
+                });
+            }
+            pool.run(tasks);
+        }
+    }
+    catch (...)
+    {
+        for (SumTree* tree : built) delete tree;
+        throw;
+    }
+
+    //Nothing below throws.
+    for (int j = 0; j < count; ++j)
+    {
+        STATS_INCREMENT(merges);
+        STATS_ADD(mergedPlayers, others[j]->playerCount);
+        STATS_MAX(largestMerge, others[j]->playerCount);
+    }
+    dropScoreBands(); //Rebuilt by the next band query, if there is one.
+    for (int j = 0; j < count; ++j)
+    {
+        others[j]->dropScoreBands();
+        others[j]->dropCache(); //Nobody will ask it anything anymore, its ID leads here now.
+        if (sketched)
+        {
+            sketch->merge(*others[j]->sketch);
+            others[j]->dropSketch();
+        }
+    }
+
+    if (replaced != nullptr)
+    {
+        for (int j = 0; j < count; ++j)
+        {
+            replaced->insert(replaced->end(), others[j]->trees_array, others[j]->trees_array + scale + 1);
+        }
+        replaced->insert(replaced->end(), trees_array, trees_array + scale + 1);
+    }
+    for (int i = 0; i < scale + 1; i++)
+    {
+        TreeMemoryCounters before = countTree(i);
+        if (replaced == nullptr)
+        {
+            SumTree::release(trees_array[i]); //Snapshots may still be reading it.
+        }
+        trees_array[i] = built[i];
+        account(countTree(i), before);
+        for (int j = 0; j < count; ++j)
+        {
+            TreeMemoryCounters otherBefore = others[j]->countTree(i);
+            if (replaced == nullptr)
+            {
+                SumTree::release(others[j]->trees_array[i]);
+            }
+            others[j]->trees_array[i] = nullptr; //The dtor will still go over that one. Don't wanna double free.
+            others[j]->account(TreeMemoryCounters(), otherBefore);
+        }
+    }
+    for (int j = 0; j < count; ++j)
+    {
+        others[j]->playerCount = 0;
+        ++others[j]->epoch;
     }
 
     playerCount = trees_array[0]->getPlayerCount();
+    ++epoch;
 }
 
 int Group::countPlayersWithScoreInRange(int lowerLevel, int higherLevel, int score) const
@@ -119,6 +608,274 @@ int Group::countPlayersInRange(int lowerLevel, int higherLevel) const
     return countPlayersInRange_Aux(lowerLevel, higherLevel);
 }
 
+void Group::countPlayersInRangeWithScore(int lowerLevel, int higherLevel, int score,
+                                         int* inRange, int* inRangeWithScore) const
+{
+    assert(trees_array[0]->getPlayerCount() == playerCount);
+    if (!initialized)
+    {
+        throw Failure("Tried to use uninitialized group (countPlayersInRangeWithScore).");
+    }
+
+    *inRange = countPlayersInRange_Aux(lowerLevel, higherLevel);
+    //Nobody in range means nobody in range with the score either; skip the second tree.
+    *inRangeWithScore = *inRange == 0 ? 0 : countPlayersInRange_Aux(lowerLevel, higherLevel, score);
+}
+
+void Group::countPlayersInRangeWithScoreBand(int lowerLevel, int higherLevel, int lowScore, int highScore,
+                                             int* inRange, int* inRangeWithScore)
+{
+    *inRange = countPlayersInRange(lowerLevel, higherLevel);
+    *inRangeWithScore = *inRange == 0 ? 0 : countPlayersWithScoreBandInRange(lowerLevel, higherLevel,
+                                                                              lowScore, highScore);
+}
+
+int Group::countPlayersWithScoreBandInRange(int lowerLevel, int higherLevel, int lowScore, int highScore)
+{
+    const SumTree* parts[maxBandParts];
+    int count = 0, partCount = scoreBandParts(lowScore, highScore, parts);
+    for (int i = 0; i < partCount; ++i)
+    {
+        count += parts[i]->countInRange(lowerLevel, higherLevel);
+    }
+    return count;
+}
+
+int Group::getPlayerCountInScoreBand(int lowScore, int highScore)
+{
+    const SumTree* parts[maxBandParts];
+    int count = 0, partCount = scoreBandParts(lowScore, highScore, parts);
+    for (int i = 0; i < partCount; ++i)
+    {
+        count += parts[i]->getPlayerCount();
+    }
+    return count;
+}
+
+/*
+ * The band is spread over several trees, so instead of a single top-m descent this binary searches
+ * for the level of the m-th highest player: the lowest level with fewer than m players above it.
+ */
+long long Group::sumLevelOfTopMInScoreBand(int m, int lowScore, int highScore)
+{
+    const SumTree* parts[maxBandParts];
+    int partCount = scoreBandParts(lowScore, highScore, parts), available = 0, low = 0, high = 0;
+    for (int i = 0; i < partCount; ++i)
+    {
+        available += parts[i]->getPlayerCount();
+        high = std::max(high, parts[i]->getMaxLevel());
+    }
+    if (m > available)
+    {
+        throw Failure("sumLevelOfTopMInScoreBand: illegal m.");
+    }
+
+    int above = 0;
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        above = 0;
+        for (int i = 0; i < partCount; ++i)
+        {
+            above += parts[i]->countAbove(mid);
+        }
+        if (above < m)
+        {
+            high = mid;
+        }
+        else
+        {
+            low = mid + 1;
+        }
+    }
+
+    above = 0;
+    long long sum = 0;
+    for (int i = 0; i < partCount; ++i)
+    {
+        int players;
+        long long levelSum;
+        parts[i]->countAbove(low, &players, &levelSum);
+        above += players;
+        sum += levelSum;
+    }
+    return sum + (long long)(m - above) * low;
+}
+
+void Group::levelMomentsInRange(int lowerLevel, int higherLevel, int lowScore, int highScore, int* players,
+                                long long* levelSum, unsigned long long* squareSum, int* lowest, int* highest)
+{
+    const SumTree* parts[maxBandParts];
+    int partCount = filteredParts(lowScore, highScore, parts);
+    *players = 0;
+    *levelSum = 0;
+    *squareSum = 0;
+    *lowest = std::numeric_limits<int>::max();
+    *highest = 0;
+    for (int i = 0; i < partCount; ++i)
+    {
+        int inRange;
+        SumTree::Value moments = parts[i]->aggregateInRange(lowerLevel, higherLevel, &inRange);
+        if (inRange == 0)
+        {
+            continue;
+        }
+        *players += inRange;
+        *levelSum += moments.first;
+        *squareSum += moments.second;
+        int above = countAtLeast(*parts[i], (long long)higherLevel + 1);
+        *highest = std::max(*highest, levelOfRank(*parts[i], above + 1));
+        *lowest = std::min(*lowest, levelOfRank(*parts[i], above + inRange));
+    }
+}
+
+int Group::levelOfRank(const SumTree& tree, int rank)
+{
+    return (int)(tree.sumLevelOfTopM(rank) - tree.sumLevelOfTopM(rank - 1));
+}
+
+void Group::levelHistogram(int lowerLevel, int higherLevel, int lowScore, int highScore, int buckets, int* counts)
+{
+    const SumTree* parts[maxBandParts];
+    int partCount = filteredParts(lowScore, highScore, parts);
+    long long width = (long long)higherLevel - lowerLevel + 1;
+
+    //Bucket i is [bound(i), bound(i + 1)), its count the difference of the players at or above each.
+    int atOrAbove = 0;
+    for (int j = 0; j < partCount; ++j)
+    {
+        atOrAbove += countAtLeast(*parts[j], lowerLevel);
+    }
+    for (int i = 0; i < buckets; ++i)
+    {
+        long long bound = lowerLevel + width * (i + 1) / buckets;
+        int next = 0;
+        for (int j = 0; j < partCount; ++j)
+        {
+            next += countAtLeast(*parts[j], bound);
+        }
+        counts[i] = atOrAbove - next;
+        atOrAbove = next;
+    }
+}
+
+int Group::countAtLeast(const SumTree& tree, long long level)
+{
+    return level <= 0 ? tree.getPlayerCount() : tree.countAbove((int)(level - 1));
+}
+
+int Group::filteredParts(int lowScore, int highScore, const SumTree** parts)
+{
+    if (lowScore == 0 && highScore == 0)
+    {
+        assert(trees_array[0]->getPlayerCount() == playerCount);
+        if (!initialized)
+        {
+            throw Failure("Tried to use uninitialized group (filteredParts).");
+        }
+        parts[0] = trees_array[0];
+        return 1;
+    }
+    return scoreBandParts(lowScore, highScore, parts);
+}
+
+int Group::scoreBandParts(int lowScore, int highScore, const SumTree** parts)
+{
+    assert(trees_array[0]->getPlayerCount() == playerCount);
+    if (!initialized)
+    {
+        throw Failure("Tried to use uninitialized group (scoreBandParts).");
+    }
+    if (lowScore < 1 || highScore > scale || lowScore > highScore)
+    {
+        throw InvalidInput("Invalid score band.");
+    }
+    if (lowScore == highScore)
+    {
+        parts[0] = trees_array[lowScore];
+        return 1;
+    }
+    if (score_bands == nullptr)
+    {
+        buildScoreBands();
+    }
+
+    int count = 0;
+    for (int i = highScore; i >= lowScore; )
+    {
+        assert(count < maxBandParts);
+        if (i - lowbit(i) + 1 >= lowScore)
+        {
+            parts[count++] = &fenwickNode(i);
+            i -= lowbit(i);
+        }
+        else
+        {
+            parts[count++] = trees_array[i--];
+        }
+    }
+    return count;
+}
+
+void Group::buildScoreBands()
+{
+    score_bands = new SumTree*[scale / 2 + 1]();
+    try
+    {
+        //Node i is trees_array[i] together with the nodes i - 1, i - 2, i - 4, ... down to i - lowbit(i) / 2,
+        //which all come before it.
+        for (int i = 2; i <= scale; i += 2)
+        {
+            std::unique_ptr<SumTree> node(SumTree::mergedCopy(*trees_array[i], fenwickNode(i - 1)));
+            for (int child = 2; child < lowbit(i); child *= 2)
+            {
+                node.reset(SumTree::mergedCopy(*node, fenwickNode(i - child)));
+            }
+            score_bands[i / 2] = node.release();
+            account(countTree(score_bands[i / 2], false), TreeMemoryCounters());
+        }
+    }
+    catch (...)
+    {
+        dropScoreBands();
+        throw;
+    }
+}
+
+void Group::dropScoreBands()
+{
+    if (score_bands == nullptr) return;
+
+    for (int i = 1; i <= scale / 2; ++i)
+    {
+        account(TreeMemoryCounters(), countTree(score_bands[i], false));
+        delete score_bands[i];
+    }
+    delete[] score_bands;
+    score_bands = nullptr;
+}
+
+//Odd nodes are the per-score trees, already updated by the caller; only the first node on the path can be odd.
+void Group::updateScoreBands(const Player& player, bool add)
+{
+    for (int i = player.getScore(); i <= scale; i += lowbit(i))
+    {
+        if (i % 2 == 1) continue;
+
+        SumTree* node = score_bands[i / 2];
+        TreeMemoryCounters before = countTree(node, false);
+        if (add)
+        {
+            node->addNode(player.getLevel());
+        }
+        else
+        {
+            node->removeNode(player.getLevel());
+        }
+        account(countTree(node, false), before);
+    }
+}
+
 int Group::getPlayerCount() const
 {
     assert(trees_array[0]->getPlayerCount() == playerCount);
@@ -130,7 +887,18 @@ int Group::getPlayerCount() const
     return playerCount;
 }
 
-int Group::sumLevelOfTopM(int m) const
+int Group::rankOfLevel(int level, int score) const
+{
+    assert(trees_array[0]->getPlayerCount() == playerCount);
+    if (!initialized)
+    {
+        throw Failure("Tried to use uninitialized group (rankOfLevel).");
+    }
+
+    return 1 + (score < 0 ? trees_array[0] : trees_array[score])->countAbove(level);
+}
+
+long long Group::sumLevelOfTopM(int m) const
 {
     assert(trees_array[0]->getPlayerCount() == playerCount);
     if (!initialized)
@@ -141,13 +909,166 @@ int Group::sumLevelOfTopM(int m) const
     return trees_array[0]->sumLevelOfTopM(m);
 }
 
+double Group::approxCountPlayersInRange(int lowerLevel, int higherLevel)
+{
+    if (sketch == nullptr)
+    {
+        buildSketch();
+    }
+    return sketch->countInRange(lowerLevel, higherLevel);
+}
+
+int Group::approxLevelAtPercentile(double percentile)
+{
+    if (sketch == nullptr)
+    {
+        buildSketch();
+    }
+    return sketch->levelAtPercentile(percentile);
+}
+
+double Group::approxSumLevelOfTopM(int m)
+{
+    if (sketch == nullptr)
+    {
+        buildSketch();
+    }
+    return sketch->sumOfTopM(m);
+}
+
+void Group::buildSketch()
+{
+    assert(trees_array[0]->getPlayerCount() == playerCount);
+    if (!initialized)
+    {
+        throw Failure("Tried to use uninitialized group (buildSketch).");
+    }
+
+    LevelSketch* built = new LevelSketch();
+    auto add = [built](int level, int inThisLevel)
+    {
+        built->add(level, inThisLevel);
+        return true;
+    };
+    trees_array[0]->forEachLevelDescending(add);
+    built->add(0, trees_array[0]->getLevelZero());
+
+    sketch = built;
+    TreeMemoryCounters added;
+    added.sketches = 1;
+    account(added, TreeMemoryCounters());
+}
+
+void Group::dropSketch()
+{
+    if (sketch == nullptr) return;
+
+    delete sketch;
+    sketch = nullptr;
+    TreeMemoryCounters dropped;
+    dropped.sketches = 1;
+    account(TreeMemoryCounters(), dropped);
+}
+
+bool Group::findCachedResult(QueryCache::Kind kind, int a, int b, int c, double* result, bool* failed)
+{
+    return cache != nullptr && cache->lookup(epoch, kind, a, b, c, result, failed);
+}
+
+void Group::cacheResult(QueryCache::Kind kind, int a, int b, int c, double result, bool failed)
+{
+    if (cache == nullptr)
+    {
+        cache = new QueryCache();
+        TreeMemoryCounters added;
+        added.caches = 1;
+        account(added, TreeMemoryCounters());
+    }
+    cache->store(epoch, kind, a, b, c, result, failed);
+}
+
+void Group::dropCache()
+{
+    if (cache == nullptr) return;
+
+    delete cache;
+    cache = nullptr;
+    TreeMemoryCounters dropped;
+    dropped.caches = 1;
+    account(TreeMemoryCounters(), dropped);
+}
+
+const TreeMemoryCounters& Group::getTreeCounters() const
+{
+    return counters;
+}
+
+std::size_t Group::getTreeDataSize(int index) const
+{
+    if (!initialized || index < 0 || index > scale)
+    {
+        throw InvalidInput("Invalid tree index (getTreeDataSize).");
+    }
+    const SumTree* tree = trees_array[index];
+    return tree == nullptr ? 0 : (std::size_t)tree->getNodeCount() * sizeof(SumTreeNode)
+        + (std::size_t)tree->getSmallCount() * sizeof(SumTree::LevelCount) + tree->getDenseSize();
+}
+
+std::unique_ptr<GroupSnapshot> Group::takeSnapshot()
+{
+    assert(trees_array[0]->getPlayerCount() == playerCount);
+    if (!initialized)
+    {
+        throw Failure("Tried to use uninitialized group (takeSnapshot).");
+    }
+
+    std::unique_ptr<GroupSnapshot> snapshot(new GroupSnapshot(scale, playerCount));
+    snapshot->trees.reserve(scale + 1);
+    for (int i = 0; i < scale + 1; ++i)
+    {
+        snapshot->trees.push_back(trees_array[i]->takeSnapshot());
+    }
+    return snapshot;
+}
+
+int GroupSnapshot::getScale() const
+{
+    return scale;
+}
+
+int GroupSnapshot::getPlayerCount() const
+{
+    return playerCount;
+}
+
+int GroupSnapshot::countPlayersInRange(int lowerLevel, int higherLevel) const
+{
+    return trees[0]->countInRange(lowerLevel, higherLevel);
+}
+
+void GroupSnapshot::countPlayersInRangeWithScore(int lowerLevel, int higherLevel, int score,
+                                                 int* inRange, int* inRangeWithScore) const
+{
+    *inRange = trees[0]->countInRange(lowerLevel, higherLevel);
+    const SumTree::Snapshot& scoreTree = score < 0 ? *trees[0] : *trees[score];
+    *inRangeWithScore = *inRange == 0 ? 0 : scoreTree.countInRange(lowerLevel, higherLevel);
+}
+
+long long GroupSnapshot::sumLevelOfTopM(int m) const
+{
+    return trees[0]->sumLevelOfTopM(m);
+}
+
 void Group::clean()
 {
     if (!initialized) return;
 
+    dropScoreBands();
+    dropSketch();
+    dropCache();
     for (int i = 0; i < scale + 1; ++i)
     {
-        delete trees_array[i];
+        SumTree::release(trees_array[i]);
     }
     delete[] trees_array;
 }
@@ -2,8 +2,49 @@
 #define GROUP_H
 
 #include "SumTree.hpp"
+#include "LevelSketch.hpp"
+#include "QueryCache.hpp"
 #include "Player.hpp"
 #include <memory>
+#include <vector>
+
+/*
+ * Memory accounting for the trees of one or more groups, kept up to date on every change so it
+ * can be read in O(1).
+ */
+struct TreeMemoryCounters
+{
+    long long nodes; //SumTreeNodes in use over all the trees.
+    long long allPlayersNodes; //The part of nodes that is in all-players trees (trees_array[0]).
+    long long nodeSlots; //SumTreeNodes the trees' pools hold, in use or not.
+    long long smallLevels; //Array entries of the trees that keep their levels in one (see SumTree).
+    long long smallSlots; //Array entries those hold, in use or not.
+    long long denseBytes; //Dense counts of the low levels, of the trees past the array.
+    long long liveTrees; //SumTree objects currently allocated.
+    long long emptyTrees; //Live trees without a single player.
+    long long sketches; //LevelSketch objects.
+    long long caches; //QueryCache objects.
+
+    TreeMemoryCounters() : nodes(0), allPlayersNodes(0), nodeSlots(0), smallLevels(0), smallSlots(0), denseBytes(0),
+        liveTrees(0), emptyTrees(0), sketches(0), caches(0)
+    {}
+
+    void add(const TreeMemoryCounters& other, int sign = 1)
+    {
+        nodes += sign * other.nodes;
+        allPlayersNodes += sign * other.allPlayersNodes;
+        nodeSlots += sign * other.nodeSlots;
+        smallLevels += sign * other.smallLevels;
+        smallSlots += sign * other.smallSlots;
+        denseBytes += sign * other.denseBytes;
+        liveTrees += sign * other.liveTrees;
+        emptyTrees += sign * other.emptyTrees;
+        sketches += sign * other.sketches;
+        caches += sign * other.caches;
+    }
+};
+
+class GroupSnapshot;
 
 class Group
 {
@@ -12,13 +53,75 @@ class Group
         SumTree** trees_array;
         int playerCount;
         bool initialized;
+        TreeMemoryCounters counters;
+        TreeMemoryCounters* shared; //Totals over several groups, also updated if not null.
+
+        /*
+         * Score bands: a Fenwick tree over the scores whose nodes are SumTrees, node i holding the
+         * players with a score in (i - lowbit(i), i]. For odd i that is just trees_array[i], so
+         * only the even nodes are kept here (node i at score_bands[i / 2]).
+         * Built on the first band query and kept up to date from then on; a merge drops it.
+         */
+        SumTree** score_bands;
+
+        //Approximate level distribution of all the group's players. Built on the first approximate query,
+        //then kept up to date and merged along with the group.
+        LevelSketch* sketch;
+
+        void buildSketch();
+        void dropSketch();
+
+        unsigned long long epoch; //Bumped by every change to the group's players.
+        QueryCache* cache; //Allocated with the first cached result.
+
+        void dropCache();
+
         int countPlayersInRange_Aux(int lowerLevel, int higherLevel, int score=-1) const;
 
+        //What a single tree (trees_array[index]) contributes to the counters.
+        TreeMemoryCounters countTree(int index) const;
+        static TreeMemoryCounters countTree(const SumTree* tree, bool allPlayers);
+
+        static int lowbit(int i)
+        {
+            return i & -i;
+        }
+
+        const SumTree& fenwickNode(int i) const
+        {
+            return i % 2 == 1 ? *trees_array[i] : *score_bands[i / 2];
+        }
+
+        void buildScoreBands();
+        void dropScoreBands();
+        void updateScoreBands(const Player& player, bool add);
+
+        //Splits [lowScore, highScore] into disjoint Fenwick nodes; returns how many went into parts.
+        static const int maxBandParts = 64;
+        int scoreBandParts(int lowScore, int highScore, const SumTree** parts);
+
+        //Same, except that a band of 0 is every player: just the all-players tree.
+        int filteredParts(int lowScore, int highScore, const SumTree** parts);
+
+        //Players at or above level, by rank: level 0 and below is everyone. level may be one past the int range.
+        static int countAtLeast(const SumTree& tree, long long level);
+
+        //The level of the rank-th highest player of the tree (from 1).
+        static int levelOfRank(const SumTree& tree, int rank);
+
+        //Below this many nodes in all the trees involved, a merge stays on the calling thread.
+        static const long long parallelMergeThreshold = 1 << 16;
+
+        //Applies after - before to the counters (and the shared ones).
+        void account(const TreeMemoryCounters& after, const TreeMemoryCounters& before);
+
     public:
-        Group() : scale(-1), trees_array(nullptr), playerCount(0), initialized(false) {} //For array initialization.
+        Group() : scale(-1), trees_array(nullptr), playerCount(0), initialized(false), counters(), shared(nullptr),
+            score_bands(nullptr), sketch(nullptr), epoch(0), cache(nullptr)
+        {} //For array initialization.
         explicit Group(int scale);
 
-        void init(int scale);
+        void init(int scale, TreeMemoryCounters* shared = nullptr);
 
         Group(Group& g) = delete;
         Group& operator=(Group& g) = delete;
@@ -29,25 +132,154 @@ class Group
             return trees_array[0]->getPlayerCount() == playerCount;
         }
 
-        void addPlayer(const Player& player);
+        /*
+         * Room for additions and removals of players of the player's score, in the trees they go through
+         * (all players' and the score's), so that those don't throw: see SumTree::reserveUpdates. Throws with
+         * nothing reserved if it can't be had; releaseUpdates takes back what won't be used, endUpdates all.
+         */
+        void reserveUpdates(const Player& player, int additions, int removals);
+        void releaseUpdates(const Player& player, int additions, int removals);
+        void endUpdates(const Player& player);
+        void endUpdates(); //Of every tree.
+
+        //Changes nothing if it fails. With reserved (the room had with reserveUpdates), it doesn't throw.
+        void addPlayer(const Player& player, bool reserved = false);
+
+        void removePlayer(const Player& player, bool reserved = false);
+
+        /*
+         * Takes part's players off this group, which must have them all (players_by_level does). Player by
+         * player if part is small next to this group's trees, otherwise every tree is rebuilt in one linear
+         * difference (SumTree::difference), whichever touches less. The removals are only done while no
+         * snapshot shares the trees, when they can't fail, so a failure leaves the group as it was.
+         * With replaced, the group can be put back as it was without failing: rebuilt trees leave the old ones
+         * at the end of replaced (for restoreTrees) instead of releasing them, and removals leave the room to
+         * add part's players back reserved (see reserveUpdates).
+         */
+        void subtractGroup(const Group& part, std::vector<SumTree*>* replaced = nullptr);
+
+        //Drops every player in O(the group's size), leaving the group empty and usable. This also brings
+        //back a group that was merged into another one (and lost its trees to it).
+        void clear();
+
+        //clear in two steps, for callers that must not fail halfway: the empty trees are made first (this
+        //may throw), and clear(fresh) takes them over and doesn't throw. With replaced, which must have the
+        //room (see reserveReplaced), the old trees go at its end instead of being released.
+        std::vector<SumTree*> makeEmptyTrees() const;
+        void clear(std::vector<SumTree*>& fresh, std::vector<SumTree*>* replaced = nullptr);
+
+        //Room in replaced (if not null) for count more trees.
+        static void reserveReplaced(std::vector<SumTree*>* replaced, std::size_t count);
+
+        //Puts back scale + 1 trees that a call above kept in replaced, releasing the ones the group has now
+        //(if any, a merged away group has none). Doesn't throw.
+        void restoreTrees(SumTree* const* kept);
 
-        void removePlayer(const Player& player);
+        //Trades players (trees and all) with other, of the same scale, without throwing: a group can be
+        //filled on the side and then put in place in one step. A merged away group may take part.
+        void swapTrees(Group& other);
 
         SumTree** getPlayers() const;
 
         void mergeGroups(Group& g);
 
+        //Merges all count groups into this one at once, with a single build per tree. With replaced, the
+        //groups' old trees go at its end instead of being released: the others' in order, then this one's.
+        void mergeGroups(Group** others, int count, std::vector<SumTree*>* replaced = nullptr);
+
         int countPlayersWithScoreInRange(int lowerLevel, int higherLevel, int score) const;
 
         int countPlayersInRange(int lowerLevel, int higherLevel) const;
 
+        //Both counts of a percentage query at once: all players in the range, and those of them with the score.
+        void countPlayersInRangeWithScore(int lowerLevel, int higherLevel, int score,
+                                          int* inRange, int* inRangeWithScore) const;
+
+        /*
+         * Score band versions of the queries above, for every score in [lowScore, highScore]
+         * (1 <= lowScore <= highScore <= scale).
+         */
+        void countPlayersInRangeWithScoreBand(int lowerLevel, int higherLevel, int lowScore, int highScore,
+                                              int* inRange, int* inRangeWithScore);
+
+        int countPlayersWithScoreBandInRange(int lowerLevel, int higherLevel, int lowScore, int highScore);
+
+        int getPlayerCountInScoreBand(int lowScore, int highScore);
+
+        //Sum of the m highest levels among the band's players. m must be at most their count.
+        long long sumLevelOfTopMInScoreBand(int m, int lowScore, int highScore);
+
+        /*
+         * Distribution of the levels in [lowerLevel, higherLevel], among the players with a score in
+         * [lowScore, highScore] or, if both are 0, all of them. The moments are the players' count, the
+         * sum of their levels and of the squared levels (modulo 2^64, see SumTree), in O(log n) per tree of
+         * the band. lowest and highest get the lowest and highest level among them (if any), from two rank
+         * queries more per tree.
+         */
+        void levelMomentsInRange(int lowerLevel, int higherLevel, int lowScore, int highScore, int* players,
+                                 long long* levelSum, unsigned long long* squareSum, int* lowest, int* highest);
+
+        //Counts of buckets equal-width buckets splitting [lowerLevel, higherLevel] (the widths differ by at
+        //most one), from buckets + 1 rank queries per tree of the band.
+        void levelHistogram(int lowerLevel, int higherLevel, int lowScore, int highScore, int buckets, int* counts);
+
         int getPlayerCount() const;
 
-        int sumLevelOfTopM(int m) const;
+        //1 + the number of players above level, among all of the group's players or those with the score.
+        int rankOfLevel(int level, int score=-1) const;
+
+        long long sumLevelOfTopM(int m) const;
+
+        //Approximate versions of the queries, answered from the sketch (see LevelSketch for the error bounds).
+        double approxCountPlayersInRange(int lowerLevel, int higherLevel);
+
+        int approxLevelAtPercentile(double percentile);
+
+        double approxSumLevelOfTopM(int m);
+
+        //Results of this group's queries, valid until the group changes (see QueryCache).
+        bool findCachedResult(QueryCache::Kind kind, int a, int b, int c, double* result, bool* failed);
+        void cacheResult(QueryCache::Kind kind, int a, int b, int c, double result, bool failed);
+
+        const TreeMemoryCounters& getTreeCounters() const;
+
+        //Bytes of the levels of the given tree (0 for all players, otherwise a score): nodes or array entries.
+        std::size_t getTreeDataSize(int index) const;
+
+        //O(scale): a snapshot of every tree. Updates to the group copy what they touch from then on.
+        std::unique_ptr<GroupSnapshot> takeSnapshot();
 
         void clean();
 
         ~Group();
 };
 
+//A frozen view of a group, answering its queries as they stood when it was taken. It outlives the group.
+class GroupSnapshot
+{
+    private:
+        int scale;
+        int playerCount;
+        std::vector<std::unique_ptr<SumTree::Snapshot> > trees; //Indexed like Group's trees_array.
+
+        GroupSnapshot(int scale, int playerCount) : scale(scale), playerCount(playerCount), trees() {}
+
+        friend class Group;
+
+    public:
+        GroupSnapshot(const GroupSnapshot& other) = delete;
+        GroupSnapshot& operator=(const GroupSnapshot& other) = delete;
+
+        int getScale() const;
+
+        int getPlayerCount() const;
+
+        int countPlayersInRange(int lowerLevel, int higherLevel) const;
+
+        void countPlayersInRangeWithScore(int lowerLevel, int higherLevel, int score,
+                                          int* inRange, int* inRangeWithScore) const;
+
+        long long sumLevelOfTopM(int m) const;
+};
+
 #endif //GROUP_H
\ No newline at end of file
@@ -1,8 +1,12 @@
 #include "GroupsUnionFind.hpp"
 
+#include <algorithm>
+#include <unordered_map>
+
 /*
  * Receives the ID of a group, and returns the ID of its superset: the number of the group at the root
  * of the disjoint set in which the group with this ID is contained.
+ * No path compression, so that unions can be undone; union by size keeps the paths O(log k).
  */
 int GroupsUnionFind::findGroupId(int id)
 {
@@ -11,23 +15,7 @@ int GroupsUnionFind::findGroupId(int id)
         throw InvalidInput("Invalid group ID passed to findGroup.");
     }
 
-    //Will have to deduct 1 on access because the array has an offset.
-    int root, curr = id, next;
-
-    root = findRoot(id);
-
-    //Path compression:
-    if (root != curr)
-    {
-        while (parents[curr - 1] != root) {
-            next = parents[curr - 1];
-            parents[curr - 1] = root;
-            assert(curr != root);
-            curr = next;
-        }
-    }
-
-    return root;
+    return findRoot(id);
 }
 
 int GroupsUnionFind::findRoot(int groupId)
@@ -55,28 +43,145 @@ Group& GroupsUnionFind::uniteGroups(int id1, int id2)
         //throw Failure ("Tried to merge groups that were already merged.");
         return sets[id1 - 1]; //Apparently this is considered a success.
     }
-    const Group& g1 = findGroup(id1);
-    const Group& g2 = findGroup(id2);
-    int from = g1.getPlayerCount() <= g2.getPlayerCount() ? id1 : id2,
-            to = g1.getPlayerCount() <= g2.getPlayerCount() ? id2 : id1;
+    int to = survivor(id1, id2), from = to == id1 ? id2 : id1;
 
-    parents[from - 1] = to;
+    sets[to - 1].mergeGroups(sets[from - 1]); //Leaves both groups as they were if it fails.
 
-    sets[to - 1].mergeGroups(sets[from - 1]);
+    parents[from - 1] = to;
+    sizes[to - 1] += sizes[from - 1];
+    unions.push_back(std::make_pair(from, to));
 
     return sets[to - 1];
 }
 
-GroupsUnionFind::GroupsUnionFind(int k, int scale) : sets(new Group[k]), sizes(new int[k]), parents(new int[k]), k(k), scale(scale)
+int GroupsUnionFind::survivor(int root1, int root2) const
+{
+    if (sizes[root1 - 1] != sizes[root2 - 1])
+    {
+        return sizes[root1 - 1] > sizes[root2 - 1] ? root1 : root2;
+    }
+    return std::min(root1, root2);
+}
+
+int GroupsUnionFind::getUnionCount() const
+{
+    return (int)unions.size();
+}
+
+int GroupsUnionFind::undoUnion(int* into)
+{
+    if (unions.empty())
+    {
+        throw Failure("No union to undo.");
+    }
+
+    int from = unions.back().first;
+    *into = unions.back().second;
+    unions.pop_back();
+    parents[from - 1] = 0;
+    sizes[*into - 1] -= sizes[from - 1];
+    return from;
+}
+
+void GroupsUnionFind::redoUnion(int absorbed, int into)
+{
+    parents[absorbed - 1] = into;
+    sizes[into - 1] += sizes[absorbed - 1];
+    unions.push_back(std::make_pair(absorbed, into));
+}
+
+std::vector<std::vector<int> > GroupsUnionFind::resolveSets(const int* pairs, int n)
 {
+    //A union-find of its own, over the roots the pairs lead to; the real one isn't touched.
+    std::unordered_map<int, int> links;
+    auto find = [&links](int id)
+    {
+        int root = id;
+        while (links[root] != root)
+        {
+            root = links[root];
+        }
+        while (links[id] != root)
+        {
+            int next = links[id];
+            links[id] = root;
+            id = next;
+        }
+        return root;
+    };
+
+    for (int i = 0; i < n; ++i)
+    {
+        int root1 = findGroupId(pairs[2 * i]), root2 = findGroupId(pairs[2 * i + 1]);
+        links.emplace(root1, root1);
+        links.emplace(root2, root2);
+        root1 = find(root1);
+        root2 = find(root2);
+        if (root1 != root2)
+        {
+            links[root1] = root2;
+        }
+    }
+
+    std::vector<int> ids;
+    ids.reserve(links.size());
+    for (const auto& link : links)
+    {
+        ids.push_back(link.first);
+    }
+    std::sort(ids.begin(), ids.end()); //So that the groups are merged in the same order every time.
+
+    std::unordered_map<int, std::size_t> setOf;
+    std::vector<std::vector<int> > united;
+    for (int id : ids)
+    {
+        auto found = setOf.emplace(find(id), united.size());
+        if (found.second)
+        {
+            united.emplace_back();
+        }
+        united[found.first->second].push_back(id);
+    }
+
+    std::vector<std::vector<int> > result;
+    for (std::vector<int>& set : united)
+    {
+        if (set.size() < 2) continue;
+        //Like uniteGroups, the biggest set stays (the lowest ID among equals, the IDs being sorted).
+        std::size_t biggest = 0;
+        for (std::size_t i = 1; i < set.size(); ++i)
+        {
+            if (survivor(set[biggest], set[i]) == set[i]) biggest = i;
+        }
+        std::swap(set[0], set[biggest]);
+        result.push_back(std::move(set));
+    }
+    return result;
+}
+
+GroupsUnionFind::GroupsUnionFind(int k, int scale) : sets(new Group[k]), sizes(new int[k]), parents(new int[k]), k(k), scale(scale),
+    treeCounters(), unions()
+{
+    unions.reserve(k); //There are never more than k - 1, so recording one can't fail.
     for (int i=0; i < k; i++)
     {
-        sets[i].init(scale);
-        sizes[i] = 0;
+        sets[i].init(scale, &treeCounters);
+        sizes[i] = 1;
         parents[i] = 0;
     }
 }
 
+const TreeMemoryCounters& GroupsUnionFind::getTreeCounters() const
+{
+    return treeCounters;
+}
+
+std::size_t GroupsUnionFind::getArraysSize() const
+{
+    return (std::size_t)k * (sizeof(Group) + sizeof(*sizes) + sizeof(*parents))
+        + unions.capacity() * sizeof(std::pair<int, int>);
+}
+
 GroupsUnionFind::~GroupsUnionFind()
 {
     delete[] sets;
@@ -3,21 +3,34 @@
 
 #include "Group.hpp"
 #include <memory>
+#include <utility>
+#include <vector>
 
-
+/*
+ * The groups, as disjoint sets of group IDs. Union by size (the number of IDs in a set) and no path
+ * compression: finds are O(log k), and a union only ever changes the absorbed root's parent, so every
+ * union is recorded and can be undone, the latest first.
+ */
 class GroupsUnionFind
 {
     private:
         Group* sets;
-        int* sizes;
+        int* sizes; //IDs in the set, for roots.
         int* parents;
         int k;
         int scale;
-
-        int findGroupId(int id);
+        TreeMemoryCounters treeCounters; //Over all the groups.
+        std::vector<std::pair<int, int> > unions; //The absorbed root and the one it went into, oldest first.
 
         int findRoot(int groupId);
 
+        //Of two roots, the one that stays: the bigger set, the lower ID among equals.
+        int survivor(int root1, int root2) const;
+
+        //The sets that uniting every pair would leave, as the IDs of the current roots in them (those
+        //of at least two), the survivor of each (the biggest set) first.
+        std::vector<std::vector<int> > resolveSets(const int* pairs, int n);
+
     public:
         GroupsUnionFind(int k, int scale);
 
@@ -26,8 +39,66 @@ class GroupsUnionFind
 
         Group& findGroup(int id);
 
+        //The ID of the group at the root of id's set: the one findGroup returns.
+        int findGroupId(int id);
+
         Group& uniteGroups(int id1, int id2);
 
+        /*
+         * Unites the groups of n pairs (pairs[2i], pairs[2i + 1]) at once: the final sets are worked out on
+         * the union-find alone, then each one's groups are merged into its biggest in a single k-way merge,
+         * instead of rebuilding the growing group's trees once per pair.
+         * beforeMerge(absorbed, into, absorbedId, intoId) is called for every group about to be merged away,
+         * and afterMerge(absorbedId, intoId), which mustn't throw, once it is. A set whose merge fails is left
+         * as it was, the sets merged before it stay merged.
+         * With replaced, each set's old trees go at its end (see Group::mergeGroups), for undoing its unions to
+         * put back: those of the groups it absorbed, in the order of their unions, then the survivor's.
+         */
+        template <class B, class A>
+        void uniteGroups(const int* pairs, int n, B& beforeMerge, A& afterMerge,
+                         std::vector<SumTree*>* replaced = nullptr)
+        {
+            std::vector<std::vector<int> > united = resolveSets(pairs, n);
+            std::vector<Group*> absorbed;
+            for (std::size_t cnt = 0; cnt < united.size(); ++cnt)
+            {
+                const std::vector<int>& ids = united[cnt];
+                Group& into = sets[ids[0] - 1];
+                absorbed.clear();
+                for (std::size_t i = 1; i < ids.size(); ++i)
+                {
+                    absorbed.push_back(&sets[ids[i] - 1]);
+                    beforeMerge((const Group&)*absorbed.back(), (const Group&)into, ids[i], ids[0]);
+                }
+                unions.reserve(unions.size() + absorbed.size()); //So that the unions below can't fail.
+                into.mergeGroups(absorbed.data(), (int)absorbed.size(), replaced);
+                for (std::size_t i = 1; i < ids.size(); ++i)
+                {
+                    parents[ids[i] - 1] = ids[0];
+                    sizes[ids[0] - 1] += sizes[ids[i] - 1];
+                    unions.push_back(std::make_pair(ids[i], ids[0]));
+                    afterMerge(ids[i], ids[0]);
+                }
+            }
+        }
+
+        //Unions done so far (MergeGroups of groups already together don't count).
+        int getUnionCount() const;
+
+        /*
+         * Undoes the latest union in the sets alone, and returns the root it absorbed; *into gets the root
+         * it went into. The groups' players stay where they are, the caller moves them back.
+         */
+        int undoUnion(int* into);
+
+        //Puts back the union undoUnion just took back. Doesn't throw: its room in unions is still there.
+        void redoUnion(int absorbed, int into);
+
+        const TreeMemoryCounters& getTreeCounters() const;
+
+        //Bytes of the group objects and the union-find arrays (the trees are accounted separately).
+        std::size_t getArraysSize() const;
+
         ~GroupsUnionFind();
 };
 #endif //UNION_FIND_H
\ No newline at end of file
@@ -0,0 +1,5 @@
+#include "Instrumentation.hpp"
+
+#ifdef GAME_SYSTEM_STATS
+thread_local Stats* Instrumentation::current = nullptr;
+#endif
@@ -0,0 +1,146 @@
+#ifndef INSTRUMENTATION_H
+#define INSTRUMENTATION_H
+
+#include "library2.h"
+
+/*
+ * Compile-time toggled probes. Build with GAME_SYSTEM_STATS defined to collect the Stats of
+ * library2.h; without it every probe below expands to nothing.
+ *
+ * Each GameSystem owns its Stats. The library2 entry points make it the current one for the
+ * duration of the call, which is how the probes deep inside the structures (rotations, rehashes)
+ * find it without holding a pointer back to the GameSystem. The current one is per thread, so calls
+ * on different threads (into different GameSystems) each charge their own. Tasks run on the shared
+ * pool detach from it: they would all write the caller's Stats at once, so their probes are dropped.
+ */
+#ifdef GAME_SYSTEM_STATS
+
+#include <chrono>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace Instrumentation
+{
+    extern thread_local Stats* current;
+
+    inline unsigned long long now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    inline void clear(Stats& stats)
+    {
+        std::memset(&stats, 0, sizeof(stats));
+    }
+
+    //Makes stats current for the lifetime of the scope, and charges it with the call.
+    class ApiScope
+    {
+    private:
+        Stats* previous;
+        Stats& stats;
+        StatsApi api;
+        unsigned long long start;
+
+    public:
+        ApiScope(Stats& stats, StatsApi api) : previous(current), stats(stats), api(api), start(now())
+        {
+            current = &stats;
+        }
+
+        ApiScope(const ApiScope& other) = delete;
+        ApiScope& operator=(const ApiScope& other) = delete;
+
+        void finish(StatusType status)
+        {
+            ++stats.calls[api];
+            ++stats.statuses[api][-status];
+            stats.cycles[api] += now() - start;
+        }
+
+        ~ApiScope()
+        {
+            current = previous;
+        }
+    };
+
+    //No current Stats for the lifetime of the scope (on whichever thread it runs).
+    class Detached
+    {
+    private:
+        Stats* previous;
+
+    public:
+        Detached() : previous(current)
+        {
+            current = nullptr;
+        }
+
+        Detached(const Detached& other) = delete;
+        Detached& operator=(const Detached& other) = delete;
+
+        ~Detached()
+        {
+            current = previous;
+        }
+    };
+
+    //Adds the time spent in the scope to counter (if there is a current Stats).
+    class ScopedTimer
+    {
+    private:
+        unsigned long long* counter;
+        unsigned long long start;
+
+    public:
+        explicit ScopedTimer(unsigned long long Stats::* field)
+            : counter(current == nullptr ? nullptr : &(current->*field)), start(now())
+        {}
+
+        ScopedTimer(const ScopedTimer& other) = delete;
+        ScopedTimer& operator=(const ScopedTimer& other) = delete;
+
+        ~ScopedTimer()
+        {
+            if (counter != nullptr)
+            {
+                *counter += now() - start;
+            }
+        }
+    };
+}
+
+#define STATS_API_BEGIN(stats, api) Instrumentation::ApiScope statsScope((stats), (api))
+#define STATS_API_END(status) statsScope.finish(status)
+#define STATS_INCREMENT(field) \
+    do { if (Instrumentation::current != nullptr) ++Instrumentation::current->field; } while (0)
+#define STATS_ADD(field, amount) \
+    do { if (Instrumentation::current != nullptr) Instrumentation::current->field += (amount); } while (0)
+#define STATS_MAX(field, value) \
+    do { \
+        if (Instrumentation::current != nullptr && Instrumentation::current->field < (unsigned long long)(value)) \
+            Instrumentation::current->field = (value); \
+    } while (0)
+#define STATS_TIME_SCOPE(field) Instrumentation::ScopedTimer statsTimer(&Stats::field)
+#define STATS_DETACH() Instrumentation::Detached statsDetached
+
+#else
+
+#define STATS_API_BEGIN(stats, api) do {} while (0)
+#define STATS_API_END(status) do {} while (0)
+#define STATS_INCREMENT(field) do {} while (0)
+#define STATS_ADD(field, amount) do {} while (0)
+#define STATS_MAX(field, value) do {} while (0)
+#define STATS_TIME_SCOPE(field) do {} while (0)
+#define STATS_DETACH() do {} while (0)
+
+#endif //GAME_SYSTEM_STATS
+
+#endif //INSTRUMENTATION_H
@@ -0,0 +1,114 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <cstdint>
+#include <cstring>
+
+/*
+ * HDR-style log-linear histogram of latencies (in nanoseconds, or any other unsigned unit).
+ * Every power of two is split into 2^subBucketBits linear sub-buckets, so any recorded value is
+ * reported within a relative error of 2^-subBucketBits (about 3%), in constant memory and with
+ * an O(1) record().
+ */
+class LatencyHistogram
+{
+private:
+    static const int subBucketBits = 5;
+    static const int subBucketCount = 1 << subBucketBits;
+    static const int bucketCount = subBucketCount * (64 - subBucketBits + 1);
+
+    uint64_t counts[bucketCount];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+
+    static int highestBit(uint64_t value)
+    {
+        int bit = 0;
+        while (value >>= 1)
+        {
+            ++bit;
+        }
+        return bit;
+    }
+
+    static int indexOf(uint64_t value)
+    {
+        if (value < (uint64_t)subBucketCount)
+        {
+            return (int)value;
+        }
+        int magnitude = highestBit(value), shift = magnitude - subBucketBits;
+        return subBucketCount * (shift + 1) + (int)((value >> shift) - subBucketCount);
+    }
+
+    //Middle of the range of values that fall into the given bucket.
+    static uint64_t valueOf(int index)
+    {
+        if (index < subBucketCount)
+        {
+            return (uint64_t)index;
+        }
+        int shift = index / subBucketCount - 1;
+        uint64_t lowest = ((uint64_t)(subBucketCount + index % subBucketCount)) << shift;
+        return lowest + (((uint64_t)1 << shift) >> 1);
+    }
+
+public:
+    LatencyHistogram() : total(0), sum(0), max(0)
+    {
+        std::memset(counts, 0, sizeof(counts));
+    }
+
+    void record(uint64_t value)
+    {
+        ++counts[indexOf(value)];
+        ++total;
+        sum += value;
+        if (value > max)
+        {
+            max = value;
+        }
+    }
+
+    uint64_t getCount() const
+    {
+        return total;
+    }
+
+    uint64_t getMax() const
+    {
+        return max;
+    }
+
+    double getMean() const
+    {
+        return total == 0 ? 0 : (double)sum / (double)total;
+    }
+
+    //percentile is in [0, 100].
+    uint64_t getPercentile(double percentile) const
+    {
+        if (total == 0)
+        {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+        if (rank == 0) rank = 1;
+        if (rank > total) rank = total;
+
+        uint64_t seen = 0;
+        for (int i = 0; i < bucketCount; ++i)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+            {
+                uint64_t value = valueOf(i);
+                return value > max ? max : value;
+            }
+        }
+        return max;
+    }
+};
+
+#endif //LATENCY_HISTOGRAM_H
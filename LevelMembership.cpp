@@ -0,0 +1,297 @@
+#include "LevelMembership.hpp"
+
+#include <cstdint>
+
+int LevelMembership::hash(int playerId) const
+{
+    return playerId % membersLength;
+}
+
+int LevelMembership::hash(const Group* owner, int level) const
+{
+    //Group objects are far apart in memory, so the low bits of the address carry little.
+    std::uintptr_t key = ((std::uintptr_t)owner >> 4) * 31 + (unsigned)level;
+    return (int)(key % (std::uintptr_t)listsLength);
+}
+
+LevelMembership::Member* LevelMembership::findMember(int playerId) const
+{
+    Member* current = members[hash(playerId)];
+    while (current != nullptr && current->playerId != playerId)
+    {
+        current = current->chain;
+    }
+    return current;
+}
+
+LevelMembership::List** LevelMembership::findListSlot(const Group* owner, int level) const
+{
+    List** slot = &lists[hash(owner, level)];
+    while (*slot != nullptr && ((*slot)->owner != owner || (*slot)->level != level))
+    {
+        slot = &(*slot)->chain;
+    }
+    return slot;
+}
+
+LevelMembership::List* LevelMembership::findOrAddList(const Group* owner, int level)
+{
+    List** slot = findListSlot(owner, level);
+    if (*slot != nullptr)
+    {
+        return *slot;
+    }
+
+    List* list = new List{ owner, level, nullptr, nullptr, nullptr };
+    *slot = list;
+    ++listCount;
+    rehashLists();
+    return list;
+}
+
+void LevelMembership::removeList(List** slot)
+{
+    List* list = *slot;
+    *slot = list->chain;
+    delete list;
+    --listCount;
+    rehashLists();
+}
+
+void LevelMembership::link(Member* member, Scope scope, const Group* owner)
+{
+    List* list = findOrAddList(owner, member->level);
+    member->prev[scope] = list->tail;
+    member->next[scope] = nullptr;
+    if (list->tail != nullptr)
+    {
+        list->tail->next[scope] = member;
+    }
+    else
+    {
+        list->head = member;
+    }
+    list->tail = member;
+}
+
+void LevelMembership::unlink(Member* member, Scope scope, const Group* owner)
+{
+    Member *prev = member->prev[scope], *next = member->next[scope];
+    if (prev != nullptr && next != nullptr)
+    {
+        //In the middle: the list itself doesn't change.
+        prev->next[scope] = next;
+        next->prev[scope] = prev;
+        return;
+    }
+
+    List** slot = findListSlot(owner, member->level);
+    assert(*slot != nullptr);
+    if (prev == nullptr && next == nullptr)
+    {
+        removeList(slot);
+        return;
+    }
+    if (prev == nullptr)
+    {
+        (*slot)->head = next;
+        next->prev[scope] = nullptr;
+    }
+    else
+    {
+        (*slot)->tail = prev;
+        prev->next[scope] = nullptr;
+    }
+}
+
+/*
+ * Both tables keep their nodes when resized; only the chains are rebuilt.
+ */
+void LevelMembership::rehashMembers()
+{
+    float lf = (float)memberCount / (float)membersLength;
+    int newLength = membersLength;
+    if (lf >= maxLoadFactor)
+    {
+        newLength = membersLength * expansionFactor;
+    }
+    else if (lf < minLoadFactor && membersLength > defaultStartingLength)
+    {
+        newLength = membersLength / expansionFactor;
+    }
+    if (newLength == membersLength) return;
+
+    Member** newTable = new Member*[newLength]();
+    int oldLength = membersLength;
+    membersLength = newLength;
+    for (int cnt = 0; cnt < oldLength; ++cnt)
+    {
+        while (members[cnt] != nullptr)
+        {
+            Member* member = members[cnt];
+            members[cnt] = member->chain;
+            int hashed = hash(member->playerId);
+            member->chain = newTable[hashed];
+            newTable[hashed] = member;
+        }
+    }
+    delete[] members;
+    members = newTable;
+}
+
+void LevelMembership::rehashLists()
+{
+    float lf = (float)listCount / (float)listsLength;
+    int newLength = listsLength;
+    if (lf >= maxLoadFactor)
+    {
+        newLength = listsLength * expansionFactor;
+    }
+    else if (lf < minLoadFactor && listsLength > defaultStartingLength)
+    {
+        newLength = listsLength / expansionFactor;
+    }
+    if (newLength == listsLength) return;
+
+    List** newTable = new List*[newLength]();
+    int oldLength = listsLength;
+    listsLength = newLength;
+    for (int cnt = 0; cnt < oldLength; ++cnt)
+    {
+        while (lists[cnt] != nullptr)
+        {
+            List* list = lists[cnt];
+            lists[cnt] = list->chain;
+            int hashed = hash(list->owner, list->level);
+            list->chain = newTable[hashed];
+            newTable[hashed] = list;
+        }
+    }
+    delete[] lists;
+    lists = newTable;
+}
+
+void LevelMembership::add(const Player& player, const Group* group, const Group* all)
+{
+    if (findMember(player.getPlayerId()) != nullptr)
+    {
+        throw Failure("Tried to add a player that was already a member.");
+    }
+
+    Member* member = new Member(player.getPlayerId(), player.getLevel());
+    int hashed = hash(member->playerId);
+    member->chain = members[hashed];
+    members[hashed] = member;
+    ++memberCount;
+
+    link(member, GROUP, group);
+    link(member, ALL, all);
+    rehashMembers();
+}
+
+void LevelMembership::remove(const Player& player, const Group* group, const Group* all)
+{
+    Member** slot = &members[hash(player.getPlayerId())];
+    while (*slot != nullptr && (*slot)->playerId != player.getPlayerId())
+    {
+        slot = &(*slot)->chain;
+    }
+    if (*slot == nullptr)
+    {
+        throw Failure("Tried to remove a player that isn't a member.");
+    }
+
+    Member* member = *slot;
+    unlink(member, GROUP, group);
+    unlink(member, ALL, all);
+    *slot = member->chain;
+    delete member;
+    --memberCount;
+    rehashMembers();
+}
+
+void LevelMembership::spliceGroup(const Group* from, const Group* into, int level)
+{
+    List** fromSlot = findListSlot(from, level);
+    if (*fromSlot == nullptr)
+    {
+        return;
+    }
+
+    Member *head = (*fromSlot)->head, *tail = (*fromSlot)->tail;
+    removeList(fromSlot);
+
+    List* list = findOrAddList(into, level);
+    head->prev[GROUP] = list->tail;
+    if (list->tail != nullptr)
+    {
+        list->tail->next[GROUP] = head;
+    }
+    else
+    {
+        list->head = head;
+    }
+    list->tail = tail;
+}
+
+void LevelMembership::moveGroup(const Player& player, const Group* from, const Group* into)
+{
+    Member* member = findMember(player.getPlayerId());
+    if (member == nullptr)
+    {
+        throw Failure("Tried to move a player that isn't a member.");
+    }
+
+    unlink(member, GROUP, from);
+    link(member, GROUP, into);
+}
+
+const LevelMembership::Member* LevelMembership::first(const Group* owner, int level, Scope scope) const
+{
+    const List* list = *findListSlot(owner, level);
+    assert(list == nullptr || list->head->prev[scope] == nullptr);
+    return list == nullptr ? nullptr : list->head;
+}
+
+int LevelMembership::getMemberCount() const
+{
+    return memberCount;
+}
+
+std::size_t LevelMembership::getMemorySize() const
+{
+    return (std::size_t)membersLength * sizeof(Member*) + (std::size_t)memberCount * sizeof(Member)
+        + (std::size_t)listsLength * sizeof(List*) + (std::size_t)listCount * sizeof(List);
+}
+
+void LevelMembership::clear()
+{
+    for (int cnt = 0; cnt < membersLength; ++cnt)
+    {
+        while (members[cnt] != nullptr)
+        {
+            Member* temp = members[cnt];
+            members[cnt] = temp->chain;
+            delete temp;
+        }
+    }
+    memberCount = 0;
+
+    for (int cnt = 0; cnt < listsLength; ++cnt)
+    {
+        while (lists[cnt] != nullptr)
+        {
+            List* temp = lists[cnt];
+            lists[cnt] = temp->chain;
+            delete temp;
+        }
+    }
+    listCount = 0;
+}
+
+LevelMembership::~LevelMembership()
+{
+    clear();
+    delete[] members;
+    delete[] lists;
+}
@@ -0,0 +1,124 @@
+#ifndef LEVEL_MEMBERSHIP_H
+#define LEVEL_MEMBERSHIP_H
+
+#include "Player.hpp"
+#include "game_exceptions.hpp"
+#include <cassert>
+#include <cstddef>
+
+class Group;
+
+/*
+ * Which players are at each level, per group and system-wide. The trees only count the players of a
+ * level, this is what lets the top ones be listed.
+ *
+ * Every player has a Member, found by ID, that sits in two doubly linked lists: the one of its group
+ * and level, and the system-wide one of its level. A list is found by its owner (the group at the
+ * root of the union-find set, or the system-wide Group) and level.
+ * Both tables use separate chaining and mod hashing, like PlayersHashTable, and relink their nodes when
+ * resized, so the nodes never move.
+ */
+class LevelMembership
+{
+public:
+    enum Scope { GROUP = 0, ALL = 1 };
+
+    class Member
+    {
+        friend class LevelMembership;
+    private:
+        int playerId;
+        int level;
+        Member* prev[2]; //Indexed by Scope.
+        Member* next[2];
+        Member* chain; //Next in the ID table's bucket.
+
+        Member(int playerId, int level) : playerId(playerId), level(level), prev(), next(), chain(nullptr) {}
+
+    public:
+        int getPlayerId() const
+        {
+            return playerId;
+        }
+
+        int getLevel() const
+        {
+            return level;
+        }
+
+        const Member* getNext(Scope scope) const
+        {
+            return next[scope];
+        }
+    };
+
+private:
+    struct List
+    {
+        const Group* owner;
+        int level;
+        Member* head;
+        Member* tail;
+        List* chain;
+    };
+
+    const int defaultStartingLength = 3;
+    const int expansionFactor = 2;
+    const float maxLoadFactor = 3.0/4.0;
+    const float minLoadFactor = maxLoadFactor / 4;
+
+    int membersLength;
+    int memberCount;
+    Member** members;
+    int listsLength;
+    int listCount;
+    List** lists;
+
+    int hash(int playerId) const;
+    int hash(const Group* owner, int level) const;
+
+    Member* findMember(int playerId) const;
+    List** findListSlot(const Group* owner, int level) const;
+    List* findOrAddList(const Group* owner, int level);
+    void removeList(List** slot);
+
+    void link(Member* member, Scope scope, const Group* owner);
+    void unlink(Member* member, Scope scope, const Group* owner);
+
+    //Expands or contracts the given table if needed.
+    void rehashMembers();
+    void rehashLists();
+
+public:
+    LevelMembership() : membersLength(defaultStartingLength), memberCount(0),
+        members(new Member*[membersLength]()), listsLength(defaultStartingLength), listCount(0),
+        lists(new List*[listsLength]())
+    {}
+    LevelMembership(const LevelMembership& other) = delete;
+    LevelMembership& operator=(const LevelMembership& other) = delete;
+
+    void add(const Player& player, const Group* group, const Group* all);
+
+    void remove(const Player& player, const Group* group, const Group* all);
+
+    //Appends from's list of the given level to into's (in the GROUP scope); from's list is gone after.
+    void spliceGroup(const Group* from, const Group* into, int level);
+
+    //Moves a member from from's list of its level to the end of into's (in the GROUP scope).
+    void moveGroup(const Player& player, const Group* from, const Group* into);
+
+    //First player of owner's list for the level (nullptr if there is none). Follow with getNext(scope).
+    const Member* first(const Group* owner, int level, Scope scope) const;
+
+    int getMemberCount() const;
+
+    //Drops every member and list.
+    void clear();
+
+    //Bytes of the tables, lists and members.
+    std::size_t getMemorySize() const;
+
+    ~LevelMembership();
+};
+
+#endif //LEVEL_MEMBERSHIP_H
@@ -0,0 +1,173 @@
+#include "LevelSketch.hpp"
+#include "game_exceptions.hpp"
+
+#include <cassert>
+#include <cmath>
+
+LevelSketch::LevelSketch(int subBucketBits) : subBucketBits(subBucketBits), subBucketCount(1 << subBucketBits),
+    bucketCount((31 - subBucketBits + 1) * subBucketCount), counts(), sums(), playerCount(0), levelSum(0)
+{
+    if (subBucketBits < 0 || subBucketBits > maxSubBucketBits)
+    {
+        throw InvalidInput("LevelSketch: unsupported precision.");
+    }
+    counts.assign(bucketCount + 1, 0);
+    sums.assign(bucketCount + 1, 0);
+}
+
+int LevelSketch::bucketOf(int level) const
+{
+    assert(level >= 0);
+    if (level < subBucketCount)
+    {
+        return level;
+    }
+    int exponent = 31 - __builtin_clz((unsigned)level), shift = exponent - subBucketBits;
+    return (shift + 1) * subBucketCount + ((level >> shift) - subBucketCount);
+}
+
+long long LevelSketch::bucketLow(int bucket) const
+{
+    if (bucket < subBucketCount)
+    {
+        return bucket;
+    }
+    int shift = bucket / subBucketCount - 1;
+    return (long long)(subBucketCount + bucket % subBucketCount) << shift;
+}
+
+long long LevelSketch::bucketWidth(int bucket) const
+{
+    return bucket < subBucketCount ? 1 : 1LL << (bucket / subBucketCount - 1);
+}
+
+int LevelSketch::countBefore(int bucket) const
+{
+    int count = 0;
+    for (int i = bucket; i > 0; i -= i & -i)
+    {
+        count += counts[i];
+    }
+    return count;
+}
+
+long long LevelSketch::sumBefore(int bucket) const
+{
+    long long sum = 0;
+    for (int i = bucket; i > 0; i -= i & -i)
+    {
+        sum += sums[i];
+    }
+    return sum;
+}
+
+int LevelSketch::bucketOfRank(int rank) const
+{
+    assert(rank >= 1 && rank <= playerCount);
+    //Standard Fenwick descent: the longest prefix holding fewer than rank players.
+    int position = 0, step = 1;
+    while (step * 2 <= bucketCount) step *= 2;
+    for (; step > 0; step /= 2)
+    {
+        if (position + step <= bucketCount && counts[position + step] < rank)
+        {
+            position += step;
+            rank -= counts[position];
+        }
+    }
+    return position; //Fenwick position + 1, minus 1 for the 0-based bucket.
+}
+
+double LevelSketch::countUpTo(int level) const
+{
+    if (level < 0)
+    {
+        return 0;
+    }
+    int bucket = bucketOf(level);
+    int below = countBefore(bucket), inBucket = countBefore(bucket + 1) - below;
+    double fraction = (double)(level - bucketLow(bucket) + 1) / bucketWidth(bucket);
+    return below + fraction * inBucket;
+}
+
+void LevelSketch::add(int level, int delta)
+{
+    if (level < 0)
+    {
+        throw InvalidInput("LevelSketch: negative level.");
+    }
+    for (int i = bucketOf(level) + 1; i <= bucketCount; i += i & -i)
+    {
+        counts[i] += delta;
+        sums[i] += (long long)delta * level;
+    }
+    playerCount += delta;
+    levelSum += (long long)delta * level;
+}
+
+void LevelSketch::merge(const LevelSketch& other)
+{
+    if (other.subBucketBits != subBucketBits)
+    {
+        throw InvalidInput("LevelSketch: merging sketches of different precisions.");
+    }
+    for (int i = 1; i <= bucketCount; ++i)
+    {
+        counts[i] += other.counts[i];
+        sums[i] += other.sums[i];
+    }
+    playerCount += other.playerCount;
+    levelSum += other.levelSum;
+}
+
+int LevelSketch::getPlayerCount() const
+{
+    return playerCount;
+}
+
+double LevelSketch::getEpsilon() const
+{
+    return 1.0 / subBucketCount;
+}
+
+std::size_t LevelSketch::getMemorySize() const
+{
+    return sizeof(LevelSketch) + counts.capacity() * sizeof(int) + sums.capacity() * sizeof(long long);
+}
+
+double LevelSketch::countInRange(int lowerLevel, int higherLevel) const
+{
+    if (lowerLevel > higherLevel)
+    {
+        return 0;
+    }
+    return countUpTo(higherLevel) - countUpTo(lowerLevel - 1);
+}
+
+int LevelSketch::levelAtPercentile(double percentile) const
+{
+    if (playerCount == 0 || percentile <= 0 || percentile > 100)
+    {
+        throw Failure("LevelSketch: no such percentile.");
+    }
+    int rank = (int)std::ceil(percentile / 100 * playerCount);
+    rank = rank < 1 ? 1 : (rank > playerCount ? playerCount : rank);
+    int bucket = bucketOfRank(rank);
+    return (int)(bucketLow(bucket) + (bucketWidth(bucket) - 1) / 2);
+}
+
+double LevelSketch::sumOfTopM(int m) const
+{
+    if (m <= 0 || m > playerCount)
+    {
+        throw Failure("LevelSketch: illegal m.");
+    }
+    //The m-th highest player is the (n - m + 1)-th lowest one.
+    int bucket = bucketOfRank(playerCount - m + 1);
+    int upToBucket = countBefore(bucket + 1), inBucket = upToBucket - countBefore(bucket);
+    long long sumUpToBucket = sumBefore(bucket + 1), bucketSum = sumUpToBucket - sumBefore(bucket);
+
+    int above = playerCount - upToBucket;
+    double sum = (double)(levelSum - sumUpToBucket);
+    return sum + (double)(m - above) * bucketSum / inBucket;
+}
@@ -0,0 +1,80 @@
+#ifndef LEVEL_SKETCH_H
+#define LEVEL_SKETCH_H
+
+#include <cstddef>
+#include <vector>
+
+/*
+ * Approximate distribution of a group's levels, for analytics that can do without exact answers.
+ *
+ * Levels are counted in log-linear buckets: levels below 2^subBucketBits get a bucket each, and every
+ * power of two above that is split into 2^subBucketBits buckets. A bucket's width is therefore at most
+ * epsilon = 2^-subBucketBits of the levels in it (about 3% with the default 5 bits). Counts and level
+ * sums per bucket are kept in Fenwick trees, so that:
+ *  - adding or removing a player is exact, and so is merging two sketches (the arrays add up),
+ *  - every query is O(log bucketCount) = O(log(log(max level) / epsilon)).
+ *
+ * Error bounds (n players in the sketch):
+ *  - countInRange is exact, except for the players of the two buckets holding the bounds, which are
+ *    interpolated linearly. Only players whose level is within a relative epsilon of a bound can be
+ *    miscounted.
+ *  - levelAtPercentile returns the middle of the right bucket: within epsilon / 2 of the exact level.
+ *  - sumOfTopM is exact, except that the last bucket it takes from is assumed to hold its average level:
+ *    within a relative epsilon of the exact sum.
+ */
+class LevelSketch
+{
+public:
+    static const int defaultSubBucketBits = 5;
+    static const int maxSubBucketBits = 16;
+
+private:
+    int subBucketBits;
+    int subBucketCount;
+    int bucketCount; //Levels are non negative ints: the exact buckets plus one range per remaining power of two.
+    //1-based Fenwick trees over the buckets.
+    std::vector<int> counts;
+    std::vector<long long> sums;
+    int playerCount;
+    long long levelSum;
+
+    int bucketOf(int level) const;
+    long long bucketLow(int bucket) const;
+    long long bucketWidth(int bucket) const;
+
+    //Players (and their level sum) in buckets 0..bucket-1.
+    int countBefore(int bucket) const;
+    long long sumBefore(int bucket) const;
+
+    //The bucket holding the player of the given rank (1-based, from the lowest level).
+    int bucketOfRank(int rank) const;
+
+    //Approximate number of players with a level <= level.
+    double countUpTo(int level) const;
+
+public:
+    //epsilon is 2^-subBucketBits; the sketch takes about 12 * 2^subBucketBits * (32 - subBucketBits) bytes.
+    explicit LevelSketch(int subBucketBits = defaultSubBucketBits);
+
+    //delta players (negative to remove) at the given level.
+    void add(int level, int delta = 1);
+
+    //other must have the same precision.
+    void merge(const LevelSketch& other);
+
+    int getPlayerCount() const;
+
+    double getEpsilon() const;
+
+    std::size_t getMemorySize() const;
+
+    double countInRange(int lowerLevel, int higherLevel) const;
+
+    //The level under which percentile percent of the players are, percentile in (0, 100]. Needs players.
+    int levelAtPercentile(double percentile) const;
+
+    //Sum of the m highest levels, m <= player count.
+    double sumOfTopM(int m) const;
+};
+
+#endif //LEVEL_SKETCH_H
@@ -0,0 +1,181 @@
+#include "OutputWriter.hpp"
+
+#include <cmath>
+#include <cstring>
+
+OutputWriter::OutputWriter(FILE* stream, bool lineBuffered, std::size_t capacity)
+    : stream(stream), buffer(new char[capacity]), capacity(capacity), length(0), lineBuffered(lineBuffered)
+{}
+
+void OutputWriter::setLineBuffered(bool lineBuffered)
+{
+    this->lineBuffered = lineBuffered;
+    if (lineBuffered)
+    {
+        flush();
+    }
+}
+
+bool OutputWriter::isLineBuffered() const
+{
+    return lineBuffered;
+}
+
+void OutputWriter::reserve(std::size_t needed)
+{
+    if (capacity - length < needed)
+    {
+        flush();
+    }
+}
+
+void OutputWriter::writeUnsigned(unsigned long long value, int minDigits)
+{
+    char digits[24];
+    int count = 0;
+    do
+    {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    while (count < minDigits)
+    {
+        digits[count++] = '0';
+    }
+
+    reserve(count);
+    while (count > 0)
+    {
+        buffer[length++] = digits[--count];
+    }
+}
+
+OutputWriter& OutputWriter::write(const char* str)
+{
+    return write(str, std::strlen(str));
+}
+
+OutputWriter& OutputWriter::write(const char* str, std::size_t size)
+{
+    if (size > capacity)
+    {
+        //Too big to ever be buffered, just pass it through.
+        flush();
+        std::fwrite(str, 1, size, stream);
+        return *this;
+    }
+    reserve(size);
+    std::memcpy(buffer + length, str, size);
+    length += size;
+    return *this;
+}
+
+OutputWriter& OutputWriter::writeChar(char c)
+{
+    reserve(1);
+    buffer[length++] = c;
+    return *this;
+}
+
+OutputWriter& OutputWriter::writeInt(long long value)
+{
+    unsigned long long magnitude = (unsigned long long)value;
+    if (value < 0)
+    {
+        writeChar('-');
+        magnitude = 0ULL - magnitude;
+    }
+    writeUnsigned(magnitude);
+    return *this;
+}
+
+OutputWriter& OutputWriter::writeFixed(double value, int precision)
+{
+    if (precision < 0 || precision > maxFastPrecision || !std::isfinite(value) || std::fabs(value) >= 1e15)
+    {
+        //Rare enough not to bother with - let printf do it.
+        char tmp[512];
+        int size = std::snprintf(tmp, sizeof(tmp), "%.*f", precision, value);
+        if (size > 0)
+        {
+            write(tmp, (std::size_t)size < sizeof(tmp) ? size : sizeof(tmp) - 1);
+        }
+        return *this;
+    }
+
+    bool negative = std::signbit(value);
+    if (negative)
+    {
+        value = -value;
+    }
+
+    //value == mantissa * 2^exponent exactly, so value * 10^precision can be rounded with integer math.
+    int exponent;
+    double fraction = std::frexp(value, &exponent);
+    unsigned long long mantissa = (unsigned long long)std::ldexp(fraction, 53);
+    exponent -= 53;
+
+    unsigned long long unit = 1;
+    for (int i = 0; i < precision; ++i)
+    {
+        unit *= 10;
+    }
+
+    unsigned long long scaled = mantissa * unit, rounded;
+    if (exponent >= 0)
+    {
+        rounded = scaled << exponent;
+    }
+    else if (exponent <= -64)
+    {
+        rounded = 0; //scaled < 2^63 <= half a unit.
+    }
+    else
+    {
+        int shift = -exponent;
+        unsigned long long remainder = scaled & ((1ULL << shift) - 1), half = 1ULL << (shift - 1);
+        rounded = scaled >> shift;
+        if (remainder > half || (remainder == half && (rounded & 1)))
+        {
+            ++rounded;
+        }
+    }
+
+    if (negative)
+    {
+        writeChar('-');
+    }
+    writeUnsigned(rounded / unit);
+    if (precision > 0)
+    {
+        writeChar('.');
+        writeUnsigned(rounded % unit, precision);
+    }
+    return *this;
+}
+
+OutputWriter& OutputWriter::endLine()
+{
+    writeChar('\n');
+    if (lineBuffered)
+    {
+        flush();
+    }
+    return *this;
+}
+
+void OutputWriter::flush()
+{
+    if (length > 0)
+    {
+        std::fwrite(buffer, 1, length, stream);
+        length = 0;
+    }
+    std::fflush(stream);
+}
+
+OutputWriter::~OutputWriter()
+{
+    flush();
+    delete[] buffer;
+}
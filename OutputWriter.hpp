@@ -0,0 +1,65 @@
+#ifndef OUTPUT_WRITER_H
+#define OUTPUT_WRITER_H
+
+#include <cstddef>
+#include <cstdio>
+
+/*
+ * Buffered sink for the driver's command results.
+ * Everything is formatted straight into one large buffer (without going through printf),
+ * and the buffer is only handed to the stream once it passes a threshold, on flush(), or on
+ * destruction. In line-buffered mode every completed line is flushed, which is what an
+ * interactive shell wants.
+ */
+class OutputWriter
+{
+private:
+    static const std::size_t defaultCapacity = 1 << 16;
+    static const int maxFastPrecision = 3; //10^3 * 2^53 still fits in 64 bits.
+
+    FILE* stream;
+    char* buffer;
+    std::size_t capacity;
+    std::size_t length;
+    bool lineBuffered;
+
+    //Makes sure at least `needed` bytes are free, flushing if necessary.
+    void reserve(std::size_t needed);
+
+    //Writes an unsigned 64-bit value in decimal, padding with zeroes up to minDigits.
+    void writeUnsigned(unsigned long long value, int minDigits = 1);
+
+public:
+    explicit OutputWriter(FILE* stream = stdout, bool lineBuffered = false,
+                          std::size_t capacity = defaultCapacity);
+
+    OutputWriter(const OutputWriter& other) = delete;
+    OutputWriter& operator=(const OutputWriter& other) = delete;
+
+    void setLineBuffered(bool lineBuffered);
+
+    bool isLineBuffered() const;
+
+    OutputWriter& write(const char* str);
+
+    OutputWriter& write(const char* str, std::size_t size);
+
+    OutputWriter& writeChar(char c);
+
+    OutputWriter& writeInt(long long value);
+
+    /*
+     * Writes value with exactly `precision` digits after the point, producing the same text as
+     * printf("%.<precision>f") (including round-half-to-even on exact ties).
+     */
+    OutputWriter& writeFixed(double value, int precision = 2);
+
+    //Ends the current line; flushes right away in line-buffered mode.
+    OutputWriter& endLine();
+
+    void flush();
+
+    ~OutputWriter();
+};
+
+#endif //OUTPUT_WRITER_H
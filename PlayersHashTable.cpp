@@ -1,4 +1,7 @@
 #include "PlayersHashTable.hpp"
+#include "Instrumentation.hpp"
+
+#include <new>
 
 int PlayersHashTable::hash(int playerId) const
 {
@@ -9,14 +12,16 @@ int PlayersHashTable::hash(int playerId) const
 //it to newTable.
 void PlayersHashTable::replaceTable(Node** newTable, int oldLength)
 {
+    STATS_TIME_SCOPE(rehashCycles);
+    STATS_INCREMENT(rehashes);
+    usedBuckets = 0; //Recounted by insertNode as newTable fills up.
     for (int cnt = 0; cnt < oldLength; ++cnt)
     {
         while (table[cnt] != nullptr)
         {
-            insertNode(new Node(table[cnt]->getPlayer()), newTable);
-            Node* toFree = table[cnt];
-            table[cnt] = toFree->getNext();
-            delete toFree;
+            Node* node = table[cnt];
+            table[cnt] = node->getNext();
+            insertNode(node, newTable); //Relinked, not copied: the lists point at the nodes.
         }
     }
     delete[] this->table;
@@ -26,8 +31,8 @@ void PlayersHashTable::replaceTable(Node** newTable, int oldLength)
 void PlayersHashTable::expand()
 {
     int oldLength = tableLength;
-    tableLength *= expansionFactor;
-    Node** newTable = new Node*[tableLength](); //The () inits to nullptrs.
+    Node** newTable = new Node*[oldLength * expansionFactor](); //The () inits to nullptrs.
+    tableLength = oldLength * expansionFactor;
     replaceTable(newTable, oldLength);
 }
 
@@ -36,8 +41,8 @@ void PlayersHashTable::contract()
     assert(tableLength >= defaultStartingLength * expansionFactor);
 
     int oldLength = tableLength;
-    tableLength /= expansionFactor;
-    Node** newTable = new Node*[tableLength]();
+    Node** newTable = new Node*[oldLength / expansionFactor]();
+    tableLength = oldLength / expansionFactor;
     replaceTable(newTable, oldLength);
 }
 
@@ -46,16 +51,23 @@ float PlayersHashTable::getLoadFactor() const
     return ((float)playerCount) / (float)tableLength;
 }
 
+//A table that can't get a new bucket array keeps its old one: only the chains get longer or the buckets emptier.
 void PlayersHashTable::rehash()
 {
     float lf = getLoadFactor();
-    if (lf >= maxLoadFactor)
+    try
     {
-        expand();
+        if (lf >= maxLoadFactor)
+        {
+            expand();
+        }
+        else if (lf < minLoadFactor && tableLength > defaultStartingLength)
+        {
+            contract();
+        }
     }
-    else if (lf < minLoadFactor && tableLength > defaultStartingLength)
+    catch (std::bad_alloc& exc)
     {
-        contract();
     }
 }
 
@@ -67,6 +79,10 @@ void PlayersHashTable::insertNode(Node* node, Node** table)
     }
 
     int hashed = hash(node->getId());
+    if (table[hashed] == nullptr)
+    {
+        ++usedBuckets;
+    }
     node->setNext(table[hashed]);
     table[hashed] = node;
 }
@@ -77,6 +93,10 @@ void PlayersHashTable::removeNode(Node* node)
     if (table[hashed] == node)
     {
         table[hashed] = node->getNext();
+        if (table[hashed] == nullptr)
+        {
+            --usedBuckets;
+        }
     }
     else
     {
@@ -88,23 +108,90 @@ void PlayersHashTable::removeNode(Node* node)
         }
         curr->setNext(node->getNext());
     }
+    *node->listSlot = node->listNext;
+    if (node->listNext != nullptr)
+    {
+        node->listNext->listSlot = node->listSlot;
+    }
     delete node;
 }
 
-void PlayersHashTable::insert(const Player& player)
+PlayersHashTable::Node** PlayersHashTable::listHead(int list) const
 {
+    if (list < 0 || list >= listCount)
+    {
+        throw InvalidInput("Invalid player list.");
+    }
+    return &lists[list];
+}
+
+void PlayersHashTable::insert(const Player& player, int list)
+{
+    Node** head = listHead(list);
     Node* node = findNode(player.getPlayerId());
     if (node != nullptr)
     {
         throw Failure("Tried to add a player that was already added.");
     }
 
-    insertNode(new Node(player));
+    if (spares != nullptr)
+    {
+        node = spares;
+        spares = node->getNext();
+        node->player = player;
+        node->setNext(nullptr);
+    }
+    else
+    {
+        node = new Node(player);
+    }
+    insertNode(node);
+    node->listNext = *head;
+    if (*head != nullptr)
+    {
+        (*head)->listSlot = &node->listNext;
+    }
+    node->listSlot = head;
+    *head = node;
     ++playerCount;
 
     rehash(); //Expands if needed.
 }
 
+void PlayersHashTable::reserve(int count)
+{
+    int made = 0;
+    try
+    {
+        for (; made < count; ++made)
+        {
+            Node* node = new Node();
+            node->setNext(spares);
+            spares = node;
+        }
+    }
+    catch (...)
+    {
+        for (; made > 0; --made)
+        {
+            Node* temp = spares;
+            spares = temp->getNext();
+            delete temp;
+        }
+        throw;
+    }
+}
+
+void PlayersHashTable::releaseReserved()
+{
+    while (spares != nullptr)
+    {
+        Node* temp = spares;
+        spares = temp->getNext();
+        delete temp;
+    }
+}
+
 void PlayersHashTable::remove(int playerId)
 {
     Node* node = findNode(playerId);
@@ -119,6 +206,62 @@ void PlayersHashTable::remove(int playerId)
     rehash(); //Contracts if needed.
 }
 
+void PlayersHashTable::update(const Player& player)
+{
+    Node* node = findNode(player.getPlayerId());
+    if (node == nullptr)
+    {
+        throw Failure("Tried to update non-existent player.");
+    }
+
+    node->player = player;
+}
+
+void PlayersHashTable::spliceList(int from, int into)
+{
+    Node **fromHead = listHead(from), **intoHead = listHead(into);
+    if (from == into || *fromHead == nullptr)
+    {
+        return;
+    }
+
+    Node* last = *fromHead;
+    while (last->listNext != nullptr)
+    {
+        last = last->listNext;
+    }
+    last->listNext = *intoHead;
+    if (*intoHead != nullptr)
+    {
+        (*intoHead)->listSlot = &last->listNext;
+    }
+    *intoHead = *fromHead;
+    (*intoHead)->listSlot = intoHead;
+    *fromHead = nullptr;
+}
+
+void PlayersHashTable::removeList(int list)
+{
+    Node** head = listHead(list);
+    while (*head != nullptr)
+    {
+        removeNode(*head); //Which moves the head on.
+        --playerCount;
+    }
+
+    try
+    {
+        while (getLoadFactor() < minLoadFactor && tableLength > defaultStartingLength)
+        {
+            contract();
+        }
+    }
+    catch (std::bad_alloc& exc)
+    {
+        //Stays longer than it needs to be.
+    }
+}
+
 PlayersHashTable::Node* PlayersHashTable::findNode(int playerId) const
 {
     Node* current = table[hash(playerId)];
@@ -149,6 +292,31 @@ bool PlayersHashTable::isMember(int playerId) const
     return findNode(playerId) != nullptr;
 }
 
+int PlayersHashTable::getPlayerCount() const
+{
+    return playerCount;
+}
+
+int PlayersHashTable::getTableLength() const
+{
+    return tableLength;
+}
+
+int PlayersHashTable::getUsedBuckets() const
+{
+    return usedBuckets;
+}
+
+std::size_t PlayersHashTable::getNodeSize()
+{
+    return sizeof(Node);
+}
+
+std::size_t PlayersHashTable::getListsSize() const
+{
+    return (std::size_t)listCount * sizeof(Node*);
+}
+
 PlayersHashTable::~PlayersHashTable()
 {
     for (int cnt = 0; cnt < tableLength; ++cnt)
@@ -161,5 +329,7 @@ PlayersHashTable::~PlayersHashTable()
         }
     }
 
+    releaseReserved();
     delete[] table;
+    delete[] lists;
 }
\ No newline at end of file
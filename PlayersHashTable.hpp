@@ -5,26 +5,34 @@
 #include "game_exceptions.hpp"
 #include "GroupsUnionFind.hpp"
 #include <cassert>
+#include <cstddef>
 
 /*
  * Dynamic hash table using separate hashing and mod n (with n being the current table's tableLength)
  * as a hash function.
+ *
+ * Every player is also in one of a fixed number of lists (doubly linked through the nodes), given on
+ * insertion: the game keeps one per group, which is what lets a whole group be found and removed
+ * without going over the table. Resizing relinks the nodes, so they never move.
  */
 class PlayersHashTable
 {
 private:
     class Node
     {
+        friend class PlayersHashTable;
     private:
         const int illegal = -1;
         Player player;
         Node *next;
+        Node **listSlot; //What points at this node in its list: the list's head or the previous listNext.
+        Node *listNext;
 
     public:
-        explicit Node(const Player& player, Node* next=nullptr)
-                : player(player), next(next) //Copy it. Just a bunch of primitive fields.
+        explicit Node(const Player& player, Node* next=nullptr) //Copy it. Just a bunch of primitive fields.
+                : player(player), next(next), listSlot(nullptr), listNext(nullptr)
         {}
-        Node() : player(illegal, illegal, illegal), next(nullptr) //For array initialization.
+        Node() : player(illegal, illegal, illegal), next(nullptr), listSlot(nullptr), listNext(nullptr) //For arrays.
         {}
 
         void setNext(Node *node)
@@ -55,7 +63,11 @@ private:
 
     int tableLength;
     int playerCount;
+    int usedBuckets; //Buckets with at least one node, for memory accounting.
     Node** table;
+    int listCount;
+    Node** lists; //The first node of each list.
+    Node* spares; //Nodes allocated ahead by reserve, chained through next; insert takes them first.
 
     int hash(int playerId) const;
 
@@ -76,23 +88,106 @@ private:
     //Auxiliary function for insert and replaceTable.
     void insertNode(Node* node, Node** table=nullptr);
 
+    //Takes the node out of its bucket and list, and frees it.
     void removeNode(Node* node);
 
     Node* findNode(int playerId) const;
+
+    Node** listHead(int list) const;
 public:
-    PlayersHashTable() : tableLength(defaultStartingLength), playerCount(0), table(new Node*[tableLength]())
+    //Lists 0 to lists.
+    explicit PlayersHashTable(int lists = 0) : tableLength(defaultStartingLength), playerCount(0), usedBuckets(0),
+        table(new Node*[tableLength]()), listCount(lists + 1), lists(new Node*[lists + 1]()), spares(nullptr)
     {}
     PlayersHashTable(const PlayersHashTable& other) = delete;
     PlayersHashTable& operator=(const PlayersHashTable& other) = delete;
 
-    void insert(const Player& player);
+    void insert(const Player& player, int list = 0);
+
+    //Allocates the nodes of count more insertions ahead: those then only throw on bad input (a table that
+    //can't grow stays as it is). Throws with nothing allocated if it fails.
+    void reserve(int count);
+
+    //Frees the nodes reserve allocated that weren't used.
+    void releaseReserved();
 
     void remove(int playerId);
 
+    //Replaces the player of the same ID (whose level or score changed) in place; it keeps its list.
+    void update(const Player& player);
+
+    //Moves all of from's players to into's list, in O(from's size).
+    void spliceList(int from, int into);
+
+    //Moves the players of from's list for which moves(player) holds to into's list, in O(from's size).
+    template <class F>
+    void splitList(int from, int into, F& moves)
+    {
+        Node **slot = listHead(from), **intoHead = listHead(into);
+        while (*slot != nullptr)
+        {
+            Node* node = *slot;
+            if (!moves(node->getPlayer()))
+            {
+                slot = &node->listNext;
+                continue;
+            }
+            *slot = node->listNext;
+            if (node->listNext != nullptr)
+            {
+                node->listNext->listSlot = slot;
+            }
+            node->listNext = *intoHead;
+            if (*intoHead != nullptr)
+            {
+                (*intoHead)->listSlot = &node->listNext;
+            }
+            node->listSlot = intoHead;
+            *intoHead = node;
+        }
+    }
+
+    //Removes every player of the list; the table only contracts once done.
+    void removeList(int list);
+
     const Player& search(int playerId) const;
 
     bool isMember(int playerId) const;
 
+    int getPlayerCount() const;
+
+    int getTableLength() const;
+
+    int getUsedBuckets() const;
+
+    static std::size_t getNodeSize();
+
+    //Bytes of the list heads.
+    std::size_t getListsSize() const;
+
+    //Calls action(player) on every player, in no particular order.
+    template <class A>
+    void forEach(A& action) const
+    {
+        for (int cnt = 0; cnt < tableLength; ++cnt)
+        {
+            for (Node* node = table[cnt]; node != nullptr; node = node->getNext())
+            {
+                action(node->getPlayer());
+            }
+        }
+    }
+
+    //Calls action(player) on every player of the list, most recently inserted first.
+    template <class A>
+    void forEachInList(int list, A& action) const
+    {
+        for (Node* node = *listHead(list); node != nullptr; node = node->listNext)
+        {
+            action(node->getPlayer());
+        }
+    }
+
     ~PlayersHashTable();
 };
 
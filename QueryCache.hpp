@@ -0,0 +1,104 @@
+#ifndef QUERY_CACHE_H
+#define QUERY_CACHE_H
+
+/*
+ * The last few query results of a group, for clients that repeat the same queries between updates.
+ *
+ * Results are stamped with the group's epoch (bumped by every change to the group); a lookup with a
+ * newer epoch drops them all. Within an epoch, the least recently used result makes room for a new one.
+ * Failures are cached too, they are answers as well.
+ */
+class QueryCache
+{
+public:
+    enum Kind
+    {
+        PERCENT_OF_PLAYERS_WITH_SCORE_IN_BOUNDS,
+        AVERAGE_HIGHEST_PLAYER_LEVEL
+    };
+
+    static const int capacity = 8;
+
+private:
+    struct Entry
+    {
+        Kind kind;
+        int args[3];
+        double result;
+        bool failed;
+        unsigned long long lastUse;
+    };
+
+    Entry entries[capacity];
+    int size;
+    unsigned long long epoch;
+    unsigned long long clock;
+
+    int find(Kind kind, int a, int b, int c) const
+    {
+        for (int i = 0; i < size; ++i)
+        {
+            const Entry& entry = entries[i];
+            if (entry.kind == kind && entry.args[0] == a && entry.args[1] == b && entry.args[2] == c)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void moveTo(unsigned long long newEpoch)
+    {
+        if (newEpoch != epoch)
+        {
+            size = 0;
+            epoch = newEpoch;
+        }
+    }
+
+public:
+    QueryCache() : entries(), size(0), epoch(0), clock(0) {}
+
+    bool lookup(unsigned long long currentEpoch, Kind kind, int a, int b, int c, double* result, bool* failed)
+    {
+        moveTo(currentEpoch);
+        int i = find(kind, a, b, c);
+        if (i < 0)
+        {
+            return false;
+        }
+        entries[i].lastUse = ++clock;
+        *result = entries[i].result;
+        *failed = entries[i].failed;
+        return true;
+    }
+
+    void store(unsigned long long currentEpoch, Kind kind, int a, int b, int c, double result, bool failed)
+    {
+        moveTo(currentEpoch);
+        int i = find(kind, a, b, c);
+        if (i < 0 && size < capacity)
+        {
+            i = size++;
+        }
+        else if (i < 0)
+        {
+            i = 0;
+            for (int j = 1; j < size; ++j)
+            {
+                if (entries[j].lastUse < entries[i].lastUse) i = j;
+            }
+        }
+
+        Entry& entry = entries[i];
+        entry.kind = kind;
+        entry.args[0] = a;
+        entry.args[1] = b;
+        entry.args[2] = c;
+        entry.result = result;
+        entry.failed = failed;
+        entry.lastUse = ++clock;
+    }
+};
+
+#endif //QUERY_CACHE_H
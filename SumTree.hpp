@@ -5,33 +5,279 @@
 
 #include "SumTreeNode.hpp"
 #include "game_exceptions.hpp"
+#include "Instrumentation.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <functional>
+#include <map>
 #include <memory>
-
-class SumTree
+#include <new>
+#include <queue>
+#include <utility>
+#include <vector>
+
+/*
+ * AVL tree keyed by level, counting how many players are in each level (level zero is kept aside
+ * as a plain counter). Every node also holds w (players in its subtree) and totalLevel (sum of
+ * their levels), which is what the rank and top-m queries descend on. The players of a node's own
+ * level are not stored but derived, w minus the children's, so updates keep w right first and the
+ * aggregates follow it.
+ *
+ * The nodes are kept in one contiguous pool per tree and addressed by 32-bit indices. There are
+ * no parent pointers: updates record their root-to-node path and fix it bottom-up.
+ *
+ * A tree with few levels skips all that: its levels sit in a small sorted array of (level, count)
+ * pairs, scanned linearly, and root stays null. Past maxSmallLevels levels the array is built into
+ * nodes, and a tree that shrinks to a quarter of that goes back to an array.
+ *
+ * Once past the array, the low levels (below denseLimit, where most players are) are not nodes either:
+ * they are counted in a plain array indexed by level, with a count and a level sum per block of
+ * denseBlock levels. Adding or removing a player there is O(1), and the queries add up at most two
+ * partial blocks and the whole ones in between before descending the nodes, which only hold the levels
+ * from denseLimit up.
+ *
+ * Snapshots are old roots. While any is alive, the nodes they can reach are never written: an update
+ * copies the nodes of its path that predate the newest snapshot and works on the copies, so it costs
+ * O(log n) new nodes. The nodes it replaces are retired, and freed once every snapshot that could reach
+ * them is gone.
+ *
+ * The tree is generic over the level (Key, a signed integer type), the player counts (Count) and what
+ * the nodes sum up besides them (Aggregate, see SumTreeAggregates.hpp). Every query is a descent that
+ * hands whole subtrees and single levels to a sink, and the sink decides what it adds up: counting
+ * players never touches the aggregates. SumTree, at the end, is the instantiation the game uses: int
+ * levels and counts, with 64-bit level sums (a group of millions of high level players overflows 32 bits)
+ * and sums of the squared levels, for the variance of a range.
+ */
+template <class Key, class Count, class Aggregate>
+class BasicSumTree
 {
+public:
+    typedef BasicSumTreeNode<Key, Count, Aggregate> Node;
+    typedef typename Aggregate::Value Value;
+    typedef typename Aggregate::Total Total;
+
 private:
-    int levelZero;
-    SumTreeNode *root;
-    SumTreeNode *highest;
+    typedef typename Node::Index Index;
+
+    //An AVL tree of at most 2^29 nodes is far shallower than this.
+    static const int maxDepth = 64;
+
+    Count levelZero;
+    int denseLimit; //Levels below it are counted in dense once the tree is past the array.
+    Index root;
+    Index freeList; //Recycled slots, chained through their left index.
     int nodeCount;
+    std::vector<Node> nodes; //nodes[0] is the null sentinel (allocated with the first node).
+
+    //Snapshot bookkeeping, allocated with the first snapshot.
+    struct Versions
+    {
+        unsigned generation; //Snapshots taken so far.
+        std::vector<unsigned> births; //Per slot: the generation it was allocated in.
+        std::vector<std::pair<Index, unsigned> > retired; //Replaced nodes, and the generation they left in.
+        std::map<unsigned, int> live; //Snapshots not yet released, by generation.
+        bool orphaned; //Released by its owner while snapshots were still reading it.
+
+        Versions() : generation(0), births(), retired(), live(), orphaned(false) {}
+    };
+    std::unique_ptr<Versions> versions;
+
+public:
+    //A level and its player count: the entries of the small representation.
+    struct LevelCount
+    {
+        Key level;
+        Count count;
+    };
+
+    static const int maxSmallLevels = 32;
+
+    static const int defaultDenseLimit = 128;
+    static const int denseBlock = 16;
+
+private:
+    std::vector<LevelCount> small; //Sorted by level; only used while root is null and dense is unallocated.
+
+    //Player counts of the levels below denseLimit.
+    struct Dense
+    {
+        std::vector<Count> counts; //By level; counts[0] stays 0, level zero has its own counter.
+        std::vector<Count> blockCounts; //Players in levels [b * denseBlock, (b + 1) * denseBlock).
+        std::vector<Value> blockAggregates; //And the aggregate of their levels.
+        int levels; //Levels with players.
+        Count players;
+
+        explicit Dense(int limit) : counts(limit, Count(0)), blockCounts((limit + denseBlock - 1) / denseBlock, Count(0)),
+            blockAggregates(blockCounts.size(), Aggregate::identity()), levels(0), players(0)
+        {}
+
+        void add(Key level, Count delta)
+        {
+            bool was = counts[level] != 0;
+            counts[level] += delta;
+            bool is = counts[level] != 0;
+            levels += (int)is - (int)was;
+            int block = (int)(level / denseBlock);
+            blockCounts[block] += delta;
+            players += delta;
+            if (Aggregate::invertible || (was && is))
+            {
+                Aggregate::adjust(blockAggregates[block], level, delta);
+            }
+            else if (is)
+            {
+                blockAggregates[block] = Aggregate::combine(blockAggregates[block], Aggregate::of(level, counts[level]));
+            }
+            else
+            {
+                //The level emptied and the aggregate can't take it out: recombine the block.
+                Value aggregate = Aggregate::identity();
+                for (int i = block * denseBlock; i < (int)counts.size() && i < (block + 1) * denseBlock; ++i)
+                {
+                    if (counts[i] != 0) aggregate = Aggregate::combine(aggregate, Aggregate::of((Key)i, counts[i]));
+                }
+                blockAggregates[block] = aggregate;
+            }
+        }
+
+        //Hands the levels in [lowerRange, upperRange] to sink, by whole blocks where it can.
+        template <class S>
+        void collect(Key lowerRange, Key upperRange, S& sink) const
+        {
+            if (lowerRange < 1) lowerRange = 1;
+            if (upperRange > (Key)counts.size() - 1) upperRange = (Key)counts.size() - 1;
+            Key level = lowerRange;
+            while (level <= upperRange)
+            {
+                if (level % denseBlock == 0 && level + denseBlock - 1 <= upperRange)
+                {
+                    sink.subtree(blockCounts[level / denseBlock], blockAggregates[level / denseBlock]);
+                    level += denseBlock;
+                }
+                else
+                {
+                    if (counts[level] != 0) sink.level(level, counts[level]);
+                    ++level;
+                }
+            }
+        }
+
+        //Hands the m highest players to sink, m <= players.
+        template <class S>
+        void collectTop(Count m, S& sink) const
+        {
+            for (int block = (int)blockCounts.size() - 1; block >= 0 && m > 0; --block)
+            {
+                if (blockCounts[block] <= m)
+                {
+                    sink.subtree(blockCounts[block], blockAggregates[block]);
+                    m -= blockCounts[block];
+                    continue;
+                }
+                for (int level = std::min((int)counts.size(), (block + 1) * denseBlock) - 1; m > 0; --level)
+                {
+                    Count taken = m < counts[level] ? m : counts[level];
+                    if (taken != 0) sink.level((Key)level, taken);
+                    m -= taken;
+                }
+            }
+        }
+
+        //0 if empty.
+        Key maxLevel() const
+        {
+            int level = (int)counts.size() - 1;
+            while (level > 0 && counts[level] == 0)
+            {
+                --level;
+            }
+            return level < 0 ? Key(0) : (Key)level;
+        }
+    };
+    std::unique_ptr<Dense> dense; //Allocated when the tree outgrows the array (unless denseLimit is 1).
+
+    //Updates that reserveUpdates had room for, not made yet.
+    int reservedAdditions;
+    int reservedRemovals;
+
+    //Whether the levels are in the small array.
+    bool isSmall() const
+    {
+        return root == Node::null && dense == nullptr;
+    }
+
+    //The levels below it are in dense.
+    int denseEnd() const
+    {
+        return dense == nullptr ? 0 : (int)dense->counts.size();
+    }
+
+    //A version of the tree to query: the current one, or a snapshot's.
+    struct View
+    {
+        Index top;
+        const LevelCount* small;
+        int smallSize;
+        const Dense* dense; //Null while the levels are in the array.
+        Count zeros;
+    };
+
+    /*
+     * What the queries' descents report to: whole subtrees (or dense blocks) by their player count and
+     * aggregate, and single levels with some of their players. The order is unspecified, which is fine
+     * for the commutative aggregates there are.
+     */
+    struct CountSink
+    {
+        Count players;
+
+        CountSink() : players(0) {}
+        void subtree(Count count, const Value& aggregate) { players += count; }
+        void level(Key level, Count count) { players += count; }
+    };
+
+    struct AggregateSink
+    {
+        Count players;
+        Value aggregate;
+
+        AggregateSink() : players(0), aggregate(Aggregate::identity()) {}
+
+        void subtree(Count count, const Value& value)
+        {
+            players += count;
+            aggregate = Aggregate::combine(aggregate, value);
+        }
+
+        void level(Key level, Count count)
+        {
+            players += count;
+            aggregate = Aggregate::combine(aggregate, Aggregate::of(level, count));
+        }
+    };
+
+    View view() const
+    {
+        View current = { root, small.data(), (int)small.size(), dense.get(), levelZero };
+        return current;
+    }
 
     //Static utilities: @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
     class StaticAVLUtilities
     {
-        friend class SumTree;
+        friend class BasicSumTree;
         class ArrayFromTreePopulator {
         private:
-            int* array;
-            int* levels;
+            Key* array;
+            Count* levels;
             int size;
             int index;
             bool reverse;
 
         public:
             ArrayFromTreePopulator() = delete;
-            explicit ArrayFromTreePopulator(int* array, int* levels, int size = -1, bool reverse=false):
+            explicit ArrayFromTreePopulator(Key* array, Count* levels, int size = -1, bool reverse=false):
                     array(array), levels(levels), size(size), index(0), reverse(reverse)
             {
                 if (reverse)
@@ -44,7 +290,7 @@ private:
                 }
             }
 
-            void operator()(int level, int inThisLevel, int height, int parentValue, int leftValue, int rightValue, int BF) {
+            void operator()(Key level, Count inThisLevel, int height, Key parentValue, Key leftValue, Key rightValue, int BF) {
                 if (reverse)
                 {
                     if(size < 0 || index >= 0)
@@ -64,11 +310,12 @@ private:
             }
         };
 
-        static int* treeToArray(const SumTree& tree, int** levels, bool reverse=false) {
-            int* array = new int[tree.getSize()];
-            *levels = new int[tree.getSize()];
+        static Key* treeToArray(const BasicSumTree& tree, Count** levels, bool reverse=false) {
+            Key* array = new Key[tree.getSize()];
+            *levels = nullptr;
             try
             {
+                *levels = new Count[tree.getSize()];
                 ArrayFromTreePopulator populator(array, *levels, tree.getSize(), reverse);
                 tree.inorder(populator);
             }
@@ -76,15 +323,25 @@ private:
             {
                 delete[] array;
                 delete[] *levels;
-                throw exception;
+                *levels = nullptr; //The callers free it too.
+                throw;
             }
             return array;
         }
 
-        static int* arrayMerge(int* arr1, int* levels1, int size1, int* arr2, int* levels2, int size2, int **levelsMerged, int *length) {
+        static Key* arrayMerge(Key* arr1, Count* levels1, int size1, Key* arr2, Count* levels2, int size2,
+                               Count** levelsMerged, int* length) {
             assert(levelsMerged != nullptr && length != nullptr);
-            int* array = new int[size1 + size2];
-            *levelsMerged = new int[size1 + size2]; //Might take more space than needed. Could realloc in the end if it matters.
+            Key* array = new Key[size1 + size2];
+            try
+            {
+                *levelsMerged = new Count[size1 + size2]; //Might take more space than needed. Could realloc in the end if it matters.
+            }
+            catch (...)
+            {
+                delete[] array;
+                throw;
+            }
             try
             {
                 int i1 = 0, i2 = 0, i = 0;
@@ -127,45 +384,88 @@ private:
         };
 
         //This uses the algorithm described & proved in the doc.
-        static std::unique_ptr<SumTree> AVLFromArray(int* arr, int* inThisLevel, int size) {
+        //The nodes are laid out in preorder, so descents mostly move forward in memory.
+        static std::unique_ptr<BasicSumTree> AVLFromArray(Key* arr, Count* inThisLevel, int size, int denseLimit) {
             assert(size >= 0);
 
-            std::unique_ptr<SumTree> tree = std::unique_ptr<SumTree>(new SumTree());
-            if (size > 0)
+            std::unique_ptr<BasicSumTree> tree = std::unique_ptr<BasicSumTree>(new BasicSumTree(denseLimit));
+            if (size <= maxSmallLevels)
             {
-                int m = (size % 2 == 0 ? size / 2 : (size + 1) / 2) - 1; //m=ceil(size/2)-1
-                tree->addNode(arr[m], inThisLevel[m]); //O(1) since the tree is empty.
-
-                if (size == 2) {
-                    tree->addNode(arr[m + 1], inThisLevel[m + 1]); //O(1) since the tree is always sized 1 and this point.
-                } else if (size > 2) {
-                    tree->setLeftSubtree(AVLFromArray(arr, inThisLevel, m));
-                    tree->setRightSubtree(
-                            AVLFromArray(arr + (m + 1), inThisLevel + (m + 1), size - m - 1)
-                        );
+                //Few enough levels for the array: merging small trees ends with a plain copy.
+                tree->small.resize(size);
+                for (int i = 0; i < size; ++i)
+                {
+                    tree->small[i].level = arr[i];
+                    tree->small[i].count = inThisLevel[i];
+                }
+            }
+            else
+            {
+                //The low levels are counted densely, the rest become nodes.
+                int low = 0;
+                if (denseLimit > 1)
+                {
+                    tree->dense.reset(new Dense(denseLimit));
+                    for (; low < size && arr[low] < denseLimit; ++low)
+                    {
+                        tree->dense->add(arr[low], inThisLevel[low]);
+                    }
+                }
+                if ((unsigned)(size - low) > Node::maxIndex - 1)
+                {
+                    throw AllocationError("SumTree: too many levels.");
+                }
+                if (low < size)
+                {
+                    tree->nodes.reserve(size - low + 1);
+                    tree->nodes.emplace_back(); //Sentinel.
+                    tree->root = buildSubtree(*tree, arr + low, inThisLevel + low, size - low);
+                    tree->nodeCount = size - low;
                 }
             }
 
             return tree;
         }
 
-        //THIS RUINS THE PARAMETER TREES. Careful!
-        static std::unique_ptr<SumTree> mergeTrees(SumTree& t1, SumTree& t2) {
-            int *t1arr = nullptr, *t2arr = nullptr, *merged = nullptr,
-                *t1levels = nullptr, *t2levels = nullptr, *levelsMerged = nullptr, size;
-            int levelZero = t1.levelZero + t2.levelZero;
-            std::unique_ptr<SumTree> result;
+        static Index buildSubtree(BasicSumTree& tree, Key* arr, Count* inThisLevel, int size) {
+            if (size == 0)
+            {
+                return Node::null;
+            }
+            int m = (size % 2 == 0 ? size / 2 : (size + 1) / 2) - 1; //m=ceil(size/2)-1
+            Index subtreeRoot = (Index)tree.nodes.size();
+            tree.nodes.emplace_back(arr[m], inThisLevel[m]);
+
+            Index left = buildSubtree(tree, arr, inThisLevel, m);
+            Index right = buildSubtree(tree, arr + (m + 1), inThisLevel + (m + 1), size - m - 1);
+            Node& node = tree.nodes[subtreeRoot];
+            node.setLeft(left);
+            node.setRight(right);
+            node.update(tree.nodes.data(), inThisLevel[m]);
+            return subtreeRoot;
+        }
+
+        //Leaves the parameter trees as they are.
+        static std::unique_ptr<BasicSumTree> mergedCopy(const BasicSumTree& t1, const BasicSumTree& t2) {
+            Key *t1arr = nullptr, *t2arr = nullptr, *merged = nullptr;
+            Count *t1levels = nullptr, *t2levels = nullptr, *levelsMerged = nullptr;
+            int size;
+            std::unique_ptr<BasicSumTree> result;
             try {
                 t1arr = treeToArray(t1, &t1levels);
                 t2arr = treeToArray(t2, &t2levels);
                 merged = arrayMerge(t1arr, t1levels, t1.getSize(), t2arr, t2levels, t2.getSize(), &levelsMerged, &size);
-                result = treeFromArray(merged, levelsMerged, size);
-                result->levelZero = levelZero;
-                t1.clean();
-                t2.clean();
+                result = treeFromArray(merged, levelsMerged, size, t1.denseLimit);
+                result->levelZero = t1.levelZero + t2.levelZero;
             }
             catch (std::exception &exception) {
-
+                delete[] t1arr;
+                delete[] t2arr;
+                delete[] merged;
+                delete[] levelsMerged;
+                delete[] t1levels;
+                delete[] t2levels;
+                throw;
             }
 
             delete[] t1arr;
@@ -177,596 +477,816 @@ private:
 
             return result;
         }
+
+        //Any number of trees: one heap merge of all their levels, then a single build. Leaves them intact.
+        static std::unique_ptr<BasicSumTree> mergedCopy(BasicSumTree* const* trees, int count) {
+            if (count == 2)
+            {
+                return mergedCopy(*trees[0], *trees[1]);
+            }
+
+            std::vector<Key*> arrays(count, nullptr);
+            std::vector<Count*> levels(count, nullptr);
+            std::unique_ptr<BasicSumTree> result;
+            try {
+                int total = 0;
+                Count zeros = 0;
+                for (int i = 0; i < count; ++i)
+                {
+                    arrays[i] = treeToArray(*trees[i], &levels[i]);
+                    total += trees[i]->getSize();
+                    zeros += trees[i]->levelZero;
+                }
+
+                typedef std::pair<Key, int> Head; //The smallest level a tree has left, and the tree.
+                std::priority_queue<Head, std::vector<Head>, std::greater<Head> > heap;
+                std::vector<int> positions(count, 0);
+                std::vector<Key> merged;
+                std::vector<Count> mergedLevels;
+                merged.reserve(total);
+                mergedLevels.reserve(total);
+                for (int i = 0; i < count; ++i)
+                {
+                    if (trees[i]->getSize() > 0) heap.push(Head(arrays[i][0], i));
+                }
+                while (!heap.empty())
+                {
+                    Head head = heap.top();
+                    heap.pop();
+                    int i = head.second, at = positions[i]++;
+                    if (!merged.empty() && merged.back() == head.first)
+                    {
+                        mergedLevels.back() += levels[i][at];
+                    }
+                    else
+                    {
+                        merged.push_back(head.first);
+                        mergedLevels.push_back(levels[i][at]);
+                    }
+                    if (positions[i] < trees[i]->getSize()) heap.push(Head(arrays[i][positions[i]], i));
+                }
+
+                result = treeFromArray(merged.data(), mergedLevels.data(), (int)merged.size(), trees[0]->denseLimit);
+                result->levelZero = zeros;
+            }
+            catch (std::exception &exception) {
+                for (int i = 0; i < count; ++i)
+                {
+                    delete[] arrays[i];
+                    delete[] levels[i];
+                }
+                throw;
+            }
+
+            for (int i = 0; i < count; ++i)
+            {
+                delete[] arrays[i];
+                delete[] levels[i];
+            }
+            return result;
+        }
+
+        //whole minus part, in one pass over both level arrays. Leaves them intact.
+        static std::unique_ptr<BasicSumTree> differenceCopy(const BasicSumTree& whole, const BasicSumTree& part) {
+            if (part.levelZero > whole.levelZero)
+            {
+                throw Failure("SumTree difference: part has players whole hasn't.");
+            }
+            Key *wholeArr = nullptr, *partArr = nullptr;
+            Count *wholeLevels = nullptr, *partLevels = nullptr;
+            std::unique_ptr<BasicSumTree> result;
+            try {
+                wholeArr = treeToArray(whole, &wholeLevels);
+                partArr = treeToArray(part, &partLevels);
+                std::vector<Key> left;
+                std::vector<Count> leftLevels;
+                left.reserve(whole.getSize());
+                leftLevels.reserve(whole.getSize());
+                int j = 0;
+                bool contained = true;
+                for (int i = 0; i < whole.getSize() && contained; ++i)
+                {
+                    Count count = wholeLevels[i];
+                    if (j < part.getSize() && partArr[j] == wholeArr[i])
+                    {
+                        count -= partLevels[j++];
+                    }
+                    contained = count >= 0 && (j == part.getSize() || partArr[j] > wholeArr[i]);
+                    if (count > 0)
+                    {
+                        left.push_back(wholeArr[i]);
+                        leftLevels.push_back(count);
+                    }
+                }
+                if (!contained || j < part.getSize())
+                {
+                    throw Failure("SumTree difference: part has players whole hasn't.");
+                }
+
+                result = treeFromArray(left.data(), leftLevels.data(), (int)left.size(), whole.denseLimit);
+                result->levelZero = whole.levelZero - part.levelZero;
+            }
+            catch (std::exception &exception) {
+                delete[] wholeArr;
+                delete[] partArr;
+                delete[] wholeLevels;
+                delete[] partLevels;
+                throw;
+            }
+
+            delete[] wholeArr;
+            delete[] partArr;
+            delete[] wholeLevels;
+            delete[] partLevels;
+            return result;
+        }
+
+        //THIS RUINS THE PARAMETER TREES. Careful! (Unless it fails: then it's null and they're as they were.)
+        static std::unique_ptr<BasicSumTree> mergeTrees(BasicSumTree& t1, BasicSumTree& t2) {
+            std::unique_ptr<BasicSumTree> result;
+            try {
+                result = mergedCopy(t1, t2);
+                t1.reserveRetired(t1.nodeCount);
+                t2.reserveRetired(t2.nodeCount);
+                t1.clean();
+                t2.clean();
+            }
+            catch (std::exception &exception) {
+                result.reset();
+            }
+
+            return result;
+        }
         //@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
     };
 
 
-    enum Order { smaller, equal, larger };
-
     static int abs(int a) { return a > 0 ? a : -a; }
 
-    void setLeftSubtree(const std::shared_ptr<SumTree>& tree)
+    Index allocateNode(Key level, Count inThisLevel)
     {
-        assert(root != nullptr);
-        root->setLeft(tree->root);
-        tree->root = nullptr; //To ensure no scary O(n) cleaning operations take place.
-        root->updateHeight();
-        nodeCount = tree->nodeCount + nodeCount;
-    }
+        //The births slot is had first: past it only emplace_back may throw, and that changes nothing.
+        std::size_t size = freeList != Node::null ? nodes.size() : std::max<std::size_t>(nodes.size(), 1) + 1;
+        if (size - 1 > Node::maxIndex)
+        {
+            throw AllocationError("SumTree: too many levels.");
+        }
+        if (versions != nullptr && versions->births.size() < size)
+        {
+            versions->births.resize(size);
+        }
 
-    void setRightSubtree(const std::shared_ptr<SumTree>& tree)
-    {
-        assert(root != nullptr);
-        root->setRight(tree->root);
-        tree->root = nullptr; //To ensure no scary O(n) cleaning operations take place.
-        if (tree->highest != nullptr)
+        Index index;
+        if (freeList != Node::null)
+        {
+            index = freeList;
+            freeList = nodes[index].getLeft();
+            nodes[index] = Node(level, inThisLevel);
+        }
+        else
+        {
+            if (nodes.empty())
+            {
+                nodes.emplace_back(); //Sentinel.
+            }
+            nodes.emplace_back(level, inThisLevel);
+            index = (Index)(nodes.size() - 1);
+        }
+        if (versions != nullptr)
         {
-            this->highest = tree->highest;
+            versions->births[index] = versions->generation;
         }
-        root->updateHeight();
-        nodeCount = tree->nodeCount + nodeCount;
+        return index;
     }
 
-    void freeList()
+    void freeNode(Index index)
     {
-        freeListAux(root);
+        nodes[index] = Node();
+        nodes[index].setLeft(freeList);
+        freeList = index;
     }
 
-    void freeListAux(SumTreeNode* curr)
+    //Whether there are live snapshots, that is whether updates have to copy.
+    bool sharing() const
     {
-        if (curr == nullptr) return;
-        freeListAux(curr->getLeft());
-        freeListAux(curr->getRight());
-        delete curr;
+        return versions != nullptr && !versions->live.empty();
     }
 
-    SumTreeNode* findLocation(int level, Order &orderRel)
+    //Whether a live snapshot may reach the node, which then must not be written.
+    bool isShared(Index index) const
     {
-        if (root == nullptr) return nullptr;
-        return findLocationAux(level, root, orderRel);
+        return sharing() && versions->births[index] < versions->generation;
     }
 
-    SumTreeNode* findLocationAux(int level, SumTreeNode* curr, Order &orderRel)
+    //Room for more retirements, so that the dropNode calls that make them don't throw.
+    void reserveRetired(std::size_t more)
     {
-        if (level == curr->getLevel())
+        if (!sharing()) return;
+        std::vector<std::pair<Index, unsigned> >& retired = versions->retired;
+        if (retired.capacity() - retired.size() < more)
         {
-            orderRel = equal;
-            return curr;
+            retired.reserve(std::max(retired.size() + more, 2 * retired.capacity()));
         }
+    }
 
-        bool isLarger = level > curr->getLevel();
-        SumTreeNode* nextNode = isLarger ? curr->getRight() : curr->getLeft();
-
-        if (nextNode == nullptr)
+    //Frees the node, or retires it if a snapshot may still reach it (which allocates, see reserveRetired).
+    void dropNode(Index index)
+    {
+        if (isShared(index))
         {
-            orderRel = isLarger ? larger : smaller;
-            return curr;
+            versions->retired.emplace_back(index, versions->generation);
+            return;
         }
+        freeNode(index);
+    }
 
-        return findLocationAux(level, nextNode, orderRel);
+    //Whether updates reserved with reserveUpdates are still to come.
+    bool reserved() const
+    {
+        return reservedAdditions + reservedRemovals > 0;
     }
 
-    /*
-     * Like findLocation, but returns the next node in order and the prev node in order IF the node
-     * was not found (this is done via the before and after parameters).
-     * If the node was found, the return value AS WELL AS BEFORE & AFTER will point to it.
-     * If the node was not found, the return value will nullptr, and before & after will point to the
-     * next & prev in order.
-     *
-     * Before and after can be provided as nullptr, in which case they will be ignored.
-     * (Hence, having both of them as nullptr effectively mimics findLocation in all respects.)
-     */
-    SumTreeNode* findLocationBounds(int level, Order &orderRel, SumTreeNode** before=nullptr, SumTreeNode** after=nullptr) const
+    //Counts an update against the reservations, of its own kind if there are any left.
+    void useReservation(bool addition)
     {
-        if (before != nullptr) *before = nullptr;
-        if (after != nullptr) *after = nullptr;
-        if (root == nullptr)
+        int& own = addition ? reservedAdditions : reservedRemovals;
+        int& other = addition ? reservedRemovals : reservedAdditions;
+        if (own > 0)
         {
-            return nullptr;
+            --own;
+        }
+        else if (other > 0)
+        {
+            --other;
         }
-        return findLocationBoundsAux(level, root, orderRel, before, after);
     }
 
-    SumTreeNode* findLocationBoundsAux(int level, SumTreeNode* curr, Order &orderRel, SumTreeNode** before, SumTreeNode** after) const
+    //A node that can be written in place of the given one: itself, or a copy that the caller relinks.
+    Index thaw(Index index)
     {
-        if (level == curr->getLevel())
+        if (!isShared(index))
         {
-            orderRel = equal;
-            if (after != nullptr)
-            {
-                *after = curr;
-            }
-            if (before != nullptr)
-            {
-                *before = curr;
-            }
-            return curr;
+            return index;
         }
+        reserveRetired(1); //Before the copy, which would be lost if retiring the node failed.
+        Index copy = allocateNode(0, 0); //May move the pool.
+        nodes[copy] = nodes[index];
+        dropNode(index);
+        return copy;
+    }
 
-        bool isLarger = level > curr->getLevel();
-        SumTreeNode* nextNode;
-
-        if (isLarger)
+    //Makes every node of a root-to-node path writable, top-down, relinking the copies.
+    void thawPath(Index* path, int depth)
+    {
+        for (int i = 0; i < depth; ++i)
         {
-            nextNode = curr->getRight();
-            if (before != nullptr) *before = curr;
+            Index copy = thaw(path[i]);
+            if (copy != path[i])
+            {
+                relinkChild(path, i, path[i], copy);
+                path[i] = copy;
+            }
         }
-        else
+    }
+
+    //Makes a child of a writable node writable.
+    Index thawChild(Index parent, bool left)
+    {
+        Index child = left ? nodes[parent].getLeft() : nodes[parent].getRight();
+        Index copy = thaw(child);
+        if (copy != child)
         {
-            nextNode = curr->getLeft();
-            if (after != nullptr) *after = curr;
+            if (left)
+            {
+                nodes[parent].setLeft(copy);
+            }
+            else
+            {
+                nodes[parent].setRight(copy);
+            }
         }
+        return copy;
+    }
 
-        if (nextNode == nullptr)
+    //Before a rotation at a writable node: its child on the heavy side, and that child's inner one for a double rotation.
+    void thawForRotation(Index subtreeRoot, bool left, bool isDouble)
+    {
+        Index child = thawChild(subtreeRoot, left);
+        if (isDouble)
         {
-            orderRel = isLarger ? larger : smaller;
-            return curr;
+            thawChild(child, !left);
         }
-
-        return findLocationBoundsAux(level, nextNode, orderRel, before, after);
     }
 
-    /*
-     * The lowerThan described in the LyX document under getPercentOfPlayersWithScoreInBounds.
-     * It'd be more efficient to merge this with findLocationBounds, but asymptotically it wouldn't
-     * matter and we're a bit short on time.
-     * If node == nullptr, return all players in tree except level zeroes.
-     * NOTE: THIS SHOULD ONLY BE CALLED ON NODES THAT ARE CONFIRMED TO BE IN THE TREE.
-     * (That's while it takes a node despite only needing a level.)
-     */
-    int lowerThan(const SumTreeNode* node) const
+    //Frees the retired nodes that no live snapshot can reach anymore.
+    void reclaim()
     {
-        int level = node->getLevel();
-        int r = 0;
-        SumTreeNode* curr = root;
-        while (curr != nullptr)
+        unsigned oldest = versions->live.empty() ? 0 : versions->live.begin()->first;
+        std::vector<std::pair<Index, unsigned> >& retired = versions->retired;
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < retired.size(); ++i)
         {
-            if (level == curr->getLevel())
-            {
-                return r + curr->getLeftW();
-            }
-            if (level > curr->getLevel())
+            //A node retired in generation g is only reachable from snapshots of generation g or older.
+            if (versions->live.empty() || retired[i].second < oldest)
             {
-                r += curr->getLeftW() + curr->getInThisLevel();
-                curr = curr->getRight();
+                freeNode(retired[i].first);
             }
             else
             {
-                curr = curr->getLeft();
+                retired[kept++] = retired[i];
             }
         }
-
-        assert(false); //shouldn't get here
-        return -1;
+        retired.resize(kept);
     }
 
-    //Updates heights and returns the lowest node with an invalid balance factor.
-    void updateTree(SumTreeNode* node)
+    void releaseSnapshot(unsigned generation)
     {
-        if (node == nullptr) return;
-
-        node->updateHeight();
-        SumTreeNode* nextNode = rotate(node);
-
-        SumTreeNode* parent = nextNode->getParent();
-
-        if (parent == nullptr)
+        std::map<unsigned, int>::iterator found = versions->live.find(generation);
+        assert(found != versions->live.end());
+        if (--found->second == 0)
         {
-            return;
+            versions->live.erase(found);
+        }
+        reclaim();
+        if (!sharing())
+        {
+            if (versions->orphaned)
+            {
+                delete this;
+            }
+            else if (root == Node::null)
+            {
+                dropPool(); //Only the snapshots were holding the nodes.
+            }
         }
-
-        updateTree(parent);
-
     }
 
-    int getBalanceFactor(SumTreeNode* node = nullptr) const
+    //Gives the node pool back; nothing may be using it.
+    void dropPool()
     {
-        if (node == nullptr) node = root;
-        return node->getLeftHeight() - node->getRightHeight();
+        std::vector<Node>().swap(this->nodes);
+        this->root = Node::null;
+        this->freeList = Node::null;
+        this->nodeCount = 0;
+        if (versions != nullptr)
+        {
+            versions->births.clear();
+            versions->retired.clear();
+        }
     }
 
-    template <class A>
-    void inorderAux(A& action, SumTreeNode* curr) const
+    //Builds small[first, first + size) into a subtree, in preorder like AVLFromArray.
+    Index buildFromSmall(int first, int size)
     {
-        if (curr == nullptr) return;
-        inorderAux(action, curr->getLeft());
-        action(
-            curr->getLevel(),
-            curr->getInThisLevel(),
-            curr->getHeight(),
-            curr->getLeft() == nullptr ? int() : curr->getLeft()->getLevel(),
-            curr->getRight() == nullptr ? int() : curr->getRight()->getLevel(),
-            curr->getParent() == nullptr ? int() : curr->getParent()->getLevel(),
-            getBalanceFactor(curr)
-        );
-        inorderAux(action, curr->getRight());
+        if (size == 0)
+        {
+            return Node::null;
+        }
+        int m = (size % 2 == 0 ? size / 2 : (size + 1) / 2) - 1;
+        Index subtreeRoot = allocateNode(small[first + m].level, small[first + m].count);
+        Index left = buildFromSmall(first, m);
+        Index right = buildFromSmall(first + m + 1, size - m - 1);
+        Node& node = nodes[subtreeRoot];
+        node.setLeft(left);
+        node.setRight(right);
+        node.update(nodes.data(), small[first + m].count);
+        return subtreeRoot;
     }
 
-    /*
-     * addNode auxiliary method adding node given findLocation's return values.
-     */
-    static void addNodeToLocation(SumTreeNode* location, SumTreeNode* newNode, Order orderRel)
+    //From the array to the dense counts and nodes, once it is full.
+    void promote()
     {
-        if (orderRel == equal)
+        assert(isSmall());
+        int low = 0;
+        std::unique_ptr<Dense> counts;
+        if (denseLimit > 1)
         {
-            //Trying to add a node that was already in the tree.
-            throw Failure("Trying to add a node that was already added.");
+            counts.reset(new Dense(denseLimit));
+            for (; low < (int)small.size() && small[low].level < denseLimit; ++low)
+            {
+                counts->add(small[low].level, small[low].count);
+            }
         }
+        //Still the array until this succeeds; if it fails, the nodes it got are lost to the pool.
+        Index built = buildFromSmall(low, (int)small.size() - low);
+        dense.swap(counts);
+        root = built;
+        nodeCount = (int)small.size() - low;
+        std::vector<LevelCount>().swap(small);
+    }
 
-        if (orderRel == larger)
+    //From the dense counts and nodes back to the array. Only a saving: if the array (or the room to retire
+    //shared nodes) can't be had, the levels stay where they are, so this never throws.
+    void demote()
+    {
+        std::vector<LevelCount> levels;
+        try
         {
-            assert(location->getRight() == nullptr);
-            location->setRight(newNode);
+            levels.reserve(getSize());
+            reserveRetired(nodeCount); //So that clean() below doesn't throw either.
         }
-        else
+        catch (std::bad_alloc& exc)
         {
-            assert(location->getLeft() == nullptr);
-            location->setLeft(newNode);
+            return;
         }
+        auto take = [&levels](Key level, Count inThisLevel, int height, Key parent, Key left, Key right, int BF)
+        {
+            LevelCount entry = { level, inThisLevel };
+            levels.push_back(entry);
+        };
+        inorder(take);
+        clean();
+        small.swap(levels);
     }
 
-    SumTreeNode* LLRotation(SumTreeNode* subtreeRoot)
+    //Where level is in the array, or where it would go.
+    int smallPosition(Key level) const
     {
-        SumTreeNode *oldRoot = subtreeRoot,
-            *rootParent = subtreeRoot->getParent(),
-            *newRoot = subtreeRoot->getLeft();
+        int i = 0;
+        while (i < (int)small.size() && small[i].level < level)
+        {
+            ++i;
+        }
+        return i;
+    }
 
-        //Set new root:
-        if (rootParent != nullptr)
+    //The queries, on a version of the tree.
+    Count getPlayerCount(const View& version) const
+    {
+        if (version.dense == nullptr && version.top == Node::null)
         {
-            if (rootParent->getLevel() > oldRoot->getLevel())
+            Count count = version.zeros;
+            for (int i = 0; i < version.smallSize; ++i)
             {
-                rootParent->setLeft(newRoot);
+                count += version.small[i].count;
             }
-            else
-            {
-                rootParent->setRight(newRoot);
-            }
-        }
-        else
-        {
-            root = newRoot;
-            newRoot->setParent(nullptr);
+            return count;
         }
-
-        //Pluck new root's old right child, and make it old root's new left:
-        oldRoot->setLeft(newRoot->getRight());
-
-        //Make old root the right child of the new root:
-        newRoot->setRight(oldRoot);
-
-        //Update the heights, totalLevels and Ws that were affected:
-        oldRoot->updateHeight();
-        newRoot->updateHeight();
-
-        return newRoot;
+        return version.zeros + (version.dense == nullptr ? Count(0) : version.dense->players)
+            + (version.top == Node::null ? Count(0) : nodes[version.top].getW());
     }
 
-    SumTreeNode* RRRotation(SumTreeNode* subtreeRoot)
+    /*
+     * The players with a level in [lowerRange, upperRange], in a single descent of the nodes: both
+     * bounds follow the same path down to the first node inside the range, where the walk splits
+     * into one half-path per bound.
+     */
+    template <class S>
+    void collectRange(const View& version, Key lowerRange, Key upperRange, S& sink) const
     {
-        SumTreeNode *oldRoot = subtreeRoot,
-                *rootParent = subtreeRoot->getParent(),
-                *newRoot = subtreeRoot->getRight();
+        if (upperRange < 0 || lowerRange > upperRange) return;
 
-        //Set new root:
-        if (rootParent != nullptr)
+        if (lowerRange <= 0 && version.zeros != 0) sink.level(Key(0), version.zeros);
+        if (lowerRange < 1) lowerRange = 1; //The rest only holds positive levels.
+        if (upperRange < lowerRange) return;
+
+        if (version.dense == nullptr && version.top == Node::null)
         {
-            if (rootParent->getLevel() > oldRoot->getLevel())
-            {
-                rootParent->setLeft(newRoot);
-            }
-            else
+            for (int i = 0; i < version.smallSize && version.small[i].level <= upperRange; ++i)
             {
-                rootParent->setRight(newRoot);
+                if (version.small[i].level >= lowerRange) sink.level(version.small[i].level, version.small[i].count);
             }
+            return;
         }
-        else
+        if (version.dense != nullptr)
         {
-            root = newRoot;
-            newRoot->setParent(nullptr);
+            version.dense->collect(lowerRange, upperRange, sink);
         }
 
-        //Pluck new root's old left child, and make it old root's new right:
-        oldRoot->setRight(newRoot->getLeft());
-
-        //Make old root the left child of the new root:
-        newRoot->setLeft(oldRoot);
-
-        //Update the heights, totalLevels and Ws that were affected:
-        oldRoot->updateHeight();
-        newRoot->updateHeight();
-
-        return newRoot;
-    }
-
-    SumTreeNode* LRRotation(SumTreeNode* subtreeRoot)
-    {
-        SumTreeNode *rootParent = subtreeRoot->getParent(),
-                *newRight = subtreeRoot,
-                *newLeft = newRight->getLeft(),
-                *newRoot = newLeft->getRight();
+        const Node* pool = nodes.data();
+        Index curr = version.top;
 
-        //Set new root:
-        if (rootParent != nullptr)
+        //Shared prefix:
+        while (curr != Node::null)
         {
-            if (rootParent->getLevel() > subtreeRoot->getLevel())
+            const Node& node = pool[curr];
+            if (upperRange < node.getLevel())
             {
-                rootParent->setLeft(newRoot);
+                curr = node.getLeft();
+            }
+            else if (lowerRange > node.getLevel())
+            {
+                curr = node.getRight();
             }
             else
             {
-                rootParent->setRight(newRoot);
+                break;
             }
         }
-        else
+        if (curr == Node::null)
         {
-            root = newRoot;
-            newRoot->setParent(nullptr);
+            return;
         }
+        sink.level(pool[curr].getLevel(), pool[curr].getInThisLevel(pool));
 
-        //Rotation fun stuff:
-        newRight->setLeft(newRoot->getRight());
-        newLeft->setRight(newRoot->getLeft());
-        newRoot->setLeft(newLeft);
-        newRoot->setRight(newRight);
-
-        //Update the heights that were affected:
-        newRight->updateHeight();
-        newLeft->updateHeight();
-        newRoot->updateHeight();
-        if (rootParent != nullptr) rootParent->updateHeight();
-
-        return newRoot;
-    }
-
-    SumTreeNode* RLRotation(SumTreeNode* subtreeRoot)
-    {
-        SumTreeNode *rootParent = subtreeRoot->getParent(),
-                *newLeft = subtreeRoot,
-                *newRight = newLeft->getRight(),
-                *newRoot = newRight->getLeft();
-
-        //Set new root:
-        if (rootParent != nullptr)
+        //Lower bound, on the left: everything at or above it.
+        Index lower = pool[curr].getLeft();
+        while (lower != Node::null)
         {
-            if (rootParent->getLevel() > subtreeRoot->getLevel())
+            const Node& node = pool[lower];
+            if (node.getLevel() >= lowerRange)
             {
-                rootParent->setLeft(newRoot);
+                const Node& right = pool[node.getRight()];
+                sink.level(node.getLevel(), node.getInThisLevel(pool));
+                sink.subtree(right.getW(), right.getAggregate());
+                lower = node.getLeft();
             }
             else
             {
-                rootParent->setRight(newRoot);
+                lower = node.getRight();
             }
         }
-        else
+
+        //Upper bound, on the right: everything at or below it.
+        Index upper = pool[curr].getRight();
+        while (upper != Node::null)
         {
-            root = newRoot;
-            newRoot->setParent(nullptr);
+            const Node& node = pool[upper];
+            if (node.getLevel() <= upperRange)
+            {
+                const Node& left = pool[node.getLeft()];
+                sink.level(node.getLevel(), node.getInThisLevel(pool));
+                sink.subtree(left.getW(), left.getAggregate());
+                upper = node.getRight();
+            }
+            else
+            {
+                upper = node.getLeft();
+            }
         }
-
-        //Rotation fun stuff:
-        newRight->setLeft(newRoot->getRight());
-        newLeft->setRight(newRoot->getLeft());
-        newRoot->setLeft(newLeft);
-        newRoot->setRight(newRight);
-
-        //Update the heights that were affected:
-        newRight->updateHeight();
-        newLeft->updateHeight();
-        newRoot->updateHeight();
-        if (rootParent != nullptr) rootParent->updateHeight();
-
-        return newRoot;
     }
 
-    /*
-     * Performs rotation based on subtreeRoot's balance factor and that of its children.
-     * @param recursive determines if this should happen all the way up to the root.
-     *        Should be set to true if rotate is called for node removal.
-     * Returns the new root of the subtree post-rotation.
-     */
-    SumTreeNode* rotate(SumTreeNode* subtreeRoot, bool recursive=false)
+    //The players with a level strictly above level (level >= 0), in one half-path.
+    template <class S>
+    void collectAbove(const View& version, Key level, S& sink) const
     {
-        SumTreeNode* newRoot = subtreeRoot;
-        int rootBF = getBalanceFactor(subtreeRoot);
-        if (abs(rootBF) > AVL_BALANCE_BOUND)
+        for (int i = version.smallSize - 1; i >= 0 && version.small[i].level > level; --i)
+        {
+            sink.level(version.small[i].level, version.small[i].count);
+        }
+        if (version.dense != nullptr && level < (Key)version.dense->counts.size() - 1)
         {
-            //rootBF is either 2==AVL_BALANCE_BOUND+1 (for Lx rotations) or minus that (for Rx rotations).
-            assert(rootBF == (AVL_BALANCE_BOUND + 1) || rootBF == -(AVL_BALANCE_BOUND + 1));
-            if (rootBF == AVL_BALANCE_BOUND + 1)
+            version.dense->collect(level + 1, (Key)version.dense->counts.size() - 1, sink);
+        }
+        const Node* pool = nodes.data();
+        Index curr = version.top;
+        while (curr != Node::null)
+        {
+            const Node &node = pool[curr], &right = pool[node.getRight()];
+            if (node.getLevel() > level)
             {
-                //Lx rotations
-                assert(abs(getBalanceFactor(subtreeRoot->getLeft())) <= 1);
-
-                if (getBalanceFactor(subtreeRoot->getLeft()) >= 0)
-                {
-                    newRoot = LLRotation(subtreeRoot);
-                }
-                else
-                {
-                    newRoot = LRRotation(subtreeRoot);
-                }
+                sink.level(node.getLevel(), node.getInThisLevel(pool));
+                sink.subtree(right.getW(), right.getAggregate());
+                curr = node.getLeft();
             }
             else
             {
-                //Rx rotations
-                assert(abs(getBalanceFactor(subtreeRoot->getRight())) <= 1);
-                if (getBalanceFactor(subtreeRoot->getRight()) <= 0)
-                {
-                    newRoot = RRRotation(subtreeRoot);
-                }
-                else
-                {
-                    newRoot = RLRotation(subtreeRoot);
-                }
-            }
-
-            //This is for the case of node removal.
-            if (recursive && newRoot->getParent() != nullptr)
-            {
-                return rotate(newRoot->getParent());
+                curr = node.getRight();
             }
         }
-        return newRoot;
     }
 
-    /*
-     * Finds the next in order (inorder) in the specific relevant case within removeNode.
-     */
-    static SumTreeNode* removeNode_nextInorderAux(SumTreeNode* node)
+    //The m highest players (level zero ones last), m <= player count.
+    template <class S>
+    void collectTopM(const View& version, Count m, S& sink) const
     {
-        assert(node != nullptr && node->getRight() != nullptr);
-        node = node->getRight();
-        while (node->getLeft() != nullptr)
+        if (m > getPlayerCount(version))
         {
-            node = node->getLeft();
+            throw Failure("sumLevelOfTopM: illegal m.");
         }
-        return node;
-    }
-
-    /*
-     * Finds the previous in order (inorder) of highest in the specific relevant case within removeNode.
-     */
-    void removeNode_updateHighestAux(SumTreeNode* node)
-    {
-        assert(node != nullptr && highest != nullptr);
-        if (node->getLevel() != highest->getLevel())
+        if (m <= 0)
         {
             return;
         }
-        if (node->getLeft() != nullptr)
+        Index top = version.top;
+        if (version.dense == nullptr && top == Node::null)
         {
-            highest = node->getLeft();
-            while (highest->getRight() != nullptr)
+            //From the highest level down; whatever is left over is level 0.
+            Count leftToSum = m;
+            for (int i = version.smallSize - 1; i >= 0 && leftToSum > 0; --i)
             {
-                highest = highest->getRight();
+                Count taken = leftToSum < version.small[i].count ? leftToSum : version.small[i].count;
+                sink.level(version.small[i].level, taken);
+                leftToSum -= taken;
             }
+            if (leftToSum > 0) sink.level(Key(0), leftToSum);
+            return;
         }
-        else if (node->getParent() != nullptr)
-        {
-            highest = node->getParent();
-        }
-        else
+
+        const Node* pool = nodes.data();
+        Count inNodes = top == Node::null ? Count(0) : pool[top].getW();
+        if (m > inNodes)
         {
-            highest = nullptr;
+            //All the nodes, then the highest dense levels; whatever is left over is level 0.
+            if (top != Node::null) sink.subtree(inNodes, pool[top].getAggregate());
+            Count leftToSum = m - inNodes;
+            if (version.dense != nullptr)
+            {
+                Count taken = std::min(leftToSum, version.dense->players);
+                version.dense->collectTop(taken, sink);
+                leftToSum -= taken;
+            }
+            if (leftToSum > 0) sink.level(Key(0), leftToSum);
+            return;
         }
-    }
 
-    /*
-     * Aux of removeNode to remove a leaf. Returns its parent, or nullptr if it was the root.
-     */
-    SumTreeNode* removeNode_LeafAux(SumTreeNode* node)
-    {
-        assert (node != nullptr && node->getHeight() == 0);
-        SumTreeNode* parent = node->getParent();
-        if (parent != nullptr)
+        Count leftToSum = m;
+        Index curr = top;
+        while (curr != Node::null)
         {
-            //Can't just check if value > parent value because sorting may momentarily be broken
-            //after using swapNodes for node removal.
-            //if (parent->getLeft() != nullptr && node->getLevel() == parent->getLeft()->getLevel())
-            if (parent->getLeft() == node)
+            const Node &node = pool[curr], &right = pool[node.getRight()];
+            if (right.getW() >= leftToSum)
             {
-                parent->setLeft(nullptr);
+                curr = node.getRight();
             }
             else
             {
-                parent->setRight(nullptr);
+                sink.subtree(right.getW(), right.getAggregate());
+                leftToSum -= right.getW();
+                Count inThisLevel = node.getInThisLevel(pool);
+                if (leftToSum <= inThisLevel)
+                {
+                    sink.level(node.getLevel(), leftToSum);
+                    return;
+                }
+                sink.level(node.getLevel(), inThisLevel);
+                leftToSum -= inThisLevel;
+                curr = node.getLeft();
             }
         }
-        else
-        {
-            root = nullptr;
-        }
-        delete node;
-        return parent;
+
+        throw Failure("Got to a weird place in sumTopM thingy in SumTree.");
+    }
+
+    Count countInRange(const View& version, Key lowerRange, Key upperRange) const
+    {
+        CountSink sink;
+        collectRange(version, lowerRange, upperRange, sink);
+        return sink.players;
+    }
+
+    Total sumLevelOfTopM(const View& version, Count m) const
+    {
+        AggregateSink sink;
+        collectTopM(version, m, sink);
+        return Aggregate::total(sink.aggregate);
+    }
+
+    template <class A>
+    void inorderAux(A& action, Index curr, Index parent) const
+    {
+        if (curr == Node::null) return;
+        const Node* pool = nodes.data();
+        const Node& node = pool[curr];
+        inorderAux(action, node.getLeft(), curr);
+        action(
+            node.getLevel(),
+            node.getInThisLevel(pool),
+            node.getHeight(),
+            parent == Node::null ? Key() : pool[parent].getLevel(),
+            node.getLeft() == Node::null ? Key() : pool[node.getLeft()].getLevel(),
+            node.getRight() == Node::null ? Key() : pool[node.getRight()].getLevel(),
+            node.getBalanceFactor(pool)
+        );
+        inorderAux(action, node.getRight(), curr);
+    }
+
+    Index LLRotation(Index subtreeRoot)
+    {
+        Node* pool = nodes.data();
+        Index newRoot = pool[subtreeRoot].getLeft();
+        Count oldRootOwn = pool[subtreeRoot].getInThisLevel(pool), newRootOwn = pool[newRoot].getInThisLevel(pool);
+
+        //Pluck new root's old right child, and make it old root's new left:
+        pool[subtreeRoot].setLeft(pool[newRoot].getRight());
+
+        //Make old root the right child of the new root:
+        pool[newRoot].setRight(subtreeRoot);
+
+        //Update the heights and aggregates that were affected (own counts read before the relinking):
+        pool[subtreeRoot].update(pool, oldRootOwn);
+        pool[newRoot].update(pool, newRootOwn);
+
+        return newRoot;
+    }
+
+    Index RRRotation(Index subtreeRoot)
+    {
+        Node* pool = nodes.data();
+        Index newRoot = pool[subtreeRoot].getRight();
+        Count oldRootOwn = pool[subtreeRoot].getInThisLevel(pool), newRootOwn = pool[newRoot].getInThisLevel(pool);
+
+        //Pluck new root's old left child, and make it old root's new right:
+        pool[subtreeRoot].setRight(pool[newRoot].getLeft());
+
+        //Make old root the left child of the new root:
+        pool[newRoot].setLeft(subtreeRoot);
+
+        //Update the heights and aggregates that were affected (own counts read before the relinking):
+        pool[subtreeRoot].update(pool, oldRootOwn);
+        pool[newRoot].update(pool, newRootOwn);
+
+        return newRoot;
+    }
+
+    Index LRRotation(Index subtreeRoot)
+    {
+        nodes[subtreeRoot].setLeft(RRRotation(nodes[subtreeRoot].getLeft()));
+        return LLRotation(subtreeRoot);
+    }
+
+    Index RLRotation(Index subtreeRoot)
+    {
+        nodes[subtreeRoot].setRight(LLRotation(nodes[subtreeRoot].getRight()));
+        return RRRotation(subtreeRoot);
     }
 
     /*
-     * Aux of removeNode to remove a node with only one child. Returns its parent or nullptr if root.
+     * Recomputes subtreeRoot's fields from its children and rotates it if its balance factor
+     * became invalid. Returns the new root of the subtree post-rotation.
      */
-    SumTreeNode* removeNode_OneChildAux(SumTreeNode* node)
+    Index rotate(Index subtreeRoot)
     {
-        assert (node->getLeft() == nullptr || node->getRight() == nullptr);
-        SumTreeNode *parent = node->getParent(), *child = node->getLeft();
-        if (child == nullptr) child = node->getRight();
-
-        if (parent == nullptr)
+        Node* pool = nodes.data();
+        pool[subtreeRoot].update(pool);
+        int rootBF = pool[subtreeRoot].getBalanceFactor(pool);
+        if (abs(rootBF) <= AVL_BALANCE_BOUND)
         {
-            root = child;
-            child->setParent(nullptr);
+            return subtreeRoot;
         }
-        else
+
+        //rootBF is either 2==AVL_BALANCE_BOUND+1 (for Lx rotations) or minus that (for Rx rotations).
+        assert(rootBF == (AVL_BALANCE_BOUND + 1) || rootBF == -(AVL_BALANCE_BOUND + 1));
+        STATS_INCREMENT(rotations);
+        if (rootBF == AVL_BALANCE_BOUND + 1)
         {
-            if (parent->getLeft() == node)
-            {
-                parent->setLeft(child);
-            }
-            else
+            //Lx rotations
+            bool single = pool[pool[subtreeRoot].getLeft()].getBalanceFactor(pool) >= 0;
+            if (sharing())
             {
-                parent->setRight(child);
+                thawForRotation(subtreeRoot, true, !single);
             }
+            return single ? LLRotation(subtreeRoot) : LRRotation(subtreeRoot);
+        }
+        //Rx rotations
+        bool single = pool[pool[subtreeRoot].getRight()].getBalanceFactor(pool) <= 0;
+        if (sharing())
+        {
+            thawForRotation(subtreeRoot, false, !single);
         }
-        delete node;
-        return parent;
+        return single ? RRRotation(subtreeRoot) : RLRotation(subtreeRoot);
     }
 
     /*
-     * Removes the node as though it's a normal binary search tree.
-     * Returns the lowest node affected.
+     * Fixes the nodes of a root-to-node path bottom-up after the node at its end changed:
+     * recomputes their fields, rotates where needed and relinks each subtree into its parent.
      */
-    SumTreeNode* removeNodeAux(SumTreeNode* node)
+    void updatePath(const Index* path, int depth)
     {
-        assert (node != nullptr);
+        for (int i = depth - 1; i >= 0; --i)
+        {
+            Index newSubtreeRoot = rotate(path[i]);
+            if (newSubtreeRoot != path[i])
+            {
+                relinkChild(path, i, path[i], newSubtreeRoot);
+            }
+        }
+    }
 
-        //Leaf:
-        if (node->getHeight() == 0)
+    //Replaces child (a child of path[depth - 1], or the root if depth == 0) with replacement.
+    void relinkChild(const Index* path, int depth, Index child, Index replacement)
+    {
+        if (depth == 0)
         {
-            return removeNode_LeafAux(node);
+            root = replacement;
+            return;
         }
-            //Only one descendant:
-        else if (node->getLeft() == nullptr || node->getRight() == nullptr)
+        Node& parent = nodes[path[depth - 1]];
+        if (parent.getLeft() == child)
         {
-            return removeNode_OneChildAux(node);
+            parent.setLeft(replacement);
         }
         else
         {
-            //Swap node with its successor in the inorder sense:
-            SumTreeNode* nextInOrder = removeNode_nextInorderAux(node);
-            swapNodes(node, nextInOrder);
-
-            //We're now looking at a node which either only has one descendant (since no left child),
-            //or is a leaf.
-            //Call the function again to enter one of the previous blocks.
-            return removeNodeAux(nextInOrder);
+            parent.setRight(replacement);
         }
     }
 
-    void swapNodes(SumTreeNode* a, SumTreeNode* b)
+public:
+    //Levels below denseLimit are counted densely once the tree outgrows the array; 1 keeps them all in nodes.
+    explicit BasicSumTree(int denseLimit = defaultDenseLimit): levelZero(0), denseLimit(denseLimit),
+        root(Node::null), freeList(Node::null), nodeCount(0), nodes(), versions(), small(), dense(),
+        reservedAdditions(0), reservedRemovals(0)
     {
-        assert(a != nullptr && b != nullptr);
-
-        //Swapping highest ptr too if needed:
-        if (highest->getLevel() == a->getLevel())
+        if (denseLimit < 1)
         {
-            highest = b;
+            throw InvalidInput("SumTree: the dense levels must start at 1.");
         }
-        else if (highest->getLevel() == b->getLevel())
-        {
-            highest = a;
-        }
-
-        //If highest is root then it can only have at most 1 left child, so we won't get here.
-        //if ()
-
-        a->swap(b);
     }
 
-public:
-    explicit SumTree(): levelZero(0), root(nullptr), highest(nullptr), nodeCount(0)
-    {}
-
-    void removeNode(int level)
+    void removeNode(Key level)
     {
+        useReservation(false);
         if (level == 0)
         {
             if (levelZero == 0)
@@ -776,103 +1296,433 @@ public:
             --levelZero;
             return;
         }
-        Order orderRel;
-        SumTreeNode* node = findLocation(level, orderRel);
-        if (node == nullptr || orderRel != equal)
+
+        if (level > 0 && level < denseEnd())
+        {
+            if (dense->counts[level] == 0)
+            {
+                throw Failure("Tried to remove non-existent node.");
+            }
+            dense->add(level, Count(-1));
+            if (getSize() <= maxSmallLevels / 4 && !reserved())
+            {
+                demote();
+            }
+            return;
+        }
+
+        if (isSmall())
+        {
+            int i = smallPosition(level);
+            if (i == (int)small.size() || small[i].level != level)
+            {
+                throw Failure("Tried to remove non-existent node.");
+            }
+            if (--small[i].count == 0)
+            {
+                small.erase(small.begin() + i);
+            }
+            return;
+        }
+
+        Index path[maxDepth];
+        int depth = 0;
+        Index curr = root;
+        while (curr != Node::null && nodes[curr].getLevel() != level)
+        {
+            path[depth++] = curr;
+            curr = level > nodes[curr].getLevel() ? nodes[curr].getRight() : nodes[curr].getLeft();
+        }
+        if (curr == Node::null)
         {
             //Node isn't in the tree.
             throw Failure("Tried to remove non-existent node.");
         }
-        node->decreaseInThisLevel();
-        SumTreeNode* nodeToFix;
-        if (node->getInThisLevel() == 0)
+
+        if (nodes[curr].getInThisLevel(nodes.data()) > 1)
         {
-            removeNode_updateHighestAux(node);
-            nodeToFix = removeNodeAux(node);
-            --nodeCount;
+            //The shape stays the same, just take the player off the path's aggregates.
+            if (sharing())
+            {
+                path[depth] = curr;
+                thawPath(path, depth + 1);
+                curr = path[depth];
+            }
+            nodes[curr].addToAggregates(level, Count(-1));
+            for (int i = 0; i < depth; ++i)
+            {
+                nodes[path[i]].addToAggregates(level, Count(-1));
+            }
+            return;
         }
-        else
+
+        int currDepth = depth;
+        path[depth++] = curr;
+        if (nodes[curr].getLeft() != Node::null && nodes[curr].getRight() != Node::null)
         {
-            nodeToFix = node->getParent();
+            //Take the place of the next in order (which has no left child), and remove that one instead.
+            Index next = nodes[curr].getRight();
+            while (nodes[next].getLeft() != Node::null)
+            {
+                path[depth++] = next;
+                next = nodes[next].getLeft();
+            }
+            path[depth++] = next;
+        }
+        if (sharing())
+        {
+            thawPath(path, depth);
+        }
+        //Take the players off the ws on the way down: the one leaving, and when the successor moves up,
+        //its own ones between its old and new place.
+        for (int i = 0; i <= currDepth; ++i)
+        {
+            nodes[path[i]].addToW(Count(-1));
+        }
+        if (depth - 1 > currDepth)
+        {
+            Count moved = nodes[path[depth - 1]].getInThisLevel(nodes.data());
+            for (int i = currDepth + 1; i < depth - 1; ++i)
+            {
+                nodes[path[i]].addToW(-moved);
+            }
+            nodes[path[currDepth]].copyKey(nodes[path[depth - 1]]);
         }
 
-        updateTree(nodeToFix);
+        //The removed node has at most one child now.
+        Index removed = path[--depth];
+        Index child = nodes[removed].getLeft() != Node::null
+                ? nodes[removed].getLeft() : nodes[removed].getRight();
+        relinkChild(path, depth, removed, child);
+        dropNode(removed);
+        --nodeCount;
+
+        updatePath(path, depth);
+        if (reserved())
+        {
+            return; //The updates to come count on the nodes.
+        }
+        if (getSize() <= maxSmallLevels / 4)
+        {
+            demote();
+        }
+        else if (root == Node::null && !sharing())
+        {
+            dropPool(); //The dense counts hold every level left; give the pool back.
+        }
     }
 
-    int getLevelZero() const
+    Count getLevelZero() const
     {
         return levelZero;
     }
 
-    void addNode(int level, int inThisLevel = 1)
+    void addNode(Key level, Count inThisLevel = 1)
     {
+        useReservation(true);
         if (level == 0)
         {
-            ++levelZero;
+            levelZero += inThisLevel;
             return;
         }
 
-        SumTreeNode* newNode(new SumTreeNode(level, inThisLevel));
+        if (isSmall())
+        {
+            int i = smallPosition(level);
+            if (i < (int)small.size() && small[i].level == level)
+            {
+                small[i].count += inThisLevel;
+                return;
+            }
+            if ((int)small.size() < maxSmallLevels)
+            {
+                LevelCount entry = { level, inThisLevel };
+                small.insert(small.begin() + i, entry);
+                return;
+            }
+            promote(); //And on to the dense counts or a new node.
+        }
 
-        if (root == nullptr)
+        if (level > 0 && level < denseEnd())
+        {
+            dense->add(level, inThisLevel);
+            return;
+        }
+        if (root == Node::null)
         {
-            root = highest = newNode;
+            root = allocateNode(level, inThisLevel);
             ++nodeCount;
+            return;
+        }
+
+        Index path[maxDepth];
+        int depth = 0;
+        Index curr = root;
+        while (curr != Node::null)
+        {
+            path[depth++] = curr;
+            Node& node = nodes[curr];
+            if (level == node.getLevel())
+            {
+                //Already there: just count the players in, the shape stays the same.
+                if (sharing())
+                {
+                    thawPath(path, depth);
+                }
+                for (int i = 0; i < depth; ++i)
+                {
+                    nodes[path[i]].addToAggregates(level, inThisLevel);
+                }
+                return;
+            }
+            curr = level > node.getLevel() ? node.getRight() : node.getLeft();
+        }
+
+        if (sharing())
+        {
+            thawPath(path, depth);
+        }
+        Index newNode = allocateNode(level, inThisLevel); //May move the pool, or fail before any count changes.
+        for (int i = 0; i < depth; ++i)
+        {
+            nodes[path[i]].addToW(inThisLevel);
+        }
+        Node& parent = nodes[path[depth - 1]];
+        if (level > parent.getLevel())
+        {
+            parent.setRight(newNode);
         }
         else
         {
-            Order orderRel;
-            SumTreeNode* location = findLocation(level, orderRel);
-            if (orderRel == equal)
+            parent.setLeft(newNode);
+        }
+        ++nodeCount;
+
+        updatePath(path, depth);
+    }
+
+    template <class A>
+    void inorder(A& action) const
+    {
+        for (const LevelCount& entry : small)
+        {
+            action(entry.level, entry.count, 0, Key(), Key(), Key(), 0);
+        }
+        for (int level = 1; level < denseEnd(); ++level)
+        {
+            if (dense->counts[level] != 0)
             {
-                location->increaseInThisLevel();
-                delete newNode;
-                newNode = location;
+                action((Key)level, dense->counts[level], 0, Key(), Key(), Key(), 0);
             }
-            else
+        }
+        inorderAux(action, root, Node::null);
+    }
+
+    //WITHOUT LEVELZERO.
+    /*
+     * Calls action(level, inThisLevel) from the highest level down, for as long as it returns true.
+     * Level zero isn't a node, so it is left out.
+     */
+    template <class A>
+    void forEachLevelDescending(A& action) const
+    {
+        for (int i = (int)small.size() - 1; i >= 0; --i)
+        {
+            if (!action(small[i].level, small[i].count))
             {
-                addNodeToLocation(location, newNode, orderRel);
-                ++nodeCount;
+                return;
             }
+        }
+        const Node* pool = nodes.data();
+        Index path[maxDepth];
+        int depth = 0;
+        Index curr = root;
+        while (curr != Node::null || depth > 0)
+        {
+            while (curr != Node::null)
+            {
+                path[depth++] = curr;
+                curr = pool[curr].getRight();
+            }
+            curr = path[--depth];
+            if (!action(pool[curr].getLevel(), pool[curr].getInThisLevel(pool)))
+            {
+                return;
+            }
+            curr = pool[curr].getLeft();
+        }
+        for (int level = denseEnd() - 1; level > 0; --level)
+        {
+            if (dense->counts[level] != 0 && !action((Key)level, dense->counts[level]))
+            {
+                return;
+            }
+        }
+    }
 
-            updateTree(newNode);
+    //Number of levels (other than zero), whichever way they are kept.
+    int getSize() const
+    {
+        return isSmall() ? (int)small.size() : (dense == nullptr ? 0 : dense->levels) + this->nodeCount;
+    }
+
+    //Nodes in use; 0 while the levels are in the array.
+    int getNodeCount() const
+    {
+        return this->nodeCount;
+    }
 
-            assert(highest != nullptr);
-            if (highest->getLevel() < newNode->getLevel())
+    //Whether snapshots of the tree are still live, so that updates copy the nodes they touch (and may throw).
+    bool hasSnapshots() const
+    {
+        return sharing();
+    }
+
+    /*
+     * Has the room for additions and removals to come (of any levels, in any order), so that making them
+     * doesn't throw: their nodes' slots and, while snapshots share the tree, the copies of the nodes they
+     * change (a path and its rotations, at most 3 per level) and the room to retire what those replace.
+     * Reservations add up, each update uses one, and until they are all used (or endUpdates) the tree stays
+     * out of the array and keeps its pool. A tree in the array that they could fill is built into nodes now.
+     * Throws if the room can't be had, with the reservation not made and the levels as they were.
+     */
+    void reserveUpdates(int additions, int removals)
+    {
+        reservedAdditions += additions;
+        reservedRemovals += removals;
+        try
+        {
+            if (isSmall() && (int)small.size() + reservedAdditions > maxSmallLevels)
             {
-                highest = newNode;
+                promote();
             }
+            std::size_t slots = 0, copies = 0;
+            if (isSmall())
+            {
+                small.reserve(std::min<std::size_t>(small.size() + reservedAdditions, maxSmallLevels));
+                if ((int)small.size() + reservedAdditions > maxSmallLevels)
+                {
+                    slots = small.size() + reservedAdditions; //Nothing to promote yet (denseLimit 1): it comes later.
+                }
+            }
+            else
+            {
+                slots = reservedAdditions;
+                if (sharing())
+                {
+                    int bits = 0;
+                    for (long long n = (long long)nodeCount + reservedAdditions + 2; n > 1; n /= 2)
+                    {
+                        ++bits;
+                    }
+                    int height = std::min(maxDepth, bits + bits / 2 + 2); //An AVL tree is under 1.45 log2(n + 2) high.
+                    copies = (std::size_t)(reservedAdditions + reservedRemovals) * 3 * height;
+                }
+            }
+            if (slots + copies > 0)
+            {
+                std::size_t needed = nodes.size() + slots + copies + 1; //And the sentinel of an empty pool.
+                if (needed - 1 > Node::maxIndex)
+                {
+                    throw AllocationError("SumTree: too many levels.");
+                }
+                if (nodes.capacity() < needed)
+                {
+                    nodes.reserve(std::max(needed, 2 * nodes.capacity()));
+                }
+                if (versions != nullptr && versions->births.size() < needed)
+                {
+                    versions->births.resize(needed);
+                }
+                reserveRetired(copies);
+            }
+        }
+        catch (...)
+        {
+            reservedAdditions -= additions;
+            reservedRemovals -= removals;
+            throw;
         }
     }
 
-    /*int getHighest() const
+    //Takes back reservations of updates that won't be made.
+    void releaseUpdates(int additions, int removals)
     {
-        return highest->getLevel();
-    }*/
+        reservedAdditions = std::max(0, reservedAdditions - additions);
+        reservedRemovals = std::max(0, reservedRemovals - removals);
+    }
 
-    template <class A>
-    void inorder(A& action) const
+    //Takes back every reservation; the room stays in the pool.
+    void endUpdates()
     {
-        inorderAux(action, root);
+        reservedAdditions = 0;
+        reservedRemovals = 0;
     }
 
-    //WITHOUT LEVELZERO.
-    int getSize() const
+    //Node slots held by the pool, in use or not (including the sentinel).
+    int getNodeCapacity() const
     {
-        return this->nodeCount;
+        return (int)nodes.capacity();
+    }
+
+    //Entries of the array: in use, and held.
+    int getSmallCount() const
+    {
+        return (int)small.size();
+    }
+
+    int getSmallCapacity() const
+    {
+        return (int)small.capacity();
+    }
+
+    //Bytes of the dense counts; 0 until the tree outgrows the array.
+    std::size_t getDenseSize() const
+    {
+        if (dense == nullptr)
+        {
+            return 0;
+        }
+        return sizeof(Dense) + (dense->counts.capacity() + dense->blockCounts.capacity()) * sizeof(Count)
+            + dense->blockAggregates.capacity() * sizeof(Value);
+    }
+
+    int getDenseLimit() const
+    {
+        return denseLimit;
+    }
+
+    Count getPlayerCount() const
+    {
+        return getPlayerCount(view());
+    }
+
+    //Highest level in the tree, 0 if it only has level zero players (or none).
+    Key getMaxLevel() const
+    {
+        const Node* pool = nodes.data();
+        Index curr = root;
+        if (isSmall()) return small.empty() ? Key(0) : small.back().level;
+        if (curr == Node::null) return dense == nullptr ? Key(0) : dense->maxLevel();
+        while (pool[curr].getRight() != Node::null)
+        {
+            curr = pool[curr].getRight();
+        }
+        return pool[curr].getLevel();
     }
 
-    int getPlayerCount() const
+    //Of the nodes: -1 while there are none (the levels are in the array, or all dense).
+    int getHeight() const
     {
-        return levelZero + (root == nullptr ? 0 : root->getW());
+        return root == Node::null ? -1 : nodes[root].getHeight();
     }
 
-    static std::unique_ptr<SumTree> treeFromArray(int* arr, int* levels, int size)
+    static std::unique_ptr<BasicSumTree> treeFromArray(Key* arr, Count* levels, int size, int denseLimit = defaultDenseLimit)
     {
-        return StaticAVLUtilities::AVLFromArray(arr, levels, size);
+        return StaticAVLUtilities::AVLFromArray(arr, levels, size, denseLimit);
     }
 
-    static int* treeToArray(const SumTree& tree, int** levels, bool reverse=false)
+    static Key* treeToArray(const BasicSumTree& tree, Count** levels, bool reverse=false)
     {
         return StaticAVLUtilities::treeToArray(tree, levels, reverse);
     }
@@ -880,98 +1730,228 @@ public:
     /*
      * THIS RUINS THE PARAMETER TREES! CAREFUL!
      */
-    static SumTree* mergeTrees(SumTree& t1, SumTree& t2)
+    static BasicSumTree* mergeTrees(BasicSumTree& t1, BasicSumTree& t2)
     {
         return StaticAVLUtilities::mergeTrees(t1, t2).release();
     }
 
-    int countInRange(int lowerRange, int upperRange) const
+    /*
+     * mergeTrees for any number of trees (at least 2), in O(N log count) for N levels in total.
+     * THIS RUINS THEM TOO, but only once the result is built: on failure it throws and leaves them as they were.
+     * (Trees that snapshots share retire their nodes, so the room for that is had before any is cleaned.)
+     */
+    static BasicSumTree* mergeTrees(BasicSumTree* const* trees, int count)
     {
-        if (upperRange < 0 || lowerRange > upperRange) return 0;
-
-        SumTreeNode *bottom, *top;
-        Order orderRel;
-        findLocationBounds(upperRange, orderRel, &top, nullptr);
-        if (top == nullptr) //upperRange is above 0 but below the minimal node.
+        std::unique_ptr<BasicSumTree> result = StaticAVLUtilities::mergedCopy(trees, count);
+        for (int i = 0; i < count; ++i)
         {
-            return lowerRange <= 0 ? levelZero : 0;
+            trees[i]->reserveRetired(trees[i]->nodeCount);
         }
-        if (lowerRange == upperRange)
+        for (int i = 0; i < count; ++i)
         {
-            return orderRel == equal ? top->getInThisLevel() : 0;
+            trees[i]->clean();
         }
+        return result.release();
+    }
 
-        if (lowerRange > 0)
-        {
-            findLocationBounds(lowerRange, orderRel, nullptr, &bottom);
-            return bottom == nullptr ? 0 //lowerRange > max
-                : lowerThan(top) + top->getInThisLevel() - lowerThan(bottom);
-        }
-        return lowerThan(top) + top->getInThisLevel() + getLevelZero();
+    //Same as mergeTrees, except that t1 and t2 stay intact.
+    static BasicSumTree* mergedCopy(const BasicSumTree& t1, const BasicSumTree& t2)
+    {
+        return StaticAVLUtilities::mergedCopy(t1, t2).release();
+    }
+
+    //Same as mergeTrees for any number of trees, except that they all stay intact.
+    static BasicSumTree* mergedCopy(BasicSumTree* const* trees, int count)
+    {
+        return StaticAVLUtilities::mergedCopy(trees, count).release();
+    }
 
+    //A new tree of whole's players without part's, built in O(size) like a merge; both stay intact.
+    //Every player of part must be in whole (counted by level), otherwise this throws Failure.
+    static BasicSumTree* difference(const BasicSumTree& whole, const BasicSumTree& part)
+    {
+        return StaticAVLUtilities::differenceCopy(whole, part).release();
+    }
+
+    //Players with a level in [lowerRange, upperRange].
+    Count countInRange(Key lowerRange, Key upperRange) const
+    {
+        return countInRange(view(), lowerRange, upperRange);
+    }
+
+    //Players with a level in [lowerRange, upperRange], and the aggregate of their levels.
+    Value aggregateInRange(Key lowerRange, Key upperRange, Count* players) const
+    {
+        AggregateSink sink;
+        collectRange(view(), lowerRange, upperRange, sink);
+        *players = sink.players;
+        return sink.aggregate;
+    }
+
+    //Players with a level strictly above level (level >= 0).
+    Count countAbove(Key level) const
+    {
+        CountSink sink;
+        collectAbove(view(), level, sink);
+        return sink.players;
+    }
+
+    //Players with a level strictly above level (level >= 0), and the sum of their levels.
+    void countAbove(Key level, Count* players, Total* levelSum) const
+    {
+        AggregateSink sink;
+        collectAbove(view(), level, sink);
+        *players = sink.players;
+        *levelSum = Aggregate::total(sink.aggregate);
     }
 
     //This should only be called if m <= player count.
-    int sumLevelOfTopM(int m) const
+    Total sumLevelOfTopM(Count m) const
+    {
+        return sumLevelOfTopM(view(), m);
+    }
+
+    //The aggregate of the m highest players' levels, m <= player count.
+    Value aggregateOfTopM(Count m) const
     {
-        if (m > getPlayerCount())
+        AggregateSink sink;
+        collectTopM(view(), m, sink);
+        return sink.aggregate;
+    }
+
+    //Drops every level but zero: the nodes, the dense counts and the array (level zero players stay).
+    void clean()
+    {
+        if (sharing())
         {
-            throw Failure("sumLevelOfTopM: illegal m.");
+            //The snapshots still read the pool: retire the nodes one by one instead. Every allocation comes
+            //first (the depth-first stack keeps at most one sibling per level), so this fails as a whole.
+            reserveRetired(nodeCount);
+            Index pending[maxDepth + 1];
+            int count = 0;
+            if (root != Node::null) pending[count++] = root;
+            while (count > 0)
+            {
+                Index curr = pending[--count];
+                if (nodes[curr].getLeft() != Node::null) pending[count++] = nodes[curr].getLeft();
+                if (nodes[curr].getRight() != Node::null) pending[count++] = nodes[curr].getRight();
+                assert(count <= maxDepth + 1);
+                dropNode(curr);
+            }
+            this->root = Node::null;
+            this->nodeCount = 0;
+            std::vector<LevelCount>().swap(small);
+            dense.reset();
+            return;
         }
-        if (root == nullptr)
+        std::vector<LevelCount>().swap(small);
+        dense.reset();
+        dropPool();
+    }
+
+    //A frozen version of the tree, answering the queries as they stood when it was taken.
+    class Snapshot
+    {
+        friend class BasicSumTree;
+    private:
+        BasicSumTree* tree;
+        Index root;
+        Count levelZero;
+        std::vector<LevelCount> small; //Copies: the array and the dense counts are written in place.
+        std::unique_ptr<Dense> dense;
+        unsigned generation;
+
+        Snapshot(BasicSumTree* tree, unsigned generation) : tree(tree), root(tree->root), levelZero(tree->levelZero),
+            small(tree->small), dense(tree->dense == nullptr ? nullptr : new Dense(*tree->dense)), generation(generation)
+        {}
+
+        View view() const
         {
-            return 0; //They're all level 0.
+            View version = { root, small.data(), (int)small.size(), dense.get(), levelZero };
+            return version;
         }
 
-        int leftToSum = m, sum = 0;
-        SumTreeNode* curr = root;
+    public:
+        Snapshot(const Snapshot& other) = delete;
+        Snapshot& operator=(const Snapshot& other) = delete;
 
-        if (leftToSum > root->getW())
+        Count getPlayerCount() const
         {
-            leftToSum = root->getW(); //Take minimum amount from levelZeros.
+            return tree->getPlayerCount(view());
         }
 
-        while (leftToSum > 0)
+        Count countInRange(Key lowerRange, Key upperRange) const
         {
-            if (curr->getRightW() >= leftToSum)
-            {
-                curr = curr->getRight();
-            }
-            else
-            {
-                sum += curr->getRightTotalLevel();
-                leftToSum -= curr->getRightW();
-                if (leftToSum <= curr->getInThisLevel())
-                {
-                    return sum + leftToSum * curr->getLevel();
-                }
-                else
-                {
-                    sum += curr->getInThisLevel() * curr->getLevel();
-                    leftToSum -= curr->getInThisLevel();
-                    curr = curr->getLeft();
-                }
-            }
+            return tree->countInRange(view(), lowerRange, upperRange);
         }
 
-        throw Failure("Got to a weird place in sumTopM thingy in SumTree.");
-        return -1;
-    }
+        Total sumLevelOfTopM(Count m) const
+        {
+            return tree->sumLevelOfTopM(view(), m);
+        }
 
-    void clean()
+        //May delete the tree, if its owner already let go of it.
+        ~Snapshot()
+        {
+            if (tree != nullptr) tree->releaseSnapshot(generation);
+        }
+    };
+
+    //The tree's current nodes just stop being written in place; the array or the dense counts are copied.
+    std::unique_ptr<Snapshot> takeSnapshot()
     {
-        this->freeList();
-        this->root = nullptr;
-        this->highest = nullptr;
-        this->nodeCount = 0;
+        if (versions == nullptr)
+        {
+            versions.reset(new Versions());
+        }
+        if (versions->births.size() < nodes.size())
+        {
+            versions->births.resize(nodes.size()); //Nodes from before the bookkeeping: generation 0.
+        }
+        unsigned generation = versions->generation + 1;
+        std::unique_ptr<Snapshot> snapshot(new Snapshot(this, generation));
+        try
+        {
+            ++versions->live[generation];
+        }
+        catch (std::bad_alloc& exception)
+        {
+            snapshot->tree = nullptr;
+            throw;
+        }
+        versions->generation = generation;
+        return snapshot;
     }
 
-    SumTree(SumTree& other) = delete;
-    SumTree& operator=(SumTree& other) = delete;
-    ~SumTree()
+    //Deletes the tree, or leaves that to its last snapshot if some are still alive.
+    static void release(BasicSumTree* tree)
     {
-        freeList();
+        if (tree != nullptr && tree->sharing())
+        {
+            tree->versions->orphaned = true;
+            return;
+        }
+        delete tree;
     }
+
+    BasicSumTree(BasicSumTree& other) = delete;
+    BasicSumTree& operator=(BasicSumTree& other) = delete;
+    ~BasicSumTree() = default;
 };
 
-#endif //AVLTree_HPP 
\ No newline at end of file
+template <class Key, class Count, class Aggregate>
+const int BasicSumTree<Key, Count, Aggregate>::maxDepth;
+
+template <class Key, class Count, class Aggregate>
+const int BasicSumTree<Key, Count, Aggregate>::maxSmallLevels;
+
+template <class Key, class Count, class Aggregate>
+const int BasicSumTree<Key, Count, Aggregate>::defaultDenseLimit;
+
+template <class Key, class Count, class Aggregate>
+const int BasicSumTree<Key, Count, Aggregate>::denseBlock;
+
+//Levels and counts in ints, and just their sum on top.
+typedef BasicSumTree<int, int, BothAggregates<LevelSum<long long>, LevelSquareSum<unsigned long long> > > SumTree;
+
+#endif //AVLTree_HPP
@@ -0,0 +1,160 @@
+#ifndef SUMTREE_AGGREGATES_H
+#define SUMTREE_AGGREGATES_H
+
+#include <limits>
+
+/*
+ * Aggregate policies for BasicSumTree: what every node (and every block of dense levels) keeps about
+ * the players under it, besides how many they are. A policy is a monoid over the levels, resolved at
+ * compile time, so a tree stores and updates the aggregates it is given and no others:
+ *  - Value: what is kept, and Total: the type of the level sum the tree reports (total(value)),
+ *  - identity(): the Value of no player,
+ *  - of(level, players): the Value of players players at one level (players > 0),
+ *  - combine(a, b): the Value of both sets of players together,
+ *  - adjust(value, level, players): players joining a level the set already has (or leaving it, if
+ *    negative) while it keeps some. For sums that is adding of(level, players); min and max stay.
+ *  - invertible: whether adjust also works when a level empties out. If not, a block of dense levels
+ *    whose level empties is recombined from its levels.
+ *
+ * The tree's own queries (sumLevelOfTopM, countAbove with a sum) read total(): every policy it is
+ * instantiated with has a level sum, and min, max or the sum of squares come on top with
+ * BothAggregates.
+ */
+
+//Sum of the levels.
+template <class T>
+struct LevelSum
+{
+    typedef T Value;
+    typedef T Total;
+    static const bool invertible = true;
+
+    static Value identity() { return Value(0); }
+
+    template <class Key, class Count>
+    static Value of(Key level, Count players) { return (Value)players * (Value)level; }
+
+    static Value combine(const Value& a, const Value& b) { return a + b; }
+
+    template <class Key, class Count>
+    static void adjust(Value& value, Key level, Count players) { value += (Value)players * (Value)level; }
+
+    static Total total(const Value& value) { return value; }
+};
+
+//Sum of the squared levels, for variances. With an unsigned T it is kept modulo 2^bits, which a sum that outgrows
+//T needs, as removals come off it exactly all the same.
+template <class T>
+struct LevelSquareSum
+{
+    typedef T Value;
+    static const bool invertible = true;
+
+    static Value identity() { return Value(0); }
+
+    template <class Key, class Count>
+    static Value of(Key level, Count players) { return (Value)players * (Value)level * (Value)level; }
+
+    static Value combine(const Value& a, const Value& b) { return a + b; }
+
+    template <class Key, class Count>
+    static void adjust(Value& value, Key level, Count players) { value += (Value)players * (Value)level * (Value)level; }
+};
+
+//Lowest level; the identity is the highest representable one.
+template <class Key>
+struct LevelMin
+{
+    typedef Key Value;
+    static const bool invertible = false;
+
+    static Value identity() { return std::numeric_limits<Key>::max(); }
+
+    template <class Count>
+    static Value of(Key level, Count players) { return level; }
+
+    static Value combine(const Value& a, const Value& b) { return a < b ? a : b; }
+
+    template <class Count>
+    static void adjust(Value& value, Key level, Count players) {}
+};
+
+//Highest level; the identity is the lowest representable one.
+template <class Key>
+struct LevelMax
+{
+    typedef Key Value;
+    static const bool invertible = false;
+
+    static Value identity() { return std::numeric_limits<Key>::min(); }
+
+    template <class Count>
+    static Value of(Key level, Count players) { return level; }
+
+    static Value combine(const Value& a, const Value& b) { return a > b ? a : b; }
+
+    template <class Count>
+    static void adjust(Value& value, Key level, Count players) {}
+};
+
+//The Total of a policy that has a level sum, void for the others.
+template <class T>
+struct VoidType
+{
+    typedef void Type;
+};
+
+template <class Policy, class = void>
+struct TotalOf
+{
+    typedef void Type;
+};
+
+template <class Policy>
+struct TotalOf<Policy, typename VoidType<typename Policy::Total>::Type>
+{
+    typedef typename Policy::Total Type;
+};
+
+//Two policies side by side. The level sum, if any, is the first one's.
+template <class First, class Second>
+struct BothAggregates
+{
+    struct Value
+    {
+        typename First::Value first;
+        typename Second::Value second;
+    };
+    typedef typename TotalOf<First>::Type Total;
+    static const bool invertible = First::invertible && Second::invertible;
+
+    static Value identity()
+    {
+        Value value = { First::identity(), Second::identity() };
+        return value;
+    }
+
+    template <class Key, class Count>
+    static Value of(Key level, Count players)
+    {
+        Value value = { First::of(level, players), Second::of(level, players) };
+        return value;
+    }
+
+    static Value combine(const Value& a, const Value& b)
+    {
+        Value value = { First::combine(a.first, b.first), Second::combine(a.second, b.second) };
+        return value;
+    }
+
+    template <class Key, class Count>
+    static void adjust(Value& value, Key level, Count players)
+    {
+        First::adjust(value.first, level, players);
+        Second::adjust(value.second, level, players);
+    }
+
+    static Total total(const Value& value) { return First::total(value.first); }
+};
+
+#endif //SUMTREE_AGGREGATES_H
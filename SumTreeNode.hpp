@@ -1,159 +1,148 @@
 #ifndef SUMTREE_BIDIRECTIONAL_NODE
 #define SUMTREE_BIDIRECTIONAL_NODE
 
-#include <cassert>
+#include "SumTreeAggregates.hpp"
 
-//A bidirectional node to be used for a our Sum Tree.
-//We won't make it generic this time.
-class SumTreeNode
+#include <cassert>
+#include <cstdint>
+
+//A compact node to be used for a our Sum Tree.
+//Nodes live in their tree's contiguous pool and refer to their children by index; there is no
+//parent pointer (the tree keeps an explicit path instead). Index 0 is the pool's null sentinel,
+//whose height and count are zero and whose aggregate is the identity, so children can be read
+//without checking for null.
+//A node doesn't store its own player count: it is w minus its children's, which the descents read
+//anyway. That is what leaves room for the 64-bit level sum and sum of squares in 32 bytes.
+//Generic over the level (Key), the player count (Count) and what else is summed up (Aggregate, see
+//SumTreeAggregates.hpp); SumTreeNode is the one the game uses.
+template <class Key, class Count, class Aggregate>
+class BasicSumTreeNode
 {
+public:
+    typedef uint32_t Index;
+    typedef typename Aggregate::Value Value;
+    static const Index null = 0;
+    static const Index maxIndex = (1u << 29) - 1;
+
 private:
-    SumTreeNode* left;
-    SumTreeNode* right;
-    SumTreeNode* parent;
-	
-	int level; //This will be the key.
-	int inThisLevel;
-	int totalLevel;
-	int w;
-	int height;
+    Key level; //This will be the key.
+    Count w;
+    Value aggregate;
+    uint64_t left : 29;
+    uint64_t right : 29;
+    uint64_t height : 6; //Counted from 1 at the leaves, so that the sentinel can have 0.
 
 public:
-    explicit SumTreeNode(int level, int inThisLevel = 1)
-        :   left(nullptr), right(nullptr), parent(nullptr), level(level),
-            inThisLevel(inThisLevel), totalLevel(level), w(1), height(0)
-    {
-        updateHeight();
-    }
+    //Sentinel.
+    BasicSumTreeNode() : level(0), w(0), aggregate(Aggregate::identity()), left(null), right(null), height(0) {}
 
-    SumTreeNode& operator=(SumTreeNode& other) = delete;
+    //A leaf.
+    explicit BasicSumTreeNode(Key level, Count inThisLevel = 1)
+        :   level(level), w(inThisLevel), aggregate(Aggregate::of(level, inThisLevel)), left(null), right(null),
+            height(1)
+    {}
 
-    SumTreeNode() = delete;
-    ~SumTreeNode() = default;
-
-    void setLeft(SumTreeNode* newLeft)
+    void setLeft(Index newLeft)
     {
         this->left = newLeft;
-        if (newLeft != nullptr)
-        {
-            newLeft->parent = this;
-        }
     }
 
-    void increaseInThisLevel()
+    void setRight(Index newRight)
     {
-        ++(this->inThisLevel);
-        this->totalLevel += level;
-        ++(this->w);
+        this->right = newRight;
     }
 
-    void decreaseInThisLevel()
+    Index getLeft() const
     {
-        --(this->inThisLevel);
-        this->totalLevel -= level;
-        --(this->w);
+        return (Index)left;
     }
 
-    void setRight(SumTreeNode* newRight)
+    Index getRight() const
     {
-        this->right = newRight;
-        if (newRight != nullptr)
-        {
-            newRight->parent = this;
-        }
+        return (Index)right;
     }
 
-    void setParent(SumTreeNode* newParent)
+    //Only for nodes on the path to an existing level, where the shape doesn't change (and the level stays).
+    void addToAggregates(Key level, Count players)
     {
-        this->parent = newParent;
+        this->w += players;
+        Aggregate::adjust(this->aggregate, level, players);
     }
 
-    SumTreeNode* getLeft()
+    //players more (or fewer) in the subtree; the aggregate gets fixed by an update call.
+    void addToW(Count players)
     {
-        return left;
+        this->w += players;
     }
 
-    SumTreeNode* getRight()
+    //Recomputes height and the aggregate from the children (looked up in pool) and w, which must be right already.
+    void update(const BasicSumTreeNode* pool)
     {
-        return right;
+        update(pool, getInThisLevel(pool));
     }
 
-    SumTreeNode* getParent()
+    //Same, for a node whose children changed: its own count has to be given, w follows.
+    void update(const BasicSumTreeNode* pool, Count inThisLevel)
     {
-        return parent;
+        const BasicSumTreeNode &l = pool[left], &r = pool[right];
+        this->height = 1 + (l.height > r.height ? l.height : r.height);
+        this->w = l.w + r.w + inThisLevel;
+        this->aggregate = Aggregate::combine(Aggregate::combine(l.aggregate, Aggregate::of(level, inThisLevel)),
+                                             r.aggregate);
     }
 
-    void updateHeight()
+    //Takes over other's key. The counts and aggregates are the caller's to fix.
+    void copyKey(const BasicSumTreeNode& other)
     {
-        int lh = this->getLeftHeight(), rh = this->getRightHeight();
-        this->height = 1 + (lh > rh ? lh : rh);
-
-        this->w = this->getLeftW() + this->getRightW() + this->inThisLevel;
-        this->totalLevel = this->getLeftTotalLevel() + this->getRightTotalLevel() + inThisLevel * level;
+        this->level = other.level;
     }
 
+    //0 for leaves, -1 for the sentinel.
     int getHeight() const
     {
-        return height;
+        return (int)height - 1;
     }
 
-    int getLevel() const
+    Key getLevel() const
     {
         return level;
     }
-	
-	int getInThisLevel() const
-    {
-        return inThisLevel;
-    }
-	
-	int getW() const
-    {
-        return w;
-    }
 
-    int getLeftHeight() const
+    //Players in this very level: w minus the children's.
+    Count getInThisLevel(const BasicSumTreeNode* pool) const
     {
-        return left == nullptr ? -1 : left->height;
+        return w - pool[left].w - pool[right].w;
     }
 
-    int getLeftW() const
+    Count getW() const
     {
-        return left == nullptr ? 0 : left->w;
+        return w;
     }
 
-    int getRightW() const
+    const Value& getAggregate() const
     {
-        return right == nullptr ? 0 : right->w;
+        return aggregate;
     }
 
-    int getLeftTotalLevel() const
+    typename Aggregate::Total getTotalLevel() const
     {
-        return left == nullptr ? 0 : left->totalLevel;
+        return Aggregate::total(aggregate);
     }
 
-    int getRightTotalLevel() const
+    int getBalanceFactor(const BasicSumTreeNode* pool) const
     {
-        return right == nullptr ? 0 : right->totalLevel;
+        return (int)pool[left].height - (int)pool[right].height;
     }
+};
 
-    int getRightHeight() const
-    {
-        return right == nullptr ? -1 : right->height;
-    }
+template <class Key, class Count, class Aggregate>
+const typename BasicSumTreeNode<Key, Count, Aggregate>::Index BasicSumTreeNode<Key, Count, Aggregate>::null;
 
-    void swap(SumTreeNode* other)
-    {
-        int temp = other->level;
-        other->level = level;
-        level = temp;
+template <class Key, class Count, class Aggregate>
+const typename BasicSumTreeNode<Key, Count, Aggregate>::Index BasicSumTreeNode<Key, Count, Aggregate>::maxIndex;
 
-        temp = other->inThisLevel;
-        other->inThisLevel = inThisLevel;
-        inThisLevel = temp;
+typedef BasicSumTreeNode<int, int, BothAggregates<LevelSum<long long>, LevelSquareSum<unsigned long long> > > SumTreeNode;
 
-        //The rest of the fields get fixed by updateHeight calls.
-    }
-};
+static_assert(sizeof(SumTreeNode) == 32, "SumTreeNode is meant to stay compact.");
 
 #endif //AVLTREE_BIDIRECTIONAL_NODE
@@ -0,0 +1,169 @@
+#include "WorkStealingPool.hpp"
+
+WorkStealingPool::WorkStealingPool(int workers) : queues(), threads(), running(), lock(), wake(), done(), batch(0),
+    stopping(false), failure(), pending(0)
+{
+    for (int i = 0; i < workers + 1; ++i)
+    {
+        queues.emplace_back(new Queue());
+    }
+    try
+    {
+        for (int i = 0; i < workers; ++i)
+        {
+            threads.emplace_back(&WorkStealingPool::work, this, i);
+        }
+    }
+    catch (...)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& thread : threads) thread.join();
+        throw;
+    }
+}
+
+WorkStealingPool::Task* WorkStealingPool::take(int self)
+{
+    {
+        Queue& own = *queues[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty())
+        {
+            Task* task = own.tasks.front();
+            own.tasks.pop_front();
+            return task;
+        }
+    }
+    for (std::size_t i = 1; i < queues.size(); ++i)
+    {
+        Queue& other = *queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(other.lock);
+        if (!other.tasks.empty())
+        {
+            Task* task = other.tasks.back();
+            other.tasks.pop_back();
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+bool WorkStealingPool::runOne(int self)
+{
+    Task* task = take(self);
+    if (task == nullptr)
+    {
+        return false;
+    }
+
+    try
+    {
+        (*task)();
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!failure) failure = std::current_exception();
+    }
+    if (--pending == 0)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        done.notify_all();
+    }
+    return true;
+}
+
+void WorkStealingPool::work(int self)
+{
+    unsigned long long seen = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&]() { return stopping || batch != seen; });
+            if (stopping) return;
+            seen = batch;
+        }
+        while (runOne(self)) {}
+    }
+}
+
+void WorkStealingPool::run(std::vector<Task>& tasks)
+{
+    if (tasks.empty())
+    {
+        return;
+    }
+    if (threads.empty())
+    {
+        std::exception_ptr first;
+        for (Task& task : tasks)
+        {
+            try
+            {
+                task();
+            }
+            catch (...)
+            {
+                if (!first) first = std::current_exception();
+            }
+        }
+        if (first) std::rethrow_exception(first);
+        return;
+    }
+
+    std::lock_guard<std::mutex> one(running);
+    pending = (int)tasks.size();
+    for (std::size_t i = 0; i < tasks.size(); ++i)
+    {
+        Queue& queue = *queues[i % queues.size()];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.tasks.push_back(&tasks[i]);
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        failure = nullptr;
+        ++batch;
+    }
+    wake.notify_all();
+
+    while (runOne((int)queues.size() - 1)) {}
+
+    std::exception_ptr thrown;
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [&]() { return pending == 0; });
+        thrown = failure;
+        failure = nullptr;
+    }
+    if (thrown) std::rethrow_exception(thrown);
+}
+
+int WorkStealingPool::getWorkerCount() const
+{
+    return (int)threads.size();
+}
+
+WorkStealingPool& WorkStealingPool::shared()
+{
+    static WorkStealingPool pool(std::thread::hardware_concurrency() > 1
+                                 ? (int)std::thread::hardware_concurrency() - 1 : 0);
+    return pool;
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
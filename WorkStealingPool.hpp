@@ -0,0 +1,69 @@
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A fixed set of worker threads for splitting one structure update into independent tasks.
+ *
+ * run() deals the tasks out round robin, in the order given, to one queue per worker plus one for the
+ * calling thread, which works too. Every thread takes from the front of its own queue and, once it is
+ * empty, steals from the back of the others': big tasks given first start first, and whoever is done
+ * early picks up the small ones left over.
+ */
+class WorkStealingPool
+{
+public:
+    typedef std::function<void()> Task;
+
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<Task*> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue> > queues; //One per worker, then the caller's.
+    std::vector<std::thread> threads;
+
+    std::mutex running; //One run at a time.
+    std::mutex lock; //Guards the fields below.
+    std::condition_variable wake;
+    std::condition_variable done;
+    unsigned long long batch; //Runs started so far.
+    bool stopping;
+    std::exception_ptr failure; //The first exception of the current run.
+    std::atomic<int> pending; //Tasks of the current run not finished yet.
+
+    Task* take(int self);
+    bool runOne(int self);
+    void work(int self);
+
+public:
+    explicit WorkStealingPool(int workers);
+    WorkStealingPool(const WorkStealingPool& other) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool& other) = delete;
+
+    /*
+     * Runs every task and returns once they are all done. If some threw, the first exception is
+     * rethrown (after the others ran). With no workers, the caller just runs them in order.
+     */
+    void run(std::vector<Task>& tasks);
+
+    int getWorkerCount() const;
+
+    //The process-wide pool: one worker per hardware thread, besides the caller.
+    static WorkStealingPool& shared();
+
+    ~WorkStealingPool();
+};
+
+#endif //WORK_STEALING_POOL_H
@@ -0,0 +1,336 @@
+/*
+ * Trace-driven benchmark of the library2 API.
+ *
+ * Either replays a command trace (text, as main2.cpp reads it, or binary, see CommandProtocol.hpp),
+ * or synthesizes one. Every call is timed individually into a per-API latency histogram, and the
+ * report (throughput, latency percentiles, peak RSS) is printed as JSON.
+ *
+ * Usage: bench [--trace FILE] [--ops N] [--k K] [--scale S] [--players P] [--max-level-increase L]
+ *              [--merge-ratio R] [--query-ratio R] [--seed X]
+ */
+
+#include "CommandProtocol.hpp"
+#include "LatencyHistogram.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+#include <sys/resource.h>
+
+using CommandProtocol::BinaryCommand;
+using CommandProtocol::BinaryResult;
+
+struct SynthesisConfig
+{
+    long ops = 1000000;
+    int k = 1000;
+    int scale = 200;
+    int players = 100000; //Size of the player ID space.
+    int maxLevelIncrease = 10;
+    double mergeRatio = 0.0005;
+    double queryRatio = 0.3;
+    unsigned seed = 1;
+};
+
+static BinaryCommand makeCommand(int code, int a = 0, int b = 0, int c = 0, int d = 0)
+{
+    BinaryCommand command = { code, { a, b, c, d } };
+    return command;
+}
+
+/*
+ * Builds a trace that mostly succeeds: it keeps track of which players exist, so removals,
+ * level increases and score changes target live players, and queries ask about the group of
+ * one of them, within the levels handed out so far.
+ */
+static void synthesize(const SynthesisConfig& config, std::vector<BinaryCommand>& trace)
+{
+    std::mt19937 random(config.seed);
+    std::uniform_real_distribution<double> coin(0, 1);
+    std::uniform_int_distribution<int> group(1, config.k), score(1, config.scale),
+        increase(1, config.maxLevelIncrease);
+
+    std::vector<int> live, freeIds;
+    std::vector<int> groupOf(config.players + 1), levelOf(config.players + 1);
+    long long levelSum = 0; //Of the live players.
+    for (int id = config.players; id > 0; --id)
+    {
+        freeIds.push_back(id);
+    }
+
+    trace.reserve(config.ops + 2);
+    trace.push_back(makeCommand(CommandProtocol::INIT, config.k, config.scale));
+    for (long i = 0; i < config.ops; ++i)
+    {
+        double roll = coin(random);
+        if (roll < config.mergeRatio)
+        {
+            trace.push_back(makeCommand(CommandProtocol::MERGE_GROUPS, group(random), group(random)));
+        }
+        else if (roll < config.mergeRatio + config.queryRatio)
+        {
+            //No player in range, or an m past the group's players, is a FAILURE that returns early.
+            //So the query is about a live player: its group (merges only make it bigger) and levels
+            //around its own, and m stays within about half the size the group has on average.
+            int subject = live.empty() ? 0 : live[std::uniform_int_distribution<size_t>(0, live.size() - 1)(random)];
+            int groupId = 0;
+            long expected = (long)live.size();
+            if (subject != 0 && coin(random) >= 0.1)
+            {
+                groupId = groupOf[subject];
+                expected = 1 + (long)live.size() / config.k;
+            }
+            if (coin(random) < 0.5)
+            {
+                int mean = live.empty() ? 0 : (int)(levelSum / (long long)live.size());
+                int low = std::uniform_int_distribution<int>(0, levelOf[subject])(random);
+                int high = levelOf[subject] + std::uniform_int_distribution<int>(0, mean + config.maxLevelIncrease)(random);
+                trace.push_back(makeCommand(CommandProtocol::GET_PERCENT_OF_PLAYERS_WITH_SCORE_IN_BOUNDS,
+                                            groupId, score(random), low, high));
+            }
+            else
+            {
+                int most = (int)std::max(1L, std::min(100L, expected / 2));
+                int m = std::uniform_int_distribution<int>(1, most)(random);
+                trace.push_back(makeCommand(CommandProtocol::AVERAGE_HIGHEST_PLAYER_LEVEL_BY_GROUP, groupId, m));
+            }
+        }
+        else
+        {
+            //Updates. Grow the population until about half the ID space is used.
+            double update = coin(random);
+            bool grow = live.size() < (size_t)config.players / 2;
+            if (live.empty() || (grow && update < 0.5) || (!grow && update < 0.2 && !freeIds.empty()))
+            {
+                int id = freeIds.back();
+                freeIds.pop_back();
+                live.push_back(id);
+                groupOf[id] = group(random);
+                levelOf[id] = 0;
+                trace.push_back(makeCommand(CommandProtocol::ADD_PLAYER, id, groupOf[id], score(random)));
+                continue;
+            }
+
+            size_t victim = std::uniform_int_distribution<size_t>(0, live.size() - 1)(random);
+            int id = live[victim];
+            if (update < 0.6)
+            {
+                int levels = increase(random);
+                levelOf[id] += levels;
+                levelSum += levels;
+                trace.push_back(makeCommand(CommandProtocol::INCREASE_PLAYER_ID_LEVEL, id, levels));
+            }
+            else if (update < 0.8)
+            {
+                trace.push_back(makeCommand(CommandProtocol::CHANGE_PLAYER_ID_SCORE, id, score(random)));
+            }
+            else
+            {
+                live[victim] = live.back();
+                live.pop_back();
+                freeIds.push_back(id);
+                levelSum -= levelOf[id];
+                trace.push_back(makeCommand(CommandProtocol::REMOVE_PLAYER, id));
+            }
+        }
+    }
+    trace.push_back(makeCommand(CommandProtocol::QUIT));
+}
+
+static bool loadTrace(const char* path, std::vector<BinaryCommand>& trace)
+{
+    FILE* in = fopen(path, "rb");
+    if (in == nullptr)
+    {
+        return false;
+    }
+
+    if (CommandProtocol::readHeader(in, CommandProtocol::commandsMagic))
+    {
+        BinaryCommand command;
+        while (fread(&command, sizeof(command), 1, in) == 1)
+        {
+            trace.push_back(command);
+        }
+    }
+    else
+    {
+        rewind(in);
+        char line[256];
+        while (fgets(line, sizeof(line), in) != nullptr)
+        {
+            BinaryCommand command;
+            CommandProtocol::ParseResult parsed = CommandProtocol::parseTextLine(line, &command);
+            if (parsed == CommandProtocol::MALFORMED) break;
+            if (parsed == CommandProtocol::PARSED) trace.push_back(command);
+        }
+    }
+    fclose(in);
+    return true;
+}
+
+//Prints text as a JSON string, quotes and all.
+static void printJsonString(const char* text)
+{
+    putchar('"');
+    for (; *text != '\0'; ++text)
+    {
+        unsigned char c = (unsigned char)*text;
+        if (c == '"' || c == '\\')
+        {
+            printf("\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            printf("\\u%04x", c);
+        }
+        else
+        {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static void printOperation(const char* name, const LatencyHistogram& histogram, long failures, bool last)
+{
+    printf("    \"%s\": {\"count\": %llu, \"failures\": %ld, \"mean_ns\": %.1f, \"p50_ns\": %llu, "
+           "\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}%s\n",
+           name, (unsigned long long)histogram.getCount(), failures, histogram.getMean(),
+           (unsigned long long)histogram.getPercentile(50), (unsigned long long)histogram.getPercentile(99),
+           (unsigned long long)histogram.getPercentile(99.9), (unsigned long long)histogram.getMax(),
+           last ? "" : ",");
+}
+
+int main(int argc, const char** argv)
+{
+    SynthesisConfig config;
+    const char* tracePath = nullptr;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *flag = argv[i], *value = argv[i + 1];
+        if (strcmp(flag, "--trace") == 0) tracePath = value;
+        else if (strcmp(flag, "--ops") == 0) config.ops = atol(value);
+        else if (strcmp(flag, "--k") == 0) config.k = atoi(value);
+        else if (strcmp(flag, "--scale") == 0) config.scale = atoi(value);
+        else if (strcmp(flag, "--players") == 0) config.players = atoi(value);
+        else if (strcmp(flag, "--max-level-increase") == 0) config.maxLevelIncrease = atoi(value);
+        else if (strcmp(flag, "--merge-ratio") == 0) config.mergeRatio = atof(value);
+        else if (strcmp(flag, "--query-ratio") == 0) config.queryRatio = atof(value);
+        else if (strcmp(flag, "--seed") == 0) config.seed = (unsigned)atol(value);
+        else
+        {
+            fprintf(stderr, "bench: unknown flag %s\n", flag);
+            return 1;
+        }
+    }
+    if (config.k <= 0 || config.scale <= 0 || config.players <= 0 || config.maxLevelIncrease <= 0)
+    {
+        fprintf(stderr, "bench: k, scale, players and max-level-increase must be positive.\n");
+        return 1;
+    }
+
+    std::vector<BinaryCommand> trace;
+    if (tracePath != nullptr)
+    {
+        if (!loadTrace(tracePath, trace))
+        {
+            fprintf(stderr, "bench: could not read %s\n", tracePath);
+            return 1;
+        }
+    }
+    else
+    {
+        synthesize(config, trace);
+    }
+
+    static LatencyHistogram histograms[CommandProtocol::COMMAND_COUNT];
+    long failures[CommandProtocol::COMMAND_COUNT] = { 0 };
+    void* DS = nullptr;
+    BinaryResult result;
+    Stats stats;
+    bool haveStats = false;
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    long executed = 0;
+    for (size_t i = 0; i < trace.size(); ++i)
+    {
+        int code = trace[i].code;
+        if (code < 0 || code >= CommandProtocol::COMMAND_COUNT)
+        {
+            break;
+        }
+        if (code == CommandProtocol::QUIT && DS != nullptr)
+        {
+            haveStats = GetStats(DS, &stats) == SUCCESS; //Last chance, Quit frees them.
+        }
+        Clock::time_point before = Clock::now();
+        int done = CommandProtocol::executeBatch(&DS, &trace[i], 1, &result);
+        Clock::time_point after = Clock::now();
+
+        histograms[code].record(
+            (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count());
+        if (result.status != SUCCESS)
+        {
+            ++failures[code];
+        }
+        ++executed;
+        if (done < 1 || (code == CommandProtocol::INIT && result.status == ALLOCATION_ERROR))
+        {
+            break;
+        }
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    if (DS != nullptr)
+    {
+        haveStats = GetStats(DS, &stats) == SUCCESS;
+        Quit(&DS);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\n");
+    if (tracePath != nullptr)
+    {
+        printf("  \"trace\": ");
+        printJsonString(tracePath);
+        printf(",\n");
+    }
+    else
+    {
+        printf("  \"synthetic\": {\"ops\": %ld, \"k\": %d, \"scale\": %d, \"players\": %d, "
+               "\"max_level_increase\": %d, \"merge_ratio\": %g, \"query_ratio\": %g, \"seed\": %u},\n",
+               config.ops, config.k, config.scale, config.players, config.maxLevelIncrease,
+               config.mergeRatio, config.queryRatio, config.seed);
+    }
+    printf("  \"ops\": %ld,\n", executed);
+    printf("  \"seconds\": %.6f,\n", seconds);
+    printf("  \"throughput_ops_per_sec\": %.1f,\n", seconds > 0 ? executed / seconds : 0.0);
+    printf("  \"peak_rss_kb\": %ld,\n", (long)usage.ru_maxrss);
+    if (haveStats)
+    {
+        printf("  \"internals\": {\"rotations\": %llu, \"rehashes\": %llu, \"rehash_cycles\": %llu, "
+               "\"merges\": %llu, \"merged_players\": %llu, \"largest_merge\": %llu, \"merge_cycles\": %llu},\n",
+               stats.rotations, stats.rehashes, stats.rehashCycles, stats.merges, stats.mergedPlayers,
+               stats.largestMerge, stats.mergeCycles);
+    }
+    printf("  \"operations\": {\n");
+    int last = CommandProtocol::COMMAND_COUNT - 1;
+    while (last > 0 && histograms[last].getCount() == 0) --last;
+    for (int code = 0; code <= last; ++code)
+    {
+        if (histograms[code].getCount() > 0 || code == last)
+        {
+            printOperation(CommandProtocol::commandName(code), histograms[code], failures[code], code == last);
+        }
+    }
+    printf("  }\n");
+    printf("}\n");
+    return 0;
+}
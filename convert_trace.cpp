@@ -0,0 +1,80 @@
+/*
+ * Converts a text command trace (the format main2.cpp reads) into the binary format of
+ * CommandProtocol.hpp.
+ *
+ * Usage: convert_trace [input.txt [output.bin]]  (defaults to stdin/stdout)
+ * Exits with 1 if a malformed line cut the trace short (main2.cpp would stop there as well).
+ */
+
+#include "CommandProtocol.hpp"
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+
+#define MAX_LINE_SIZE (255)
+
+static bool isBlank(const char* line)
+{
+    for (; *line != '\0'; ++line)
+    {
+        if (!isspace((unsigned char)*line)) return false;
+    }
+    return true;
+}
+
+int main(int argc, const char** argv)
+{
+    FILE* in = argc > 1 ? fopen(argv[1], "r") : stdin;
+    FILE* out = argc > 2 ? fopen(argv[2], "wb") : stdout;
+    if (in == nullptr || out == nullptr)
+    {
+        fprintf(stderr, "convert_trace: could not open files.\n");
+        return 1;
+    }
+
+    CommandProtocol::writeHeader(out, CommandProtocol::commandsMagic);
+
+    char line[MAX_LINE_SIZE];
+    long lineNumber = 0, written = 0;
+    bool malformed = false;
+    while (fgets(line, MAX_LINE_SIZE, in) != nullptr)
+    {
+        ++lineNumber;
+        CommandProtocol::BinaryCommand command;
+        CommandProtocol::ParseResult parsed = CommandProtocol::parseTextLine(line, &command);
+        if (parsed == CommandProtocol::SKIPPED)
+        {
+            continue;
+        }
+        if (parsed == CommandProtocol::MALFORMED)
+        {
+            //The text driver stops reading here too. Only blank lines may follow (the end of the trace);
+            //anything else is lost, and the trace is only good up to this line.
+            char rest[MAX_LINE_SIZE];
+            long dropped = 0;
+            while (fgets(rest, MAX_LINE_SIZE, in) != nullptr)
+            {
+                dropped += !isBlank(rest);
+            }
+            if (!isBlank(line))
+            {
+                fprintf(stderr, "convert_trace: line %ld is malformed: %s%s", lineNumber, line,
+                        line[strlen(line) - 1] == '\n' ? "" : "\n");
+            }
+            if (!isBlank(line) || dropped > 0)
+            {
+                fprintf(stderr, "convert_trace: stopped at line %ld, %ld later lines dropped.\n", lineNumber, dropped);
+                malformed = true;
+            }
+            break;
+        }
+        fwrite(&command, sizeof(command), 1, out);
+        ++written;
+    }
+
+    fprintf(stderr, "convert_trace: %ld commands written.\n", written);
+    if (in != stdin) fclose(in);
+    if (out != stdout) fclose(out);
+    return malformed ? 1 : 0;
+}
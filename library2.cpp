@@ -1,82 +1,164 @@
 #include "library2.h"
 #include "GameSystem.hpp"
 
-#define TRY_CATCH_WRAP(action) \
-if (DS == NULL)                \
-{                              \
-    return INVALID_INPUT;      \
-}                              \
+#define TRY_CATCH_STATUS(status, action) \
 try {                          \
     action                     \
 }                              \
 catch(Failure& exc)            \
 {                              \
-    return FAILURE;            \
+    status = FAILURE;          \
 }                              \
 catch(std::bad_alloc& exc)     \
 {                              \
-    return ALLOCATION_ERROR;   \
+    status = ALLOCATION_ERROR; \
+}                              \
+catch(AllocationError& exc)    \
+{                              \
+    status = ALLOCATION_ERROR; \
 }                              \
 catch(InvalidInput& exc)       \
+{                              \
+    status = INVALID_INPUT;    \
+}
+
+#define TRY_CATCH_WRAP(api, action) \
+if (DS == NULL)                \
+{                              \
+    return INVALID_INPUT;      \
+}                              \
+STATS_API_BEGIN(((GameSystem*)DS)->getStats(), api); \
+StatusType status = SUCCESS;   \
+TRY_CATCH_STATUS(status, action) \
+STATS_API_END(status);         \
+return status
+
+//For the introspection calls, which shouldn't show up in the stats themselves.
+#define TRY_CATCH_WRAP_UNCOUNTED(action) \
+if (DS == NULL)                \
 {                              \
     return INVALID_INPUT;      \
 }                              \
-return SUCCESS
+StatusType status = SUCCESS;   \
+TRY_CATCH_STATUS(status, action) \
+return status
 
 
 void *Init(int k, int scale)
 {
     try
     {
+#ifdef GAME_SYSTEM_STATS
+        unsigned long long start = Instrumentation::now();
+#endif
         GameSystem* DS = new GameSystem(k, scale);
+#ifdef GAME_SYSTEM_STATS
+        Stats& stats = DS->getStats();
+        stats.calls[STATS_INIT] = stats.statuses[STATS_INIT][-SUCCESS] = 1;
+        stats.cycles[STATS_INIT] = Instrumentation::now() - start;
+#endif
         return (void*)DS;
     }
     catch (std::bad_alloc& exc)
     {
         return NULL;
     }
+    catch (AllocationError& exc)
+    {
+        return NULL;
+    }
 }
 
 StatusType MergeGroups(void *DS, int GroupID1, int GroupID2)
 {
-    TRY_CATCH_WRAP(
+    TRY_CATCH_WRAP(STATS_MERGE_GROUPS,
     ((GameSystem*)DS)->mergeGroups(GroupID1, GroupID2);
     );
 }
 
+StatusType MergeGroupsBatch(void *DS, const int *pairs, int n)
+{
+    TRY_CATCH_WRAP(STATS_MERGE_GROUPS_BATCH,
+    ((GameSystem*)DS)->mergeGroupsBatch(pairs, n);
+    );
+}
+
+StatusType GetMergeCheckpoint(void *DS, int *checkpoint)
+{
+    if (checkpoint == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP_UNCOUNTED(
+    *checkpoint = ((GameSystem*)DS)->getMergeCheckpoint();
+    );
+}
+
+StatusType RollbackMerges(void *DS, int checkpoint)
+{
+    TRY_CATCH_WRAP(STATS_ROLLBACK_MERGES,
+    ((GameSystem*)DS)->rollbackMerges(checkpoint);
+    );
+}
+
 StatusType AddPlayer(void *DS, int PlayerID, int GroupID, int score)
 {
-    TRY_CATCH_WRAP(
+    TRY_CATCH_WRAP(STATS_ADD_PLAYER,
     ((GameSystem*)DS)->addPlayer(PlayerID, GroupID, score);
     );
 }
 
 StatusType RemovePlayer(void *DS, int PlayerID)
 {
-    TRY_CATCH_WRAP(
+    TRY_CATCH_WRAP(STATS_REMOVE_PLAYER,
     ((GameSystem*)DS)->removePlayer(PlayerID);
     );
 }
 
+StatusType RemoveAllPlayersInGroup(void *DS, int GroupID)
+{
+    TRY_CATCH_WRAP(STATS_REMOVE_ALL_PLAYERS_IN_GROUP,
+    ((GameSystem*)DS)->removeAllPlayersInGroup(GroupID);
+    );
+}
+
 StatusType IncreasePlayerIDLevel(void *DS, int PlayerID, int LevelIncrease)
 {
-    TRY_CATCH_WRAP(
+    TRY_CATCH_WRAP(STATS_INCREASE_PLAYER_ID_LEVEL,
     ((GameSystem*)DS)->increasePlayerIDLevel(PlayerID, LevelIncrease);
     );
 }
 
 StatusType ChangePlayerIDScore(void *DS, int PlayerID, int NewScore)
 {
-    TRY_CATCH_WRAP(
+    TRY_CATCH_WRAP(STATS_CHANGE_PLAYER_ID_SCORE,
     ((GameSystem*)DS)->changePlayerIDScore(PlayerID, NewScore);
     );
 }
 
+StatusType BeginTxn(void *DS)
+{
+    TRY_CATCH_WRAP(STATS_BEGIN_TXN,
+    ((GameSystem*)DS)->beginTransaction();
+    );
+}
+
+StatusType CommitTxn(void *DS)
+{
+    TRY_CATCH_WRAP(STATS_COMMIT_TXN,
+    ((GameSystem*)DS)->commitTransaction();
+    );
+}
+
+StatusType AbortTxn(void *DS)
+{
+    TRY_CATCH_WRAP(STATS_ABORT_TXN,
+    ((GameSystem*)DS)->abortTransaction();
+    );
+}
+
 StatusType GetPercentOfPlayersWithScoreInBounds(void *DS, int GroupID, int score, int lowerLevel, int higherLevel,
                                             double * players)
 {
     if (players == nullptr) return INVALID_INPUT;
-    TRY_CATCH_WRAP(
+    TRY_CATCH_WRAP(STATS_GET_PERCENT_OF_PLAYERS_WITH_SCORE_IN_BOUNDS,
     *players = ((GameSystem*)DS)->getPercentOfPlayersWithScoreInBounds(
             GroupID, score, lowerLevel, higherLevel
         );
@@ -86,7 +168,7 @@ StatusType GetPercentOfPlayersWithScoreInBounds(void *DS, int GroupID, int score
 StatusType AverageHighestPlayerLevelByGroup(void *DS, int GroupID, int m, double * level)
 {
     if (level == nullptr) return INVALID_INPUT;
-    TRY_CATCH_WRAP(
+    TRY_CATCH_WRAP(STATS_AVERAGE_HIGHEST_PLAYER_LEVEL_BY_GROUP,
     *level = ((GameSystem*)DS)->averageHighestPlayerLevelByGroup(GroupID, m);
     );
 }
@@ -94,9 +176,193 @@ StatusType AverageHighestPlayerLevelByGroup(void *DS, int GroupID, int m, double
 StatusType GetPlayersBound(void *DS, int GroupID, int score, int m,
                                          int * LowerBoundPlayers, int * HigherBoundPlayers)
 {
+#ifdef GAME_SYSTEM_STATS
+    if (DS != NULL)
+    {
+        STATS_API_BEGIN(((GameSystem*)DS)->getStats(), STATS_GET_PLAYERS_BOUND);
+        STATS_API_END(FAILURE);
+    }
+#endif
     return FAILURE; //Not implemented.
 }
 
+StatusType GetTopMPlayers(void *DS, int GroupID, int m, int * ids, int * levels)
+{
+    if (ids == nullptr || levels == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP(STATS_GET_TOP_M_PLAYERS,
+    ((GameSystem*)DS)->getTopMPlayers(GroupID, m, ids, levels);
+    );
+}
+
+StatusType GetPlayerRank(void *DS, int PlayerID, int * groupRank, int * globalRank)
+{
+    if (groupRank == nullptr || globalRank == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP(STATS_GET_PLAYER_RANK,
+    ((GameSystem*)DS)->getPlayerRank(PlayerID, false, groupRank, globalRank);
+    );
+}
+
+StatusType GetPlayerRankInScore(void *DS, int PlayerID, int * groupRank, int * globalRank)
+{
+    if (groupRank == nullptr || globalRank == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP(STATS_GET_PLAYER_RANK,
+    ((GameSystem*)DS)->getPlayerRank(PlayerID, true, groupRank, globalRank);
+    );
+}
+
+StatusType GetPercentOfPlayersWithScoreBandInBounds(void *DS, int GroupID, int lowerScore, int higherScore,
+                                                    int lowerLevel, int higherLevel, double * players)
+{
+    if (players == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP(STATS_GET_PERCENT_OF_PLAYERS_WITH_SCORE_BAND_IN_BOUNDS,
+    *players = ((GameSystem*)DS)->getPercentOfPlayersWithScoreBandInBounds(
+            GroupID, lowerScore, higherScore, lowerLevel, higherLevel
+        );
+    );
+}
+
+StatusType CountPlayersWithScoreBandInBounds(void *DS, int GroupID, int lowerScore, int higherScore,
+                                             int lowerLevel, int higherLevel, int * players)
+{
+    if (players == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP(STATS_COUNT_PLAYERS_WITH_SCORE_BAND_IN_BOUNDS,
+    *players = ((GameSystem*)DS)->countPlayersWithScoreBandInBounds(
+            GroupID, lowerScore, higherScore, lowerLevel, higherLevel
+        );
+    );
+}
+
+StatusType AverageHighestPlayerLevelInScoreBand(void *DS, int GroupID, int lowerScore, int higherScore, int m,
+                                                double * level)
+{
+    if (level == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP(STATS_AVERAGE_HIGHEST_PLAYER_LEVEL_IN_SCORE_BAND,
+    *level = ((GameSystem*)DS)->averageHighestPlayerLevelInScoreBand(GroupID, lowerScore, higherScore, m);
+    );
+}
+
+StatusType GetLevelStats(void *DS, int GroupID, int lowerScore, int higherScore, int lowerLevel, int higherLevel,
+                         int * players, double * mean, double * variance)
+{
+    if (players == nullptr || mean == nullptr || variance == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP(STATS_GET_LEVEL_STATS,
+    ((GameSystem*)DS)->getLevelStats(GroupID, lowerScore, higherScore, lowerLevel, higherLevel,
+                                     players, mean, variance);
+    );
+}
+
+StatusType GetLevelHistogram(void *DS, int GroupID, int lowerScore, int higherScore, int lowerLevel, int higherLevel,
+                             int buckets, int * counts)
+{
+    if (counts == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP(STATS_GET_LEVEL_HISTOGRAM,
+    ((GameSystem*)DS)->getLevelHistogram(GroupID, lowerScore, higherScore, lowerLevel, higherLevel,
+                                         buckets, counts);
+    );
+}
+
+StatusType GetApproxPlayersInBounds(void *DS, int GroupID, int lowerLevel, int higherLevel, double * players)
+{
+    if (players == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP(STATS_APPROXIMATE_QUERY,
+    *players = ((GameSystem*)DS)->approxPlayersInBounds(GroupID, lowerLevel, higherLevel);
+    );
+}
+
+StatusType GetApproxLevelPercentile(void *DS, int GroupID, double percentile, int * level)
+{
+    if (level == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP(STATS_APPROXIMATE_QUERY,
+    *level = ((GameSystem*)DS)->approxLevelPercentile(GroupID, percentile);
+    );
+}
+
+StatusType GetApproxAverageHighestPlayerLevel(void *DS, int GroupID, int m, double * level)
+{
+    if (level == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP(STATS_APPROXIMATE_QUERY,
+    *level = ((GameSystem*)DS)->approxAverageHighestPlayerLevel(GroupID, m);
+    );
+}
+
+StatusType RunQueryBatch(void *DS, const Query *queries, int n, QueryResult *results)
+{
+    TRY_CATCH_WRAP(STATS_RUN_QUERY_BATCH,
+    ((GameSystem*)DS)->runQueryBatch(queries, n, results);
+    );
+}
+
+StatusType TakeSnapshot(void *DS, int GroupID, void **snapshot)
+{
+    if (snapshot == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP_UNCOUNTED(
+    *snapshot = (void*)((GameSystem*)DS)->takeSnapshot(GroupID).release();
+    );
+}
+
+StatusType GetPercentOfPlayersWithScoreInBoundsInSnapshot(void *snapshot, int score, int lowerLevel, int higherLevel,
+                                                          double * players)
+{
+    if (snapshot == NULL || players == nullptr) return INVALID_INPUT;
+    StatusType status = SUCCESS;
+    TRY_CATCH_STATUS(status,
+    *players = GameSystem::getPercentOfPlayersWithScoreInBounds(*(GroupSnapshot*)snapshot, score,
+                                                                 lowerLevel, higherLevel);
+    )
+    return status;
+}
+
+StatusType AverageHighestPlayerLevelInSnapshot(void *snapshot, int m, double * level)
+{
+    if (snapshot == NULL || level == nullptr) return INVALID_INPUT;
+    StatusType status = SUCCESS;
+    TRY_CATCH_STATUS(status,
+    *level = GameSystem::averageHighestPlayerLevel(*(GroupSnapshot*)snapshot, m);
+    )
+    return status;
+}
+
+void ReleaseSnapshot(void **snapshot)
+{
+    delete ((GroupSnapshot*)*snapshot);
+    *snapshot = nullptr;
+}
+
+StatusType GetMemoryUsage(void *DS, MemoryReport *report)
+{
+    if (report == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP_UNCOUNTED(
+    ((GameSystem*)DS)->getMemoryUsage(report);
+    );
+}
+
+StatusType GetTreeMemoryUsage(void *DS, int GroupID, int score, unsigned long long *bytes)
+{
+    if (bytes == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP_UNCOUNTED(
+    *bytes = ((GameSystem*)DS)->getTreeMemoryUsage(GroupID, score);
+    );
+}
+
+StatusType GetQueryCacheStats(void *DS, unsigned long long *hits, unsigned long long *misses, double *hitRate)
+{
+    if (hits == nullptr || misses == nullptr || hitRate == nullptr) return INVALID_INPUT;
+    TRY_CATCH_WRAP_UNCOUNTED(
+    ((GameSystem*)DS)->getQueryCacheStats(hits, misses, hitRate);
+    );
+}
+
+StatusType GetStats(void *DS, Stats *stats)
+{
+    if (DS == NULL || stats == NULL) return INVALID_INPUT;
+#ifdef GAME_SYSTEM_STATS
+    *stats = ((GameSystem*)DS)->getStats();
+    return SUCCESS;
+#else
+    return FAILURE; //Built without instrumentation.
+#endif
+}
+
 void Quit(void** DS)
 {
     delete ((GameSystem*)*DS);
@@ -27,19 +27,102 @@ typedef enum {
     INVALID_INPUT = -3
 } StatusType;
 
+/* Instrumentation (only collected when built with GAME_SYSTEM_STATS)
+ * ----------------------------------- */
+typedef enum {
+    STATS_INIT = 0,
+    STATS_MERGE_GROUPS = 1,
+    STATS_ADD_PLAYER = 2,
+    STATS_REMOVE_PLAYER = 3,
+    STATS_INCREASE_PLAYER_ID_LEVEL = 4,
+    STATS_CHANGE_PLAYER_ID_SCORE = 5,
+    STATS_GET_PERCENT_OF_PLAYERS_WITH_SCORE_IN_BOUNDS = 6,
+    STATS_AVERAGE_HIGHEST_PLAYER_LEVEL_BY_GROUP = 7,
+    STATS_GET_PLAYERS_BOUND = 8,
+    STATS_GET_PERCENT_OF_PLAYERS_WITH_SCORE_BAND_IN_BOUNDS = 9,
+    STATS_COUNT_PLAYERS_WITH_SCORE_BAND_IN_BOUNDS = 10,
+    STATS_AVERAGE_HIGHEST_PLAYER_LEVEL_IN_SCORE_BAND = 11,
+    STATS_GET_TOP_M_PLAYERS = 12,
+    STATS_GET_PLAYER_RANK = 13,
+    STATS_APPROXIMATE_QUERY = 14,
+    STATS_MERGE_GROUPS_BATCH = 15,
+    STATS_RUN_QUERY_BATCH = 16,
+    STATS_GET_LEVEL_STATS = 17,
+    STATS_GET_LEVEL_HISTOGRAM = 18,
+    STATS_REMOVE_ALL_PLAYERS_IN_GROUP = 19,
+    STATS_ROLLBACK_MERGES = 20,
+    STATS_BEGIN_TXN = 21,
+    STATS_COMMIT_TXN = 22,
+    STATS_ABORT_TXN = 23,
+    STATS_API_COUNT = 24
+} StatsApi;
+
+#define STATS_STATUS_COUNT (4)
+
+typedef struct {
+    unsigned long long calls[STATS_API_COUNT];
+    /* Outcomes per API, indexed by -StatusType (so [0] is SUCCESS, [1] FAILURE and so on). */
+    unsigned long long statuses[STATS_API_COUNT][STATS_STATUS_COUNT];
+    /* Cumulative time spent inside each API, in cycles (or nanoseconds where there is no TSC). */
+    unsigned long long cycles[STATS_API_COUNT];
+    unsigned long long rotations;
+    unsigned long long rehashes;
+    unsigned long long rehashCycles;
+    unsigned long long merges;
+    unsigned long long mergedPlayers; /* Sum over merges of the size of the group merged in. */
+    unsigned long long largestMerge; /* Largest group merged in. */
+    unsigned long long mergeCycles;
+} Stats;
+
 
 void *Init(int k, int scale);
 
 StatusType MergeGroups(void *DS, int GroupID1, int GroupID2);
 
+/* MergeGroups for n pairs at once: pairs holds GroupID1, GroupID2 of each, 2 * n ints. Every group of a
+ * resulting set is merged in one go, which is much cheaper than n MergeGroups calls that keep folding
+ * groups into a growing one. INVALID_INPUT (and no merge at all) if any ID is. Should a set fail to merge
+ * (ALLOCATION_ERROR), its groups stay as they were, while the sets merged before it stay merged. */
+StatusType MergeGroupsBatch(void *DS, const int *pairs, int n);
+
+/* Merge checkpoints: every union of two groups (by either call above) can be undone, the latest first.
+ * GetMergeCheckpoint gives the number of unions so far, and RollbackMerges undoes those after checkpoint:
+ * each merged group is split back into the groups it was made of, every player going back to the group
+ * of the GroupID it was added with. Players added or removed since stay so. FAILURE if checkpoint is
+ * ahead of the unions there are now (a later rollback already went past it). */
+StatusType GetMergeCheckpoint(void *DS, int *checkpoint);
+
+StatusType RollbackMerges(void *DS, int checkpoint);
+
 StatusType AddPlayer(void *DS, int PlayerID, int GroupID, int score);
 
 StatusType RemovePlayer(void *DS, int PlayerID);
 
+/* Removes every player of the group (with those of the groups merged into it) at once, in time linear in
+ * their number or in the system-wide levels, whichever is less, rather than a RemovePlayer each. The group
+ * is still there afterwards, empty. */
+StatusType RemoveAllPlayersInGroup(void *DS, int GroupID);
+
 StatusType IncreasePlayerIDLevel(void *DS, int PlayerID, int LevelIncrease);
 
 StatusType ChangePlayerIDScore(void *DS, int PlayerID, int NewScore);
 
+/* Transactions: the updates above (all but RollbackMerges, which is a FAILURE within one) made between
+ * BeginTxn and CommitTxn only have their input checked, INVALID_INPUT as usual, and are queued; queries
+ * meanwhile see the players as they were. CommitTxn applies them all, in order, or none: if one fails
+ * (FAILURE, ALLOCATION_ERROR), those applied are undone and CommitTxn returns its status. AbortTxn drops
+ * them. The transaction is over either way. Applying them together is cheaper than calling them one by
+ * one: a run of player updates is sorted by player and each player's are folded into a single change,
+ * and a run of merges is merged as one MergeGroupsBatch. FAILURE for BeginTxn with a transaction open,
+ * and for CommitTxn and AbortTxn without one.
+ * Undoing can't fail: the memory it needs is had as the updates are applied, and the trees that merges and
+ * emptied groups replace are kept until CommitTxn returns. */
+StatusType BeginTxn(void *DS);
+
+StatusType CommitTxn(void *DS);
+
+StatusType AbortTxn(void *DS);
+
 StatusType GetPercentOfPlayersWithScoreInBounds(void *DS, int GroupID, int score, int lowerLevel, int higherLevel,
                                             double * players);
 
@@ -48,6 +131,131 @@ StatusType AverageHighestPlayerLevelByGroup(void *DS, int GroupID, int m, double
 StatusType GetPlayersBound(void *DS, int GroupID, int score, int m,
                                          int * LowerBoundPlayers, int * HigherBoundPlayers);
 
+/* The m highest level players of the group (GroupID 0 for all of them), highest first: ids and levels
+ * must have room for m entries. FAILURE if there are fewer than m players. */
+StatusType GetTopMPlayers(void *DS, int GroupID, int m, int * ids, int * levels);
+
+/* 1 + the number of players with a higher level, in the player's group and system-wide (ties share a rank).
+ * The InScore version only counts the players that have the player's score. */
+StatusType GetPlayerRank(void *DS, int PlayerID, int * groupRank, int * globalRank);
+
+StatusType GetPlayerRankInScore(void *DS, int PlayerID, int * groupRank, int * globalRank);
+
+/* Score bands: the queries above, over every score in [lowerScore, higherScore] instead of a single one.
+ * ----------------------------------- */
+StatusType GetPercentOfPlayersWithScoreBandInBounds(void *DS, int GroupID, int lowerScore, int higherScore,
+                                                    int lowerLevel, int higherLevel, double * players);
+
+StatusType CountPlayersWithScoreBandInBounds(void *DS, int GroupID, int lowerScore, int higherScore,
+                                             int lowerLevel, int higherLevel, int * players);
+
+StatusType AverageHighestPlayerLevelInScoreBand(void *DS, int GroupID, int lowerScore, int higherScore, int m,
+                                                double * level);
+
+/* Level distribution of the players with a level in [lowerLevel, higherLevel] and a score in the band
+ * (lowerScore = higherScore = 0 for any score). GetLevelStats gives their count, mean level and (population)
+ * variance, in O(log n); FAILURE if there are none, or if they are so many and so far apart that the sum of
+ * their squared levels can't be told: their count times (highest - mean) times (mean - lowest) past 2^64,
+ * e.g. 10^5 players spread evenly over 10^8 levels. GetLevelHistogram splits the levels into buckets
+ * equal-width buckets (widths differing by at most one, lowest first) and counts each in counts, which must
+ * have room for buckets entries: O(buckets log n). An empty range (lowerLevel > higherLevel) gets zero counts. */
+StatusType GetLevelStats(void *DS, int GroupID, int lowerScore, int higherScore, int lowerLevel, int higherLevel,
+                         int * players, double * mean, double * variance);
+
+StatusType GetLevelHistogram(void *DS, int GroupID, int lowerScore, int higherScore, int lowerLevel, int higherLevel,
+                             int buckets, int * counts);
+
+/* Approximate queries, from a per-group sketch of the levels (built on a group's first approximate query).
+ * Levels are bucketed with a relative width of at most 2^-5 (about 3%), levels under 32 exactly:
+ * counts only miss players within that distance of a bound, percentiles are within half of it, and
+ * the average of the top m is within it.
+ * ----------------------------------- */
+StatusType GetApproxPlayersInBounds(void *DS, int GroupID, int lowerLevel, int higherLevel, double * players);
+
+/* The level under which percentile percent of the players are, percentile in (0, 100]. */
+StatusType GetApproxLevelPercentile(void *DS, int GroupID, double percentile, int * level);
+
+StatusType GetApproxAverageHighestPlayerLevel(void *DS, int GroupID, int m, double * level);
+
+/* Snapshots: a frozen view of a group (GroupID 0 for all the players), O(scale) to take. The queries on it
+ * answer as the group stood then, however it changed since; they don't need DS, and a snapshot may be
+ * kept after Quit. Updates copy the O(log n) tree nodes they touch while snapshots share them, so release
+ * each snapshot once done with it.
+ * ----------------------------------- */
+StatusType TakeSnapshot(void *DS, int GroupID, void **snapshot);
+
+StatusType GetPercentOfPlayersWithScoreInBoundsInSnapshot(void *snapshot, int score, int lowerLevel, int higherLevel,
+                                                          double * players);
+
+StatusType AverageHighestPlayerLevelInSnapshot(void *snapshot, int m, double * level);
+
+void ReleaseSnapshot(void **snapshot);
+
+/* Query batches: many read queries answered in one call, spread over worker threads when there are
+ * enough of them. Each query gets the status and result its own API call would have returned (the query
+ * result caches are neither used nor filled).
+ * ----------------------------------- */
+typedef enum {
+    QUERY_PERCENT_OF_PLAYERS_WITH_SCORE_IN_BOUNDS = 0, /* GroupID, score, lowerLevel, higherLevel -> value */
+    QUERY_AVERAGE_HIGHEST_PLAYER_LEVEL = 1,            /* GroupID, m -> value */
+    QUERY_COUNT_PLAYERS_IN_BOUNDS = 2,                 /* GroupID, score (0 for any), lowerLevel, higherLevel -> counts[0] */
+    QUERY_PLAYER_RANK = 3                              /* PlayerID, inScore (0 or 1) -> counts[0] group, counts[1] global */
+} QueryKind;
+
+typedef struct {
+    QueryKind kind;
+    int args[4];
+} Query;
+
+typedef struct {
+    StatusType status;
+    double value;
+    int counts[2];
+} QueryResult;
+
+/* results[i] answers queries[i]. INVALID_INPUT for the call itself only if the arrays are missing. */
+StatusType RunQueryBatch(void *DS, const Query *queries, int n, QueryResult *results);
+
+/* Memory accounting, in bytes unless stated otherwise
+ * ----------------------------------- */
+typedef struct {
+    unsigned long long hashTableBuckets;  /* The bucket array, and the heads of the per-group player lists. */
+    unsigned long long hashTableNodes;
+    unsigned long long unionFindArrays;   /* Group objects plus the parents and sizes arrays. */
+    unsigned long long treeArrays;        /* Every group's array of SumTree pointers. */
+    unsigned long long trees;             /* The SumTree objects themselves. */
+    unsigned long long groupAllPlayersTreeNodes; /* SumTreeNodes of the groups' all-players trees. */
+    unsigned long long groupScoreTreeNodes;      /* SumTreeNodes of the groups' per-score trees. */
+    unsigned long long globalTreeNodes;   /* SumTreeNodes of the system-wide trees. */
+    unsigned long long smallTreeLevels;   /* Level entries of the trees small enough to keep them in an array. */
+    unsigned long long denseLevelCounts;  /* Per-level counts of the low levels, in the trees past the array. */
+    unsigned long long liveTrees;         /* Count. */
+    unsigned long long emptyTrees;        /* Count of live trees holding no player. */
+    unsigned long long emptyBuckets;      /* Count. */
+    unsigned long long levelMembership;   /* Per-level player lists, once GetTopMPlayers was called. */
+    unsigned long long sketches;          /* Level sketches of the groups that had approximate queries. */
+    unsigned long long queryCaches;       /* Query result caches of the groups that had queries. */
+    /* Bytes allocated without holding data: empty trees, empty buckets, unused tree node slots
+     * and the estimated per-allocation overhead of the heap. */
+    unsigned long long fragmentation;
+    unsigned long long total;             /* Everything above that is in bytes, fragmentation included. */
+} MemoryReport;
+
+StatusType GetMemoryUsage(void *DS, MemoryReport *report);
+
+/* Bytes of the levels (tree nodes, array entries or dense counts) in one tree of a group: score 0 is the all-players
+ * tree, and GroupID 0 means the system-wide trees. */
+StatusType GetTreeMemoryUsage(void *DS, int GroupID, int score, unsigned long long *bytes);
+
+/* How often GetPercentOfPlayersWithScoreInBounds and AverageHighestPlayerLevelByGroup were answered from
+ * their group's cache of recent results (kept until the group changes), and how often they weren't. */
+StatusType GetQueryCacheStats(void *DS, unsigned long long *hits, unsigned long long *misses, double *hitRate);
+
+/* Copies the counters gathered so far. FAILURE if the library was built without GAME_SYSTEM_STATS. Work that
+ * big merges and query batches hand to the thread pool is timed with its call, but not counted in rotations,
+ * rehashes and the like. */
+StatusType GetStats(void *DS, Stats *stats);
+
 void Quit(void** DS);
 
 #ifdef __cplusplus
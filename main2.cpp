@@ -18,7 +18,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include "library2.h"
+#include "OutputWriter.hpp"
 #include <iostream>
+#include <unistd.h>
 using namespace std;
 
 #ifdef __cplusplus
@@ -81,10 +83,13 @@ typedef enum {
 static errorType parser(const char* const command);
 
 #define ValidateRead(read_parameters,required_parameters,ErrorString) \
-if ( (read_parameters)!=(required_parameters) ) { printf(ErrorString); return error; }
+if ( (read_parameters)!=(required_parameters) ) { output.write(ErrorString).endLine(); return error; }
 
 static bool isInit = false;
 
+/* All results go through here. Only flushed at a threshold or at exit, unless interactive. */
+static OutputWriter output;
+
 /***************************************************************************/
 /* main                                                                    */
 /***************************************************************************/
@@ -92,12 +97,25 @@ static bool isInit = false;
 int main(int argc, const char**argv) {
     char buffer[MAX_STRING_INPUT_SIZE];
 
+    // Line-buffered when someone is typing at us (or when asked to), batched otherwise
+    bool interactive = isatty(fileno(stdin));
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--interactive") == 0)
+            interactive = true;
+        else if (strcmp(argv[i], "--batch") == 0)
+            interactive = false;
+    }
+    output.setLineBuffered(interactive);
+
     // Reading commands
     while (fgets(buffer, MAX_STRING_INPUT_SIZE, stdin) != NULL) {
-        fflush(stdout);
-        if (parser(buffer) == error)
+        errorType rtn_val = parser(buffer);
+        if (output.isLineBuffered())
+            output.flush();
+        if (rtn_val == error)
             break;
     };
+    output.flush();
     return 0;
 }
 
@@ -111,7 +129,7 @@ static commandType CheckCommand(const char* const command,
         return (NONE_CMD);
     if (StrCmp("#", command)) {
         if (strlen(command) > 1)
-            printf("%s", command);
+            output.write(command);
         return (COMMENT_CMD);
     };
     for (int index = 0; index < numActions; index++) {
@@ -176,7 +194,7 @@ static errorType parser(const char* const command) {
             rtn_val = OnAverageHighestPlayerLevelByGroup(DS, command_args);
             break;
         case (GETPLAYERSBOUND_CMD):
-            rtn_val = OnGetPlayersBound(&DS, command_args);
+            rtn_val = OnGetPlayersBound(DS, command_args);
             break;
         case (QUIT_CMD):
             rtn_val = OnQuit(&DS, command_args);
@@ -199,19 +217,19 @@ static errorType parser(const char* const command) {
 /***************************************************************************/
 static errorType OnInit(void** DS, const char* const command) {
     if (isInit) {
-        printf("Init was already called.\n");
+        output.write("Init was already called.").endLine();
         return (error_free);
     };
     isInit = true;
     int k;
     int scale;
-    ValidateRead(sscanf(command, "%d %d", &k, &scale), 2, "Init failed.\n");
+    ValidateRead(sscanf(command, "%d %d", &k, &scale), 2, "Init failed.");
     *DS = Init(k, scale);
     if (*DS == NULL) {
-        printf("Init failed.\n");
+        output.write("Init failed.").endLine();
         return error;
     };
-    printf("Init done.\n");
+    output.write("Init done.").endLine();
 
     return error_free;
 }
@@ -222,14 +240,14 @@ static errorType OnInit(void** DS, const char* const command) {
 static errorType OnMergeGroups(void* DS, const char* const command) {
     int groupID1;
     int groupID2;
-    ValidateRead(sscanf(command, "%d %d", &groupID1, &groupID2), 2, "MergeGroups failed.\n");
+    ValidateRead(sscanf(command, "%d %d", &groupID1, &groupID2), 2, "MergeGroups failed.");
     StatusType res = MergeGroups(DS, groupID1, groupID2);
 
     if (res != SUCCESS) {
-        printf("MergeGroups: %s\n", ReturnValToStr(res));
+        output.write("MergeGroups: ").write(ReturnValToStr(res)).endLine();
         return error_free;
     } else {
-        printf("MergeGroups: %s\n", ReturnValToStr(res));
+        output.write("MergeGroups: ").write(ReturnValToStr(res)).endLine();
     }
 
     return error_free;
@@ -244,15 +262,15 @@ static errorType OnAddPlayer(void* DS, const char* const command) {
     int score;
     ValidateRead(
             sscanf(command, "%d %d %d", &playerID, &groupID, &score),
-            3, "AddPlayer failed.\n");
+            3, "AddPlayer failed.");
     StatusType res = AddPlayer(DS, playerID, groupID, score);
 
     if (res != SUCCESS) {
-        printf("AddPlayer: %s\n", ReturnValToStr(res));
+        output.write("AddPlayer: ").write(ReturnValToStr(res)).endLine();
         return error_free;
     }
 
-    printf("AddPlayer: %s\n", ReturnValToStr(res));
+    output.write("AddPlayer: ").write(ReturnValToStr(res)).endLine();
     return error_free;
 }
 
@@ -262,14 +280,14 @@ static errorType OnAddPlayer(void* DS, const char* const command) {
 static errorType OnRemovePlayer(void* DS, const char* const command) {
     int playerID;
     ValidateRead(sscanf(command, "%d", &playerID), 1,
-                 "RemovePlayer failed.\n");
+                 "RemovePlayer failed.");
     StatusType res = RemovePlayer(DS, playerID);
     if (res != SUCCESS) {
-        printf("RemovePlayer: %s\n", ReturnValToStr(res));
+        output.write("RemovePlayer: ").write(ReturnValToStr(res)).endLine();
         return error_free;
     }
 
-    printf("RemovePlayer: %s\n", ReturnValToStr(res));
+    output.write("RemovePlayer: ").write(ReturnValToStr(res)).endLine();
     return error_free;
 }
 
@@ -280,15 +298,15 @@ static errorType OnIncreasePlayerIDLevel(void* DS, const char* const command) {
     int playerID;
     int levelIncrease;
     ValidateRead(sscanf(command, "%d %d", &playerID, &levelIncrease), 2,
-                 "IncreasePlayerIDLevel failed.\n");
+                 "IncreasePlayerIDLevel failed.");
     StatusType res = IncreasePlayerIDLevel(DS, playerID, levelIncrease);
 
     if (res != SUCCESS) {
-        printf("IncreasePlayerIDLevel: %s\n", ReturnValToStr(res));
+        output.write("IncreasePlayerIDLevel: ").write(ReturnValToStr(res)).endLine();
         return error_free;
     }
 
-    printf("IncreasePlayerIDLevel: %s\n", ReturnValToStr(res));
+    output.write("IncreasePlayerIDLevel: ").write(ReturnValToStr(res)).endLine();
     return error_free;
 }
 
@@ -299,15 +317,15 @@ static errorType OnIncreasePlayerIDLevel(void* DS, const char* const command) {
 static errorType OnChangePlayerIDScore(void* DS, const char* const command) {
     int playerID;
     int newScore;
-    ValidateRead(sscanf(command, "%d %d", &playerID, &newScore), 2, "ChangePlayerIDScore failed.\n");
+    ValidateRead(sscanf(command, "%d %d", &playerID, &newScore), 2, "ChangePlayerIDScore failed.");
     StatusType res = ChangePlayerIDScore(DS, playerID, newScore);
 
     if (res != SUCCESS) {
-        printf("ChangePlayerIDScore: %s\n", ReturnValToStr(res));
+        output.write("ChangePlayerIDScore: ").write(ReturnValToStr(res)).endLine();
         return error_free;
     }
 
-    printf("ChangePlayerIDScore: %s\n", ReturnValToStr(res));
+    output.write("ChangePlayerIDScore: ").write(ReturnValToStr(res)).endLine();
     return error_free;
 }
 
@@ -321,16 +339,16 @@ static errorType OnGetPercentOfPlayersWithScoreInBounds(void* DS, const char* co
     int lowerLevel;
     int higherLevel;
     ValidateRead(sscanf(command, "%d %d %d %d", &groupID, &score, &lowerLevel, &higherLevel), 4,
-                 "GetPercentOfPlayersWithScoreInBounds failed.\n");
+                 "GetPercentOfPlayersWithScoreInBounds failed.");
     double players;
     StatusType res = GetPercentOfPlayersWithScoreInBounds(DS, groupID, score, lowerLevel, higherLevel, &players);
 
     if (res != SUCCESS) {
-        printf("GetPercentOfPlayersWithScoreInBounds: %s\n", ReturnValToStr(res));
+        output.write("GetPercentOfPlayersWithScoreInBounds: ").write(ReturnValToStr(res)).endLine();
         return error_free;
     }
 
-    printf("GetPercentOfPlayersWithScoreInBounds: %.2f\n", players);
+    output.write("GetPercentOfPlayersWithScoreInBounds: ").writeFixed(players, 2).endLine();
     return error_free;
 }
 
@@ -342,16 +360,16 @@ static errorType OnAverageHighestPlayerLevelByGroup(void* DS, const char* const
     int groupID;
     int m;
     ValidateRead(sscanf(command, "%d %d", &groupID, &m), 2,
-                 "AverageHighestPlayerLevelByGroup failed.\n");
+                 "AverageHighestPlayerLevelByGroup failed.");
     double level;
     StatusType res = AverageHighestPlayerLevelByGroup(DS, groupID, m, &level);
 
     if (res != SUCCESS) {
-        printf("AverageHighestPlayerLevelByGroup: %s\n", ReturnValToStr(res));
+        output.write("AverageHighestPlayerLevelByGroup: ").write(ReturnValToStr(res)).endLine();
         return error_free;
     }
 
-    printf("AverageHighestPlayerLevelByGroup: %.2f\n", level);
+    output.write("AverageHighestPlayerLevelByGroup: ").writeFixed(level, 2).endLine();
     return error_free;
 }
 
@@ -364,17 +382,17 @@ static errorType OnGetPlayersBound(void* DS, const char* const command) {
     int score;
     int m;
     ValidateRead(sscanf(command, "%d %d %d", &groupID, &score, &m), 3,
-                 "GetPlayersBound failed.\n");
+                 "GetPlayersBound failed.");
     int lowerBoundPlayers;
     int higherBoundPlayers;
     StatusType res = GetPlayersBound(DS, groupID, score, m, &lowerBoundPlayers, &higherBoundPlayers);
 
     if (res != SUCCESS) {
-        printf("GetPlayersBound: %s\n", ReturnValToStr(res));
+        output.write("GetPlayersBound: ").write(ReturnValToStr(res)).endLine();
         return error_free;
     }
 
-    printf("GetPlayersBound: %d %d\n", lowerBoundPlayers, higherBoundPlayers);
+    output.write("GetPlayersBound: ").writeInt(lowerBoundPlayers).writeChar(' ').writeInt(higherBoundPlayers).endLine();
 
     return error_free;
 }
@@ -385,12 +403,12 @@ static errorType OnGetPlayersBound(void* DS, const char* const command) {
 static errorType OnQuit(void** DS, const char* const command) {
     Quit(DS);
     if (*DS != NULL) {
-        printf("Quit failed.\n");
+        output.write("Quit failed.").endLine();
         return error;
     };
 
     isInit = false;
-    printf("Quit done.\n");
+    output.write("Quit done.").endLine();
 
     return error_free;
 }
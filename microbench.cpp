@@ -0,0 +1,524 @@
+/*
+ * Microbenchmarks of SumTree and PlayersHashTable in isolation (no GameSystem around them).
+ *
+ * For every size (powers of ten from --min-size to --max-size) and every key distribution
+ * (uniform, zipf, sequential) each operation is timed over a whole batch and reported as ns/op,
+ * together with an estimate of the bytes each operation touches: the nodes on its root-to-leaf
+ * path(s) for the tree, the bucket plus the expected chain for the hash table. That estimate is
+ * a proxy for cache misses, not a measurement. SumTree runs three times: as is, with every level in
+ * nodes ("SumTree nodes only", no dense counts for the low levels), and with nothing but 32-bit level
+ * sums ("SumTree 32-bit totals"), for what the 64-bit sums and the sums of squares cost.
+ *
+ * LevelSketch is benchmarked against the exact SumTree answers instead: for every precision, the
+ * latency of both and the error of the sketch (see benchLevelSketch for how each error is measured).
+ *
+ * Small groups are benchmarked as many trees of a few players each, for group sizes around the point
+ * where SumTree moves from its sorted array to nodes: the bytes per group and the latency of each
+ * operation, per player or query.
+ *
+ * Output is one JSON object per line.
+ *
+ * Usage: microbench [--min-size N] [--max-size N] [--queries Q] [--zipf-exponent S] [--seed X]
+ */
+
+#include "SumTree.hpp"
+#include "PlayersHashTable.hpp"
+#include "LevelSketch.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+enum Distribution { UNIFORM, ZIPF, SEQUENTIAL };
+static const char* const distributionNames[] = { "uniform", "zipf", "sequential" };
+
+struct Config
+{
+    long minSize = 1000;
+    long maxSize = 1000000;
+    long queries = 1000000;
+    double zipfExponent = 1.0;
+    unsigned seed = 1;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedNs(Clock::time_point start)
+{
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+/*
+ * Values in [1, range] with P(x) proportional to x^-exponent, sampled by inverting the continuous
+ * approximation of the CDF (no tables, so it works for any range).
+ */
+class ZipfGenerator
+{
+private:
+    double range;
+    double exponent;
+    std::uniform_real_distribution<double> unit;
+
+public:
+    ZipfGenerator(long range, double exponent) : range((double)range), exponent(exponent), unit(0, 1) {}
+
+    template <class R>
+    long operator()(R& random)
+    {
+        double u = unit(random), x;
+        if (std::fabs(exponent - 1.0) < 1e-9)
+        {
+            x = std::exp(u * std::log(range + 1));
+        }
+        else
+        {
+            double power = 1.0 - exponent;
+            x = std::pow(u * (std::pow(range + 1, power) - 1) + 1, 1.0 / power);
+        }
+        long value = (long)x;
+        return value < 1 ? 1 : (value > (long)range ? (long)range : value);
+    }
+};
+
+static void generateKeys(Distribution distribution, long size, const Config& config, std::mt19937_64& random,
+                         std::vector<int>& keys)
+{
+    keys.resize(size);
+    std::uniform_int_distribution<int> uniform(1, size > 1 ? (int)std::min(size, (long)1 << 30) : 1);
+    ZipfGenerator zipf(size, config.zipfExponent);
+    for (long i = 0; i < size; ++i)
+    {
+        switch (distribution)
+        {
+            case UNIFORM: keys[i] = uniform(random); break;
+            case ZIPF: keys[i] = (int)zipf(random); break;
+            case SEQUENTIAL: keys[i] = (int)(i + 1); break;
+        }
+    }
+}
+
+static void report(const char* structure, const char* operation, Distribution distribution, long size,
+                   long ops, double ns, double bytesPerOp)
+{
+    printf("{\"structure\": \"%s\", \"op\": \"%s\", \"distribution\": \"%s\", \"size\": %ld, \"ops\": %ld, "
+           "\"ns_per_op\": %.2f, \"bytes_touched_per_op\": %.1f}\n",
+           structure, operation, distributionNames[distribution], size, ops, ops > 0 ? ns / ops : 0.0, bytesPerOp);
+    fflush(stdout);
+}
+
+//Keeps the optimizer from dropping query results.
+static volatile long sink;
+
+template <class Tree>
+static void benchSumTree(const char* name, Distribution distribution, long size, const Config& config,
+                         std::mt19937_64& random, int denseLimit)
+{
+    typedef typename Tree::Node Node;
+    std::vector<int> levels;
+    generateKeys(distribution, size, config, random, levels);
+    double pathBytes;
+
+    //addNode
+    Tree tree(denseLimit);
+    Clock::time_point start = Clock::now();
+    for (long i = 0; i < size; ++i)
+    {
+        tree.addNode(levels[i]);
+    }
+    double ns = elapsedNs(start);
+    pathBytes = (double)(tree.getHeight() + 1) * sizeof(Node);
+    report(name, "addNode", distribution, size, size, ns, pathBytes);
+
+    long queries = std::min(config.queries, size);
+    std::uniform_int_distribution<int> level(1, levels.empty() ? 1 : *std::max_element(levels.begin(), levels.end()));
+
+    //countInRange: a shared descent that splits into one half-path per bound.
+    std::vector<int> bounds(2 * queries);
+    for (long i = 0; i < 2 * queries; i += 2)
+    {
+        int a = level(random), b = level(random);
+        bounds[i] = std::min(a, b);
+        bounds[i + 1] = std::max(a, b);
+    }
+    long total = 0;
+    start = Clock::now();
+    for (long i = 0; i < 2 * queries; i += 2)
+    {
+        total += tree.countInRange(bounds[i], bounds[i + 1]);
+    }
+    ns = elapsedNs(start);
+    sink = total;
+    report(name, "countInRange", distribution, size, queries, ns, 2 * pathBytes);
+
+    //sumLevelOfTopM
+    std::uniform_int_distribution<int> m(1, tree.getPlayerCount());
+    std::vector<int> ms(queries);
+    for (long i = 0; i < queries; ++i)
+    {
+        ms[i] = m(random);
+    }
+    start = Clock::now();
+    for (long i = 0; i < queries; ++i)
+    {
+        total += tree.sumLevelOfTopM(ms[i]);
+    }
+    ns = elapsedNs(start);
+    sink = total;
+    report(name, "sumLevelOfTopM", distribution, size, queries, ns, pathBytes);
+
+    //removeNode, in an order unrelated to the insertion order.
+    std::vector<int> order(levels);
+    std::shuffle(order.begin(), order.end(), random);
+    start = Clock::now();
+    for (long i = 0; i < size; ++i)
+    {
+        tree.removeNode(order[i]);
+    }
+    ns = elapsedNs(start);
+    report(name, "removeNode", distribution, size, size, ns, pathBytes);
+
+    //mergeTrees of two halves; reported per element.
+    Tree first(denseLimit), second(denseLimit);
+    for (long i = 0; i < size; ++i)
+    {
+        (i % 2 == 0 ? first : second).addNode(levels[i]);
+    }
+    long nodes = first.getSize() + second.getSize();
+    start = Clock::now();
+    Tree* merged = Tree::mergeTrees(first, second);
+    ns = elapsedNs(start);
+    //Each node is read once, written once, and passes through three int array pairs.
+    report(name, "mergeTrees", distribution, size, size, ns,
+           nodes == 0 ? 0 : (double)nodes * (2 * sizeof(Node) + 6 * sizeof(int)) / size);
+    delete merged;
+}
+
+static void reportGroups(const char* operation, Distribution distribution, int groupSize, const char* layout,
+                         long ops, double ns, double bytesPerGroup)
+{
+    printf("{\"structure\": \"SumTree groups\", \"op\": \"%s\", \"distribution\": \"%s\", \"group_size\": %d, "
+           "\"layout\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.2f, \"bytes_per_group\": %.1f}\n",
+           operation, distributionNames[distribution], groupSize, layout, ops, ops > 0 ? ns / ops : 0.0, bytesPerGroup);
+    fflush(stdout);
+}
+
+/*
+ * About config.queries players in groups of groupSize, levels drawn over [1, 1000] (so a group of n players has
+ * about min(n, 1000) levels): adding them, querying every group in turn, and merging the groups in pairs.
+ */
+static void benchSmallGroups(Distribution distribution, int groupSize, const Config& config, std::mt19937_64& random)
+{
+    long groupCount = std::max(1L, std::min(config.queries, 1L << 20) / groupSize);
+    std::vector<int> levels;
+    generateKeys(distribution, 1000, config, random, levels); //Zipf and sequential over 1000 levels.
+    std::uniform_int_distribution<int> pick(0, (int)levels.size() - 1);
+    std::vector<int> added(groupCount * groupSize);
+    for (long i = 0; i < (long)added.size(); ++i)
+    {
+        added[i] = distribution == SEQUENTIAL ? (int)(i % groupSize + 1) : levels[pick(random)];
+    }
+
+    std::vector<SumTree> groups(groupCount);
+    Clock::time_point start = Clock::now();
+    for (long i = 0; i < (long)added.size(); ++i)
+    {
+        groups[i / groupSize].addNode(added[i]);
+    }
+    double ns = elapsedNs(start);
+
+    double bytes = 0;
+    for (const SumTree& group : groups)
+    {
+        bytes += sizeof(SumTree) + (double)group.getNodeCapacity() * sizeof(SumTreeNode)
+            + (double)group.getSmallCapacity() * sizeof(SumTree::LevelCount) + (double)group.getDenseSize();
+    }
+    bytes /= groupCount;
+    const char* layout = groups[0].getSmallCount() > 0 ? "array" : "tree";
+    reportGroups("addNode", distribution, groupSize, layout, (long)added.size(), ns, bytes);
+
+    long total = 0;
+    std::uniform_int_distribution<int> level(1, 1000), m(1, groupSize);
+    std::vector<int> args(3 * groupCount);
+    for (long i = 0; i < groupCount; ++i)
+    {
+        int a = level(random), b = level(random);
+        args[3 * i] = std::min(a, b);
+        args[3 * i + 1] = std::max(a, b);
+        args[3 * i + 2] = m(random);
+    }
+    start = Clock::now();
+    for (long i = 0; i < groupCount; ++i)
+    {
+        total += groups[i].countInRange(args[3 * i], args[3 * i + 1]);
+    }
+    ns = elapsedNs(start);
+    reportGroups("countInRange", distribution, groupSize, layout, groupCount, ns, bytes);
+
+    start = Clock::now();
+    for (long i = 0; i < groupCount; ++i)
+    {
+        total += groups[i].sumLevelOfTopM(args[3 * i + 2]);
+    }
+    ns = elapsedNs(start);
+    sink = total;
+    reportGroups("sumLevelOfTopM", distribution, groupSize, layout, groupCount, ns, bytes);
+
+    //mergeTrees of neighbours; reported per merge.
+    std::vector<SumTree*> merged;
+    start = Clock::now();
+    for (long i = 0; i + 1 < groupCount; i += 2)
+    {
+        merged.push_back(SumTree::mergeTrees(groups[i], groups[i + 1]));
+    }
+    ns = elapsedNs(start);
+    reportGroups("mergeTrees", distribution, groupSize, layout, (long)merged.size(), ns, bytes);
+    for (SumTree* tree : merged)
+    {
+        delete tree;
+    }
+}
+
+static void reportSketch(const char* query, Distribution distribution, long size, int bits, const LevelSketch& sketch,
+                         long ops, double exactNs, double sketchNs, double meanError, double maxError)
+{
+    printf("{\"structure\": \"LevelSketch\", \"op\": \"%s\", \"distribution\": \"%s\", \"size\": %ld, "
+           "\"sub_bucket_bits\": %d, \"epsilon\": %g, \"sketch_bytes\": %zu, \"ops\": %ld, "
+           "\"exact_ns_per_op\": ", query, distributionNames[distribution], size, bits, sketch.getEpsilon(),
+           sketch.getMemorySize(), ops);
+    if (exactNs < 0)
+    {
+        printf("null");
+    }
+    else
+    {
+        printf("%.2f", exactNs / ops);
+    }
+    printf(", \"sketch_ns_per_op\": %.2f, \"mean_error\": %.6f, \"max_error\": %.6f}\n",
+           sketchNs / ops, meanError / ops, maxError);
+    fflush(stdout);
+}
+
+/*
+ * Errors: countInRange in players, relative to the size; levelAtPercentile relative to the exact level
+ * (there is no SumTree query for it, so it has no exact latency); sumOfTopM relative to the exact sum.
+ * The exact percentiles and sums come from the sorted levels.
+ */
+static void benchLevelSketch(Distribution distribution, long size, const Config& config, std::mt19937_64& random)
+{
+    std::vector<int> levels;
+    generateKeys(distribution, size, config, random, levels);
+    SumTree tree;
+    for (long i = 0; i < size; ++i)
+    {
+        tree.addNode(levels[i]);
+    }
+    std::vector<int> sorted(levels);
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<long long> topSums(size + 1, 0); //topSums[m] is the sum of the m highest levels.
+    for (long i = 1; i <= size; ++i)
+    {
+        topSums[i] = topSums[i - 1] + sorted[size - i];
+    }
+
+    long queries = std::min(config.queries, size);
+    std::uniform_int_distribution<int> level(1, sorted.back());
+    std::uniform_int_distribution<int> m(1, (int)size);
+    std::uniform_real_distribution<double> percent(0, 100);
+    std::vector<int> bounds(2 * queries), ms(queries);
+    std::vector<double> percentiles(queries);
+    for (long i = 0; i < queries; ++i)
+    {
+        int a = level(random), b = level(random);
+        bounds[2 * i] = std::min(a, b);
+        bounds[2 * i + 1] = std::max(a, b);
+        ms[i] = m(random);
+        percentiles[i] = 100 - percent(random); //(0, 100]
+    }
+
+    //The exact answers and their latency don't depend on the precision.
+    std::vector<int> exactCounts(queries);
+    long total = 0;
+    Clock::time_point start = Clock::now();
+    for (long i = 0; i < queries; ++i)
+    {
+        exactCounts[i] = tree.countInRange(bounds[2 * i], bounds[2 * i + 1]);
+    }
+    double exactCountNs = elapsedNs(start);
+    start = Clock::now();
+    for (long i = 0; i < queries; ++i)
+    {
+        total += tree.sumLevelOfTopM(ms[i]);
+    }
+    double exactSumNs = elapsedNs(start);
+    sink = total;
+
+    const int precisions[] = { 2, 3, 4, 5, 6, 8, 10 };
+    for (int bits : precisions)
+    {
+        LevelSketch sketch(bits);
+        for (long i = 0; i < size; ++i)
+        {
+            sketch.add(levels[i]);
+        }
+
+        std::vector<double> answers(queries);
+        start = Clock::now();
+        for (long i = 0; i < queries; ++i)
+        {
+            answers[i] = sketch.countInRange(bounds[2 * i], bounds[2 * i + 1]);
+        }
+        double ns = elapsedNs(start);
+        double meanError = 0, maxError = 0;
+        for (long i = 0; i < queries; ++i)
+        {
+            double error = std::fabs(answers[i] - exactCounts[i]) / size;
+            meanError += error;
+            maxError = std::max(maxError, error);
+        }
+        reportSketch("countInRange", distribution, size, bits, sketch, queries, exactCountNs, ns, meanError, maxError);
+
+        start = Clock::now();
+        for (long i = 0; i < queries; ++i)
+        {
+            answers[i] = sketch.levelAtPercentile(percentiles[i]);
+        }
+        ns = elapsedNs(start);
+        meanError = maxError = 0;
+        for (long i = 0; i < queries; ++i)
+        {
+            long rank = std::max(1L, (long)std::ceil(percentiles[i] / 100 * size));
+            double exact = sorted[std::min(rank, size) - 1];
+            double error = std::fabs(answers[i] - exact) / std::max(exact, 1.0);
+            meanError += error;
+            maxError = std::max(maxError, error);
+        }
+        reportSketch("levelAtPercentile", distribution, size, bits, sketch, queries, -1, ns, meanError, maxError);
+
+        start = Clock::now();
+        for (long i = 0; i < queries; ++i)
+        {
+            answers[i] = sketch.sumOfTopM(ms[i]);
+        }
+        ns = elapsedNs(start);
+        meanError = maxError = 0;
+        for (long i = 0; i < queries; ++i)
+        {
+            double exact = (double)topSums[ms[i]];
+            double error = std::fabs(answers[i] - exact) / std::max(exact, 1.0);
+            meanError += error;
+            maxError = std::max(maxError, error);
+        }
+        reportSketch("sumOfTopM", distribution, size, bits, sketch, queries, exactSumNs, ns, meanError, maxError);
+    }
+}
+
+static void benchHashTable(Distribution distribution, long size, const Config& config, std::mt19937_64& random)
+{
+    //IDs must be distinct: sequential IDs, or a random permutation spread over the ID space for
+    //the other two. For zipf the skew is in the lookups, which hit popular players far more often.
+    std::vector<int> ids(size);
+    long stride = distribution == SEQUENTIAL ? 1 : 7919;
+    for (long i = 0; i < size; ++i)
+    {
+        ids[i] = (int)(i * stride % 2147483629L) + 1;
+    }
+    if (distribution != SEQUENTIAL)
+    {
+        std::shuffle(ids.begin(), ids.end(), random);
+    }
+
+    PlayersHashTable table;
+    Clock::time_point start = Clock::now();
+    for (long i = 0; i < size; ++i)
+    {
+        table.insert(Player(ids[i], 1, 1));
+    }
+    double ns = elapsedNs(start);
+    double chain = (double)table.getPlayerCount() / table.getTableLength();
+    double lookupBytes = sizeof(void*) + chain * PlayersHashTable::getNodeSize();
+    report("PlayersHashTable", "insert", distribution, size, size, ns, lookupBytes + PlayersHashTable::getNodeSize());
+
+    long queries = std::min(config.queries, size);
+    std::vector<int> targets(queries);
+    ZipfGenerator zipf(size, config.zipfExponent);
+    std::uniform_int_distribution<long> uniform(0, size - 1);
+    for (long i = 0; i < queries; ++i)
+    {
+        long index = distribution == ZIPF ? zipf(random) - 1 : (distribution == UNIFORM ? uniform(random) : i);
+        targets[i] = ids[index];
+    }
+    long total = 0;
+    start = Clock::now();
+    for (long i = 0; i < queries; ++i)
+    {
+        total += table.search(targets[i]).getScore();
+    }
+    ns = elapsedNs(start);
+    sink = total;
+    report("PlayersHashTable", "search", distribution, size, queries, ns, lookupBytes);
+
+    if (distribution != SEQUENTIAL)
+    {
+        std::shuffle(ids.begin(), ids.end(), random);
+    }
+    start = Clock::now();
+    for (long i = 0; i < size; ++i)
+    {
+        table.remove(ids[i]);
+    }
+    ns = elapsedNs(start);
+    report("PlayersHashTable", "remove", distribution, size, size, ns, lookupBytes);
+}
+
+int main(int argc, const char** argv)
+{
+    Config config;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *flag = argv[i], *value = argv[i + 1];
+        if (strcmp(flag, "--min-size") == 0) config.minSize = atol(value);
+        else if (strcmp(flag, "--max-size") == 0) config.maxSize = atol(value);
+        else if (strcmp(flag, "--queries") == 0) config.queries = atol(value);
+        else if (strcmp(flag, "--zipf-exponent") == 0) config.zipfExponent = atof(value);
+        else if (strcmp(flag, "--seed") == 0) config.seed = (unsigned)atol(value);
+        else
+        {
+            fprintf(stderr, "microbench: unknown flag %s\n", flag);
+            return 1;
+        }
+    }
+    if (config.minSize <= 0 || config.maxSize > 100000000L || config.queries <= 0)
+    {
+        fprintf(stderr, "microbench: sizes must be in [1, 1e8] and queries positive.\n");
+        return 1;
+    }
+
+    std::mt19937_64 random(config.seed);
+    for (long size = config.minSize; size <= config.maxSize; size *= 10)
+    {
+        for (int distribution = UNIFORM; distribution <= SEQUENTIAL; ++distribution)
+        {
+            benchSumTree<SumTree>("SumTree", (Distribution)distribution, size, config, random,
+                                  SumTree::defaultDenseLimit);
+            benchSumTree<SumTree>("SumTree nodes only", (Distribution)distribution, size, config, random, 1);
+            benchSumTree<BasicSumTree<int, int, LevelSum<int> > >("SumTree 32-bit totals", (Distribution)distribution,
+                                                                  size, config, random, SumTree::defaultDenseLimit);
+            benchHashTable((Distribution)distribution, size, config, random);
+            benchLevelSketch((Distribution)distribution, size, config, random);
+        }
+    }
+    static const int groupSizes[] = { 4, 16, 32, 64, 256, 1024 };
+    for (int groupSize : groupSizes)
+    {
+        for (int distribution = UNIFORM; distribution <= SEQUENTIAL; ++distribution)
+        {
+            benchSmallGroups((Distribution)distribution, groupSize, config, random);
+        }
+    }
+    return 0;
+}
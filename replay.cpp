@@ -0,0 +1,74 @@
+/*
+ * Replays a binary command trace (see CommandProtocol.hpp) against library2, a batch of commands
+ * at a time, and prints the results either as main2.cpp would or as a binary result stream.
+ *
+ * Usage: replay [--binary-output] [trace.bin]  (defaults to stdin)
+ */
+
+#include "CommandProtocol.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+static const int batchSize = 4096;
+
+int main(int argc, const char** argv)
+{
+    bool binaryOutput = false;
+    const char* path = nullptr;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--binary-output") == 0)
+        {
+            binaryOutput = true;
+        }
+        else
+        {
+            path = argv[i];
+        }
+    }
+
+    FILE* in = path != nullptr ? fopen(path, "rb") : stdin;
+    if (in == nullptr || !CommandProtocol::readHeader(in, CommandProtocol::commandsMagic))
+    {
+        fprintf(stderr, "replay: missing or unrecognized trace.\n");
+        return 1;
+    }
+
+    static CommandProtocol::BinaryCommand commands[batchSize];
+    static CommandProtocol::BinaryResult results[batchSize];
+    OutputWriter output;
+    if (binaryOutput)
+    {
+        CommandProtocol::writeHeader(stdout, CommandProtocol::resultsMagic);
+    }
+
+    void* DS = nullptr;
+    bool stopped = false;
+    size_t read;
+    while (!stopped && (read = fread(commands, sizeof(commands[0]), batchSize, in)) > 0)
+    {
+        int executed = CommandProtocol::executeBatch(&DS, commands, (int)read, results);
+        stopped = executed > 0 && CommandProtocol::isFatal(results[executed - 1]);
+
+        if (binaryOutput)
+        {
+            output.write((const char*)results, executed * sizeof(results[0]));
+        }
+        else
+        {
+            for (int i = 0; i < executed; ++i)
+            {
+                CommandProtocol::writeTextResult(output, results[i]);
+            }
+        }
+    }
+    output.flush();
+
+    if (DS != nullptr)
+    {
+        Quit(&DS);
+    }
+    if (in != stdin) fclose(in);
+    return 0;
+}
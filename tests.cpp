@@ -0,0 +1,318 @@
+/*
+ * Regression tests for library2, run by ctest. Each test builds its own system through the C API and
+ * checks what it answers; a failed check prints where it was and the run exits with 1.
+ */
+
+#include "library2.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+static int failures = 0;
+
+//Fault injection: the allocation failAt from now (counting from 0) throws, once, or with keepFailing along
+//with every one after it until failing is reset. Negative: none does.
+static long failAt = -1;
+static bool keepFailing = false, failing = false;
+
+void* operator new(std::size_t size)
+{
+    if (failing || (failAt >= 0 && failAt-- == 0))
+    {
+        failing = keepFailing;
+        throw std::bad_alloc();
+    }
+    void* memory = std::malloc(size == 0 ? 1 : size);
+    if (memory == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            ++failures; \
+        } \
+    } while (0)
+
+static bool near(double value, double expected)
+{
+    return std::fabs(value - expected) <= 1e-9 * std::fabs(expected) + 1e-9;
+}
+
+//Adds players first, first + 1, ..., count of them, to group at score, all at level.
+static void addAtLevel(void* DS, int first, int count, int group, int score, int level)
+{
+    for (int id = first; id < first + count; ++id)
+    {
+        AddPlayer(DS, id, group, score);
+        if (level > 0) IncreasePlayerIDLevel(DS, id, level);
+    }
+}
+
+//Levels high enough that their squares add up past 64 bits.
+static void testLevelStatsHighLevels()
+{
+    void* DS = Init(2, 5);
+    const int count = 100000, level = 10000000;
+    addAtLevel(DS, 1, count, 1, 1, level);
+
+    int players;
+    double mean, variance;
+    CHECK(GetLevelStats(DS, 0, 0, 0, 0, 2000000000, &players, &mean, &variance) == SUCCESS);
+    CHECK(players == count && near(mean, level) && variance == 0);
+
+    addAtLevel(DS, count + 1, count, 2, 2, 2 * level);
+    CHECK(GetLevelStats(DS, 0, 0, 0, 0, 2000000000, &players, &mean, &variance) == SUCCESS);
+    CHECK(players == 2 * count && near(mean, 1.5 * level) && near(variance, 0.25 * level * (double)level));
+
+    //Removals come off the sum of squares exactly, however far past 64 bits it went.
+    for (int id = count + 1; id <= 2 * count; ++id)
+    {
+        RemovePlayer(DS, id);
+    }
+    CHECK(GetLevelStats(DS, 0, 0, 0, 0, 2000000000, &players, &mean, &variance) == SUCCESS);
+    CHECK(players == count && near(mean, level) && variance == 0);
+
+    //By score band and within a group.
+    CHECK(GetLevelStats(DS, 1, 1, 1, level, level, &players, &mean, &variance) == SUCCESS);
+    CHECK(players == count && near(mean, level) && variance == 0);
+    Quit(&DS);
+}
+
+//Too many levels too far apart to tell the sum of squares: FAILURE, not garbage.
+static void testLevelStatsTooSpread()
+{
+    void* DS = Init(1, 5);
+    const int count = 50000, level = 2000000000;
+    addAtLevel(DS, 1, count, 1, 1, level);
+    addAtLevel(DS, count + 1, count, 1, 1, 0);
+
+    int players;
+    double mean, variance;
+    CHECK(GetLevelStats(DS, 0, 0, 0, 0, level, &players, &mean, &variance) == FAILURE);
+    CHECK(GetLevelStats(DS, 0, 0, 0, 1, level, &players, &mean, &variance) == SUCCESS);
+    CHECK(players == count && near(mean, level) && variance == 0);
+
+    //A few far off ones still leave it exact.
+    addAtLevel(DS, 2 * count + 1, 1, 1, 1, 1);
+    CHECK(GetLevelStats(DS, 0, 0, 0, 1, level, &players, &mean, &variance) == SUCCESS);
+    double expectedMean = ((double)count * level + 1) / (count + 1);
+    double expectedVariance = ((double)count * ((double)level - expectedMean) * ((double)level - expectedMean)
+                               + (1 - expectedMean) * (1 - expectedMean)) / (count + 1);
+    CHECK(players == count + 1 && near(mean, expectedMean) && std::fabs(variance - expectedVariance) <= 1e-6 * expectedVariance);
+    Quit(&DS);
+}
+
+//What the queries say about every group and player: two systems answering the same are in the same state.
+static std::vector<double> answers(void* DS, int k, int scale, int ids)
+{
+    std::vector<double> result;
+    for (int group = 0; group <= k; ++group)
+    {
+        //The per-score trees against the all-players one.
+        int players = 0;
+        double level = 0;
+        CountPlayersWithScoreBandInBounds(DS, group, 1, scale, 0, 2000000000, &players);
+        result.push_back(players);
+        result.push_back(AverageHighestPlayerLevelByGroup(DS, group, players, &level));
+        result.push_back(level);
+        result.push_back(AverageHighestPlayerLevelByGroup(DS, group, players + 1, &level));
+        for (int score = 1; score <= scale; ++score)
+        {
+            double percent = 0;
+            GetPercentOfPlayersWithScoreInBounds(DS, group, score, 0, 2000000000, &percent);
+            result.push_back(percent);
+        }
+    }
+    for (int id = 1; id <= ids; ++id)
+    {
+        int groupRank = 0, globalRank = 0;
+        result.push_back(GetPlayerRank(DS, id, &groupRank, &globalRank));
+        result.push_back(groupRank);
+        result.push_back(globalRank);
+    }
+    return result;
+}
+
+//Player updates that run out of memory while snapshots share the trees: each changes nothing, and its
+//partner trees (all players' and the score's) stay in step, snapshots or not.
+static void testUpdatesFailingWithSnapshots()
+{
+    const int k = 3, scale = 5, count = 200;
+    auto build = [&](void** snapshots)
+    {
+        void* DS = Init(k, scale);
+        for (int id = 1; id <= count; ++id)
+        {
+            AddPlayer(DS, id, 1 + id % k, 1 + id % scale);
+            IncreasePlayerIDLevel(DS, id, 200 + (id * 37) % 1000);
+        }
+        TakeSnapshot(DS, 0, &snapshots[0]);
+        TakeSnapshot(DS, 1, &snapshots[1]);
+        return DS;
+    };
+    auto update = [&](void* DS, int kind, int variant)
+    {
+        int id = 1 + 3 * variant;
+        switch (kind)
+        {
+        case 0:
+            return AddPlayer(DS, count + 1, 1 + variant % k, 1 + variant % scale);
+        case 1:
+            return IncreasePlayerIDLevel(DS, id, 1 + 29 * variant);
+        case 2:
+            return ChangePlayerIDScore(DS, id, 1 + (7 * variant) % scale);
+        default:
+            return RemovePlayer(DS, id);
+        }
+    };
+
+    for (int kind = 0; kind < 4; ++kind)
+    {
+        for (int variant = 0; variant < 20; ++variant)
+        {
+            StatusType status = ALLOCATION_ERROR;
+            for (long failing = 0; status == ALLOCATION_ERROR; ++failing)
+            {
+                void *snapshots[2], *twinSnapshots[2];
+                void *DS = build(snapshots), *twin = build(twinSnapshots);
+                std::vector<double> before = answers(DS, k, scale, count + 1);
+                double snapshotLevel = 0, snapshotLevelAfter = 0;
+                AverageHighestPlayerLevelInSnapshot(snapshots[1], 10, &snapshotLevel);
+
+                failAt = failing;
+                status = update(DS, kind, variant);
+                failAt = -1;
+                CHECK(status == SUCCESS || status == ALLOCATION_ERROR);
+                AverageHighestPlayerLevelInSnapshot(snapshots[1], 10, &snapshotLevelAfter);
+                CHECK(snapshotLevelAfter == snapshotLevel);
+                if (status == ALLOCATION_ERROR)
+                {
+                    CHECK(answers(DS, k, scale, count + 1) == before);
+                    update(DS, kind, variant);
+                }
+                update(twin, kind, variant);
+                CHECK(answers(DS, k, scale, count + 1) == answers(twin, k, scale, count + 1));
+
+                //And the trees go on right once the snapshots are gone.
+                for (int i = 0; i < 2; ++i)
+                {
+                    ReleaseSnapshot(&snapshots[i]);
+                    ReleaseSnapshot(&twinSnapshots[i]);
+                }
+                for (int id = 2; id <= count; id += 5)
+                {
+                    IncreasePlayerIDLevel(DS, id, 5);
+                    IncreasePlayerIDLevel(twin, id, 5);
+                }
+                CHECK(answers(DS, k, scale, count + 1) == answers(twin, k, scale, count + 1));
+                Quit(&DS);
+                Quit(&twin);
+            }
+        }
+    }
+}
+
+//A commit that runs out of memory for good: undoing it needs none, so it is all taken back, snapshots or not.
+static void testCommitFailingForGood()
+{
+    const int k = 6, scale = 5, count = 150;
+    auto build = [&](void** snapshots)
+    {
+        void* DS = Init(k, scale);
+        for (int id = 1; id <= count; ++id)
+        {
+            AddPlayer(DS, id, 1 + id % k, 1 + id % scale);
+            IncreasePlayerIDLevel(DS, id, (id * 53) % 700);
+        }
+        MergeGroups(DS, 5, 6);
+        TakeSnapshot(DS, 0, &snapshots[0]);
+        TakeSnapshot(DS, 2, &snapshots[1]);
+        return DS;
+    };
+    auto queue = [&](void* DS)
+    {
+        BeginTxn(DS);
+        for (int id = 3; id <= count; id += 3)
+        {
+            IncreasePlayerIDLevel(DS, id, id % 40 + 1);
+        }
+        for (int id = 7; id <= count; id += 7)
+        {
+            ChangePlayerIDScore(DS, id, 1 + id % scale);
+        }
+        for (int id = count + 1; id <= count + 10; ++id)
+        {
+            AddPlayer(DS, id, 1 + id % k, 1 + id % scale);
+        }
+        int pairs[] = { 1, 2, 3, 2 };
+        MergeGroupsBatch(DS, pairs, 2);
+        RemovePlayer(DS, 11);
+        RemovePlayer(DS, count + 1);
+        RemoveAllPlayersInGroup(DS, 4);
+        MergeGroups(DS, 4, 5);
+        IncreasePlayerIDLevel(DS, count + 2, 300);
+        RemovePlayer(DS, 13);
+        AddPlayer(DS, 13, 4, 2);
+    };
+
+    void* snapshots[2];
+    void* twin = build(snapshots);
+    queue(twin);
+    CHECK(CommitTxn(twin) == SUCCESS);
+    std::vector<double> committed = answers(twin, k, scale, count + 10);
+    for (int i = 0; i < 2; ++i)
+    {
+        ReleaseSnapshot(&snapshots[i]);
+    }
+    Quit(&twin);
+
+    StatusType status = ALLOCATION_ERROR;
+    for (long failingAt = 0; status == ALLOCATION_ERROR; failingAt += 1 + failingAt / 20)
+    {
+        void* DS = build(snapshots);
+        std::vector<double> before = answers(DS, k, scale, count + 10);
+        queue(DS);
+        failAt = failingAt;
+        keepFailing = true;
+        status = CommitTxn(DS);
+        failAt = -1;
+        keepFailing = failing = false;
+        CHECK(status == SUCCESS || status == ALLOCATION_ERROR);
+        CHECK(answers(DS, k, scale, count + 10) == (status == SUCCESS ? committed : before));
+        for (int i = 0; i < 2; ++i)
+        {
+            ReleaseSnapshot(&snapshots[i]);
+        }
+        Quit(&DS);
+    }
+}
+
+int main()
+{
+    testLevelStatsHighLevels();
+    testLevelStatsTooSpread();
+    testUpdatesFailingWithSnapshots();
+    testCommitFailingForGood();
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "%d checks failed.\n", failures);
+        return 1;
+    }
+    printf("All tests passed.\n");
+    return 0;
+}